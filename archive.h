@@ -0,0 +1,474 @@
+//
+// archive.h
+//
+// A container holding many compressed files in one archive, with a central
+// index at the end:
+//
+//   "HUFA" version
+//   entry data       each entry's blocks back to back, as encodeBlock()
+//                    writes them
+//   index            varint block size
+//                    varint table count, then per table: varint id and its
+//                    "{k:v, ...}" text
+//                    varint entry count, then per entry: varint name length,
+//                    name, varint raw size, varint data offset, 4-byte
+//                    CRC32C of the raw bytes, varint table id (0 for none),
+//                    varint block count, then per block its varint size and
+//                    the 4-byte CRC32C of its raw bytes
+//   trailer          8-byte index offset, "HUFA"
+//
+// The trailer has a fixed size, so listing an archive reads only the trailer
+// and the index, and extracting an entry reads just that entry's blocks.
+// Every block is checked as it is decoded, so a single block read on its own
+// is checked too.
+//
+// Small entries can share a code table stored once in the index.  Their
+// blocks are TAG_DICTIONARY messages naming the table by id, the same format
+// compressWithDictionary() writes, except the table is looked up in the
+// archive rather than in a DictionaryRegistry.
+//
+// Entry names are relative paths with no empty, "." or ".." parts (see
+// archiveName()), so extracting an entry cannot write outside the current
+// directory.  An archive naming an entry any other way does not open.
+//
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "buffer.h"
+#include "checksum.h"
+#include "dictionary.h"
+#include "format.h"
+#include "mymap.h"
+#include "stream.h"
+#pragma once
+
+const char ARCHIVE_MAGIC[4] = {'H', 'U', 'F', 'A'};
+const uint8_t ARCHIVE_VERSION = 2;
+const size_t ARCHIVE_TRAILER_SIZE = 12;
+
+//
+// Turns path into the name an archive entry is stored under: relative, with
+// "." parts dropped and ".." parts resolved, and nothing climbing above the
+// top.  "/var/log/x" becomes "var/log/x" and "../a/./b" becomes "a/b".
+//
+string archiveName(const string& path) {
+  vector<string> parts;
+  size_t at = 0;
+  while (at <= path.size()) {
+    size_t end = path.find('/', at);
+    if (end == string::npos) end = path.size();
+    string part = path.substr(at, end - at);
+    if (part == "..") {
+      if (!parts.empty()) parts.pop_back();
+    } else if (!part.empty() && part != ".") {
+      parts.push_back(part);
+    }
+    at = end + 1;
+  }
+  string name;
+  for (size_t i = 0; i < parts.size(); i++) name += (i ? "/" : "") + parts[i];
+  return name;
+}
+
+// true if name is already what archiveName() would store, and not empty
+bool isArchiveName(const string& name) {
+  return !name.empty() && archiveName(name) == name;
+}
+
+struct ArchiveEntry {
+  string name;
+  uint64_t rawSize;
+  uint64_t offset;            // where the entry's first block starts
+  uint32_t checksum;          // CRC32C of the raw bytes
+  uint32_t table;             // shared table id, 0 if the blocks carry their own
+  vector<uint64_t> blockEnd;  // offset just past each block
+  vector<uint32_t> blockChecksum;  // CRC32C of each block's raw bytes
+
+  uint64_t packedSize() const {
+    return blockEnd.empty() ? 0 : blockEnd.back() - offset;
+  }
+};
+
+class ArchiveWriter {
+ public:
+  ArchiveWriter(size_t blockSize = DEFAULT_BLOCK_SIZE)
+      : blockSize(blockSize), fd(-1), offset(0), ok(false), names(BALANCE_ROTATE) {}
+
+  ~ArchiveWriter() {
+    for (size_t i = 0; i < tables.size(); i++) delete tables[i];
+    if (fd >= 0) ::close(fd);
+  }
+
+  bool open(const string& filename) {
+    fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0;
+    vector<uint8_t> head(ARCHIVE_MAGIC, ARCHIVE_MAGIC + 4);
+    head.push_back(ARCHIVE_VERSION);
+    append(head);
+    return ok;
+  }
+
+  //
+  // addTable:
+  // Stores a shared code table built from freq (see trainDictionary()) and
+  // returns its id for add(), or 0 if freq does not cover every byte.
+  //
+  uint32_t addTable(const hashmap& freq) {
+    HuffmanDictionary* table = new HuffmanDictionary(tables.size() + 1, freq);
+    if (!table->complete()) {
+      delete table;
+      return 0;
+    }
+    tables.push_back(table);
+    return table->id();
+  }
+
+  //
+  // add:
+  // Compresses len bytes at data as the entry called name.  With a table
+  // from addTable(), each block is coded with it unless its own table, a
+  // stored block or a run comes out smaller.  Returns false if name is
+  // already taken or not an archiveName(), table is unknown, or a write
+  // fails.
+  //
+  bool add(const string& name, const uint8_t* data, size_t len,
+           uint32_t table = 0) {
+    if (!beginEntry(name, table)) return false;
+    for (size_t at = 0; at < len; at += blockSize)
+      addBlock(data + at, min(blockSize, len - at));
+    return ok;
+  }
+
+  //
+  // addFile:
+  // Like add(), reading the entry from the file path a block at a time.
+  //
+  bool addFile(const string& name, const string& path, uint32_t table = 0) {
+    int fdIn = ::open(path.c_str(), O_RDONLY);
+    if (fdIn < 0 || !beginEntry(name, table)) {
+      if (fdIn >= 0) ::close(fdIn);
+      return false;
+    }
+    bool readOk;
+    {
+      BlockReader reader(fdIn, blockSize);
+      const uint8_t* data;
+      size_t len;
+      while (reader.read(data, len)) {
+        if (len > 0) addBlock(data, len);
+      }
+      readOk = !reader.failed();
+    }
+    ::close(fdIn);
+    return ok && readOk;
+  }
+
+  //
+  // close:
+  // Writes the index and trailer.  Until this succeeds the archive cannot be
+  // read.
+  //
+  bool close() {
+    if (fd < 0) return false;
+    vector<uint8_t> index;
+    uint64_t indexOffset = offset;
+    putVarint(blockSize, index);
+    putVarint(tables.size(), index);
+    for (size_t i = 0; i < tables.size(); i++) {
+      putVarint(tables[i]->id(), index);
+      tables[i]->codes().writeHeader(index);
+    }
+    putVarint(entries.size(), index);
+    for (size_t i = 0; i < entries.size(); i++) {
+      const ArchiveEntry& e = entries[i];
+      putVarint(e.name.size(), index);
+      index.insert(index.end(), e.name.begin(), e.name.end());
+      putVarint(e.rawSize, index);
+      putVarint(e.offset, index);
+      _putFixed(e.checksum, 4, index);
+      putVarint(e.table, index);
+      putVarint(e.blockEnd.size(), index);
+      uint64_t start = e.offset;
+      for (size_t b = 0; b < e.blockEnd.size(); b++) {
+        putVarint(e.blockEnd[b] - start, index);
+        _putFixed(e.blockChecksum[b], 4, index);
+        start = e.blockEnd[b];
+      }
+    }
+    _putFixed(indexOffset, 8, index);
+    index.insert(index.end(), ARCHIVE_MAGIC, ARCHIVE_MAGIC + 4);
+    append(index);
+    ok = (::close(fd) == 0) && ok;
+    fd = -1;
+    return ok;
+  }
+
+ private:
+  size_t blockSize;
+  int fd;
+  uint64_t offset;  // bytes written so far
+  bool ok;          // false once a write has failed
+  vector<HuffmanDictionary*> tables;
+  vector<ArchiveEntry> entries;
+  mymap<string, int> names;  // entry index by name, rotated so no add stalls
+  vector<uint8_t> packed;
+
+  void append(const vector<uint8_t>& bytes) {
+    if (ok) ok = _writeAll(fd, bytes.data(), bytes.size());
+    offset += bytes.size();
+  }
+
+  bool beginEntry(const string& name, uint32_t table) {
+    if (!ok || !isArchiveName(name) || names.contains(name) ||
+        table > tables.size())
+      return false;
+    names.put(name, (int)entries.size());
+    ArchiveEntry e;
+    e.name = name;
+    e.rawSize = 0;
+    e.offset = offset;
+    e.checksum = 0;
+    e.table = table;
+    entries.push_back(e);
+    return true;
+  }
+
+  void addBlock(const uint8_t* data, size_t len) {
+    ArchiveEntry& e = entries.back();
+    HuffmanContext& ctx = threadContext();
+    packed.clear();
+    encodeBlock(data, len, packed, ctx);
+    if (e.table != 0) {
+      // the shared table has no header to pay for, only the tag and id
+      const HuffmanContext& codes = tables[e.table - 1]->codes();
+      uint64_t bits = codes.codeLength(PSEUDO_EOF);
+      for (size_t i = 0; i < len; i++) bits += codes.codeLength(data[i]);
+      uint64_t size = 1 + varintSize(e.table) + (bits + 7) / 8;
+      if (size < packed.size()) {
+        packed.clear();
+        packed.push_back(TAG_DICTIONARY);
+        putVarint(e.table, packed);
+        codes.encode(data, len, packed);
+      }
+    }
+    append(packed);
+    uint32_t crc = crc32c(data, len);
+    e.rawSize += len;
+    e.checksum = crc32cCombine(e.checksum, crc, len);
+    e.blockEnd.push_back(offset);
+    e.blockChecksum.push_back(crc);
+  }
+
+  ArchiveWriter(const ArchiveWriter&) = delete;
+  ArchiveWriter& operator=(const ArchiveWriter&) = delete;
+};
+
+class ArchiveReader {
+ public:
+  ArchiveReader() : fd(-1), blockSize(0), names(BALANCE_ROTATE) {}
+
+  ~ArchiveReader() {
+    close();
+  }
+
+  //
+  // open:
+  // Reads the trailer and the index, nothing else.  Returns false if
+  // filename is not a complete archive.
+  //
+  bool open(const string& filename) {
+    close();
+    fd = ::open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    uint8_t head[5], trailer[ARCHIVE_TRAILER_SIZE];
+    if (fd < 0 || fstat(fd, &st) != 0) return fail();
+    uint64_t size = st.st_size;
+    if (size < sizeof(head) + sizeof(trailer) ||
+        pread(fd, head, sizeof(head), 0) != (ssize_t)sizeof(head) ||
+        memcmp(head, ARCHIVE_MAGIC, 4) != 0 || head[4] != ARCHIVE_VERSION ||
+        pread(fd, trailer, sizeof(trailer), size - sizeof(trailer)) !=
+            (ssize_t)sizeof(trailer) ||
+        memcmp(trailer + 8, ARCHIVE_MAGIC, 4) != 0)
+      return fail();
+    dataEnd = _getFixed(trailer, 8);
+    if (dataEnd < sizeof(head) || dataEnd > size - sizeof(trailer)) return fail();
+
+    vector<uint8_t> index(size - sizeof(trailer) - dataEnd);
+    if (pread(fd, index.data(), index.size(), dataEnd) != (ssize_t)index.size() ||
+        !parseIndex(index.data(), index.size()))
+      return fail();
+    return true;
+  }
+
+  void close() {
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+    entries.clear();
+    names.clear();
+    for (size_t i = 0; i < tables.size(); i++) delete tables[i];
+    tables.clear();
+  }
+
+  size_t size() const { return entries.size(); }
+  const ArchiveEntry& entry(size_t i) const { return entries[i]; }
+
+  // index of the entry called name, or -1
+  int find(const string& name) {
+    return names.contains(name) ? names.get(name) : -1;
+  }
+
+  //
+  // extract:
+  // Decompresses entry i into out, reading only its blocks, and checks its
+  // size and checksums.  Returns false if anything does not match.
+  //
+  bool extract(size_t i, vector<uint8_t>& out) {
+    if (i >= entries.size()) return false;
+    const ArchiveEntry& e = entries[i];
+    vector<uint8_t>& packed = threadContext().inputBuffer();
+    out.clear();
+    packed.resize(e.packedSize());
+    if (pread(fd, packed.data(), packed.size(), e.offset) != (ssize_t)packed.size())
+      return false;
+    size_t pos = 0;
+    uint32_t crc = 0;
+    for (size_t b = 0; b < e.blockEnd.size(); b++) {
+      size_t before = out.size();
+      if (!decode(packed.data(), e.blockEnd[b] - e.offset, pos, out) ||
+          pos != e.blockEnd[b] - e.offset)
+        return false;
+      // summed while the block is still in cache
+      uint32_t blockCrc = crc32c(out.data() + before, out.size() - before);
+      if (blockCrc != e.blockChecksum[b]) return false;
+      crc = crc32cCombine(crc, blockCrc, out.size() - before);
+    }
+    return out.size() == e.rawSize && crc == e.checksum;
+  }
+
+  //
+  // extractFile:
+  // Extracts entry i into a new file at its name, under the current
+  // directory, creating directories on the way.  Returns false without
+  // touching it if the file already exists.
+  //
+  bool extractFile(size_t i) {
+    vector<uint8_t>& raw = threadContext().outputBuffer();
+    if (i >= entries.size() || !extract(i, raw)) return false;
+    const string& name = entries[i].name;
+    for (size_t at = name.find('/'); at != string::npos;
+         at = name.find('/', at + 1))
+      mkdir(name.substr(0, at).c_str(), 0755);
+    int fdOut = ::open(name.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fdOut < 0) return false;
+    bool ok = _writeAll(fdOut, raw.data(), raw.size());
+    ok = (::close(fdOut) == 0) && ok;
+    if (!ok) unlink(name.c_str());
+    return ok;
+  }
+
+  //
+  // verify:
+  // Does everything extract() does for entry i, and throws the bytes away.
+  //
+  bool verify(size_t i) {
+    return extract(i, threadContext().outputBuffer());
+  }
+
+  //
+  // extractBlock:
+  // Decompresses block b of entry i alone, appending it to out, for reading
+  // a part of a large entry.  Every block but the last holds exactly the
+  // archive's block size.
+  //
+  bool extractBlock(size_t i, size_t b, vector<uint8_t>& out) {
+    if (i >= entries.size() || b >= entries[i].blockEnd.size()) return false;
+    const ArchiveEntry& e = entries[i];
+    uint64_t start = (b == 0) ? e.offset : e.blockEnd[b - 1];
+    vector<uint8_t>& packed = threadContext().inputBuffer();
+    packed.resize(e.blockEnd[b] - start);
+    if (pread(fd, packed.data(), packed.size(), start) != (ssize_t)packed.size())
+      return false;
+    size_t pos = 0, before = out.size();
+    uint64_t expected = min((uint64_t)blockSize, e.rawSize - b * blockSize);
+    return decode(packed.data(), packed.size(), pos, out) &&
+           pos == packed.size() && out.size() - before == expected &&
+           crc32c(out.data() + before, expected) == e.blockChecksum[b];
+  }
+
+ private:
+  int fd;
+  uint64_t blockSize;
+  uint64_t dataEnd;  // where the entry data stops and the index begins
+  vector<HuffmanDictionary*> tables;
+  vector<ArchiveEntry> entries;
+  mymap<string, int> names;
+
+  bool fail() {
+    close();
+    return false;
+  }
+
+  bool decode(const uint8_t* data, size_t len, size_t& pos, vector<uint8_t>& out) {
+    if (pos >= len || data[pos] != TAG_DICTIONARY)
+      return decodeBlock(data, len, pos, out, threadContext());
+    uint64_t id;
+    pos++;
+    if (!getVarint(data, len, pos, id) || id == 0 || id > tables.size())
+      return false;
+    return tables[id - 1]->codes().decode(data, len, pos, out);
+  }
+
+  bool parseIndex(const uint8_t* data, size_t len) {
+    size_t pos = 0;
+    uint64_t n, id;
+    if (!getVarint(data, len, pos, blockSize) || blockSize == 0) return false;
+    if (!getVarint(data, len, pos, n)) return false;
+    for (uint64_t i = 0; i < n; i++) {
+      if (!getVarint(data, len, pos, id) || id != i + 1) return false;
+      tables.push_back(new HuffmanDictionary(id));
+      if (!tables.back()->read(data, len, pos)) return false;
+    }
+
+    if (!getVarint(data, len, pos, n)) return false;
+    for (uint64_t i = 0; i < n; i++) {
+      ArchiveEntry e;
+      uint64_t nameLen, table, nBlocks, blockLen;
+      if (!getVarint(data, len, pos, nameLen) || nameLen > len - pos) return false;
+      e.name.assign((const char*)data + pos, nameLen);
+      pos += nameLen;
+      if (!isArchiveName(e.name)) return false;
+      if (!getVarint(data, len, pos, e.rawSize) ||
+          !getVarint(data, len, pos, e.offset) || len - pos < 4)
+        return false;
+      e.checksum = (uint32_t)_getFixed(data + pos, 4);
+      pos += 4;
+      if (!getVarint(data, len, pos, table) || table > tables.size() ||
+          !getVarint(data, len, pos, nBlocks) ||
+          nBlocks != (e.rawSize + blockSize - 1) / blockSize)
+        return false;
+      e.table = (uint32_t)table;
+      if (e.offset > dataEnd || names.contains(e.name)) return false;
+      uint64_t end = e.offset;
+      for (uint64_t b = 0; b < nBlocks; b++) {
+        if (!getVarint(data, len, pos, blockLen) || blockLen > dataEnd - end ||
+            len - pos < 4)
+          return false;
+        end += blockLen;
+        e.blockEnd.push_back(end);
+        e.blockChecksum.push_back((uint32_t)_getFixed(data + pos, 4));
+        pos += 4;
+      }
+      names.put(e.name, (int)entries.size());
+      entries.push_back(e);
+    }
+    return pos == len;
+  }
+
+  ArchiveReader(const ArchiveReader&) = delete;
+  ArchiveReader& operator=(const ArchiveReader&) = delete;
+};
@@ -0,0 +1,251 @@
+//
+// batch.h
+//
+// Compresses or decompresses many files in one process on a work-stealing
+// pool.  Files are scheduled largest first.  A file bigger than one block is
+// split into per-block tasks; small files are grouped so each task has about
+// a block's worth of work.  Every input "name" becomes "name.huf", with the
+// same contents compress() would write.
+//
+// A split file is read through one descriptor and written through another.
+// Coded blocks are written in order as soon as the ones before them are, and
+// no more than BATCH_WINDOW blocks per thread are read ahead of the writes,
+// so a file of any size takes a bounded amount of memory.
+//
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "scheduler.h"
+#include "util.h"
+#pragma once
+
+// blocks of one split file in flight at a time, per pool thread
+const int BATCH_WINDOW = 2;
+
+struct FileStats {
+  string name;
+  uint64_t bytesIn;
+  uint64_t bytesOut;
+  double seconds;
+  bool ok;
+};
+
+struct BatchOptions {
+  int threads;
+  size_t blockSize;
+  bool decompress;  // turn "name.huf" back into "name"
+
+  BatchOptions()
+      : threads(max(1, (int)thread::hardware_concurrency())),
+        blockSize(DEFAULT_BLOCK_SIZE),
+        decompress(false) {}
+};
+
+//
+// Lists the regular files directly inside dir, skipping ".huf" files when
+// compressing and everything else when decompressing.
+//
+vector<string> listDirectory(const string& dir, bool compressed) {
+  vector<string> files;
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr) return files;
+  while (struct dirent* e = readdir(d)) {
+    string path = dir + "/" + e->d_name;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+    bool isHuf = path.size() > 4 && path.compare(path.size() - 4, 4, ".huf") == 0;
+    if (isHuf == compressed) files.push_back(path);
+  }
+  closedir(d);
+  return files;
+}
+
+class BatchJob {
+ public:
+  BatchJob(const vector<string>& files, const BatchOptions& opt)
+      : opt(opt), stats(files.size()) {
+    for (size_t i = 0; i < files.size(); i++) {
+      struct stat st;
+      stats[i].name = files[i];
+      stats[i].bytesIn = (stat(files[i].c_str(), &st) == 0) ? st.st_size : 0;
+      stats[i].bytesOut = 0;
+      stats[i].seconds = 0;
+      stats[i].ok = false;
+    }
+  }
+
+  vector<FileStats> run() {
+    vector<size_t> order(stats.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+      return stats[a].bytesIn > stats[b].bytesIn;
+    });
+
+    WorkStealingPool pool(opt.threads);
+    vector<size_t> group;
+    size_t groupBytes = 0;
+    for (size_t k = 0; k < order.size(); k++) {
+      size_t i = order[k];
+      if (!opt.decompress && stats[i].bytesIn > opt.blockSize) {
+        splitFile(pool, i);
+        continue;
+      }
+      group.push_back(i);
+      groupBytes += stats[i].bytesIn;
+      if (groupBytes >= opt.blockSize) {
+        submitGroup(pool, group);
+        group.clear();
+        groupBytes = 0;
+      }
+    }
+    if (!group.empty()) submitGroup(pool, group);
+    pool.wait();
+    return stats;
+  }
+
+ private:
+  typedef chrono::steady_clock Clock;
+
+  // one large file being coded a block per task
+  struct SplitFile {
+    size_t index;
+    int fdIn, fdOut;
+    size_t nBlocks;
+    mutex m;                              // guards everything below
+    map<size_t, vector<uint8_t> > coded;  // blocks waiting for the ones before
+    size_t nextSubmit, nextWrite;
+    bool writing;                         // a thread is writing blocks out
+    bool failed;
+    uint64_t bytesOut;
+    Clock::time_point start;
+  };
+
+  BatchOptions opt;
+  vector<FileStats> stats;
+
+  static double since(Clock::time_point start) {
+    return chrono::duration<double>(Clock::now() - start).count();
+  }
+
+  void submitGroup(WorkStealingPool& pool, vector<size_t> group) {
+    pool.submit([this, group] {
+      for (size_t k = 0; k < group.size(); k++) codeWholeFile(group[k]);
+    });
+  }
+
+  void codeWholeFile(size_t i) {
+    Clock::time_point start = Clock::now();
+    HuffmanContext& ctx = threadContext();
+    vector<uint8_t>& in = ctx.inputBuffer();
+    vector<uint8_t>& out = ctx.outputBuffer();
+    const string& name = stats[i].name;
+    bool isHuf = name.size() > 4 && name.compare(name.size() - 4, 4, ".huf") == 0;
+    string ofname = opt.decompress ? name.substr(0, name.size() - 4) : name + ".huf";
+    bool ok = (isHuf || !opt.decompress) && _readFile(name, in);
+    if (ok && opt.decompress) {
+      ok = decompressBuffer(in.data(), in.size(), out, ctx);
+    } else if (ok) {
+      // the same blocks compressStream() would produce
+      out.clear();
+      size_t at = 0;
+      do {
+        size_t n = min(opt.blockSize, in.size() - at);
+        encodeBlock(in.data() + at, n, out, ctx);
+        at += n;
+      } while (at < in.size());
+    }
+    ok = ok && _writeFile(ofname, out);
+    stats[i].bytesOut = ok ? out.size() : 0;
+    stats[i].seconds = since(start);
+    stats[i].ok = ok;
+  }
+
+  void splitFile(WorkStealingPool& pool, size_t i) {
+    shared_ptr<SplitFile> job(new SplitFile);
+    const string& name = stats[i].name;
+    job->index = i;
+    job->nBlocks = (stats[i].bytesIn + opt.blockSize - 1) / opt.blockSize;
+    job->nextSubmit = job->nextWrite = 0;
+    job->writing = job->failed = false;
+    job->bytesOut = 0;
+    job->start = Clock::now();
+    job->fdIn = open(name.c_str(), O_RDONLY);
+    job->fdOut = (job->fdIn < 0) ? -1 : open((name + ".huf").c_str(),
+                                             O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (job->fdOut < 0) {
+      if (job->fdIn >= 0) close(job->fdIn);
+      stats[i].seconds = since(job->start);
+      return;
+    }
+    // the first blocks may finish and submit more before this loop is done
+    lock_guard<mutex> lock(job->m);
+    size_t window = min(job->nBlocks, (size_t)BATCH_WINDOW * pool.size());
+    for (size_t k = 0; k < window; k++) submitBlock(pool, job);
+  }
+
+  // queues the next block of job; callers hold job->m
+  void submitBlock(WorkStealingPool& pool, shared_ptr<SplitFile> job) {
+    size_t b = job->nextSubmit++;
+    pool.submit([this, &pool, job, b] { codeBlock(pool, job, b); });
+  }
+
+  void codeBlock(WorkStealingPool& pool, shared_ptr<SplitFile> job, size_t b) {
+    FileStats& st = stats[job->index];
+    HuffmanContext& ctx = threadContext();
+    vector<uint8_t>& in = ctx.inputBuffer();
+    vector<uint8_t> block;
+    size_t n = min((uint64_t)opt.blockSize, st.bytesIn - b * opt.blockSize);
+    in.resize(n);
+    bool ok = pread(job->fdIn, in.data(), n, b * opt.blockSize) == (ssize_t)n;
+    if (ok) encodeBlock(in.data(), n, block, ctx);
+
+    unique_lock<mutex> lock(job->m);
+    job->failed = job->failed || !ok;
+    job->coded[b].swap(block);
+    // one thread at a time writes out whatever is next in order
+    if (job->writing) return;
+    job->writing = true;
+    while (job->coded.count(job->nextWrite) != 0) {
+      block.swap(job->coded[job->nextWrite]);
+      job->coded.erase(job->nextWrite++);
+      if (job->nextSubmit < job->nBlocks) submitBlock(pool, job);
+      lock.unlock();
+      ok = _writeAll(job->fdOut, block.data(), block.size());
+      lock.lock();
+      job->failed = job->failed || !ok;
+      job->bytesOut += block.size();
+    }
+    job->writing = false;
+    if (job->nextWrite < job->nBlocks) return;
+
+    close(job->fdIn);
+    close(job->fdOut);
+    if (job->failed) unlink((st.name + ".huf").c_str());
+    st.bytesOut = job->failed ? 0 : job->bytesOut;
+    st.seconds = since(job->start);
+    st.ok = !job->failed;
+  }
+
+  BatchJob(const BatchJob&) = delete;
+  BatchJob& operator=(const BatchJob&) = delete;
+};
+
+//
+// *This function compresses (or, with opt.decompress, decompresses) every
+// file in files on one thread pool and returns what happened to each one, in
+// the order given.
+//
+vector<FileStats> runBatch(const vector<string>& files,
+                           const BatchOptions& opt = BatchOptions()) {
+  BatchJob job(files, opt);
+  return job.run();
+}
@@ -0,0 +1,503 @@
+//
+// bench.cpp
+//
+// Microbenchmarks for the containers, against their std:: counterparts.
+//
+//   make bench       builds with -O2 and runs every benchmark
+//
+// mymap: a full in-order scan, short range scans starting from lower_bound,
+// and lower_bound alone, each compared with std::map holding the same keys.
+// Times are the best of a few repeats, in nanoseconds per key visited.
+// Then the latency of single put() calls while a map grows to n keys, for
+// each balance mode and for std::map, with ascending and random keys.
+//
+// SnapshotMap: lookups per second from 1 to 8 reader threads, while one
+// writer publishes a new version every millisecond, against a mymap behind
+// a mutex doing the same.
+//
+// Serialization: writing and reading a frequency table as "{k:v, ...}" text
+// and in binary, and a large mymap in binary, in nanoseconds per entry.
+//
+// Histogram: GB/s counting a 256 MiB buffer with parallelHistogram() on 1
+// thread up to one per core, and buildFrequencyMap() on a 64 MiB file
+// against the ifstream loop it used to be.
+//
+// Stream decoding: MB/s decoding a 1 MiB four-stream block with the
+// single-symbol and the multi-symbol table, for inputs whose codes run from
+// short to long, and which table decode() picks by itself.
+//
+// Decompressing to a pipe: MB/s of output for decompressStream(), which
+// splices chunks and copies stored blocks in the kernel, against decoding
+// the whole file with decompressBuffer() and then write()ing it, for text
+// and for incompressible (stored) input.
+//
+// Quantized headers: for log lines from 100 bytes to 1 MiB, the size of the
+// "{k:v, ...}" header against the quantized one, how much longer the codes
+// built from quantized counts make the data, in percent, and the time one
+// quantize() takes.
+//
+
+#include "mymap.h"
+#include "snapshotmap.h"
+#include "serialize.h"
+#include "util.h"
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const int REPEATS = 5;
+
+// keeps results live so the loops are not optimized away
+static volatile long sink;
+
+//
+// Runs f REPEATS times and returns the fastest run in nanoseconds per item,
+// f returning how many items it visited.
+//
+template<typename F>
+static double bestOf(F f) {
+    double best = 1e300;
+    for (int r = 0; r < REPEATS; r++) {
+        Clock::time_point start = Clock::now();
+        long items = f();
+        double ns = chrono::duration<double, nano>(Clock::now() - start).count();
+        best = min(best, ns / max(items, 1L));
+    }
+    return best;
+}
+
+static void report(const char* what, double mine, double theirs) {
+    printf("  %-26s %8.2f ns   std::map %8.2f ns   %.2fx\n", what, mine, theirs, theirs / mine);
+}
+
+static void benchMymap(int n) {
+    mymap<int, int> m;
+    map<int, int> ref;
+    vector<int> probes;
+    srand(1);
+    for (int i = 0; i < n; i++) {
+        int k = rand();
+        m.put(k, i);
+        ref[k] = i;
+        if (i % 16 == 0) probes.push_back(rand());
+    }
+    printf("mymap<int, int>, %d keys\n", (int)ref.size());
+
+    report("full scan, per key", bestOf([&m] {
+               long sum = 0, count = 0;
+               for (mymap<int, int>::iterator it = m.begin(); it != m.end(); ++it) {
+                   sum += it.value();
+                   count++;
+               }
+               sink = sum;
+               return count;
+           }),
+           bestOf([&ref] {
+               long sum = 0, count = 0;
+               for (map<int, int>::iterator it = ref.begin(); it != ref.end(); ++it) {
+                   sum += it->second;
+                   count++;
+               }
+               sink = sum;
+               return count;
+           }));
+
+    const int SPAN = RAND_MAX / n * 64;  // about 64 keys per range
+    report("range scan, per key", bestOf([&m, &probes, SPAN] {
+               long sum = 0, count = 0;
+               for (int lo : probes) {
+                   int hi = (lo > RAND_MAX - SPAN) ? RAND_MAX : lo + SPAN;
+                   m.forRange(lo, hi, [&sum, &count](int, int v) {
+                       sum += v;
+                       count++;
+                   });
+               }
+               sink = sum;
+               return count;
+           }),
+           bestOf([&ref, &probes, SPAN] {
+               long sum = 0, count = 0;
+               for (int lo : probes) {
+                   int hi = (lo > RAND_MAX - SPAN) ? RAND_MAX : lo + SPAN;
+                   for (map<int, int>::iterator it = ref.lower_bound(lo);
+                        it != ref.end() && it->first < hi; ++it) {
+                       sum += it->second;
+                       count++;
+                   }
+               }
+               sink = sum;
+               return count;
+           }));
+
+    report("lower_bound, per lookup", bestOf([&m, &probes] {
+               long sum = 0;
+               for (int k : probes) {
+                   mymap<int, int>::iterator it = m.lower_bound(k);
+                   if (it != m.end()) sum += it.value();
+               }
+               sink = sum;
+               return (long)probes.size();
+           }),
+           bestOf([&ref, &probes] {
+               long sum = 0;
+               for (int k : probes) {
+                   map<int, int>::iterator it = ref.lower_bound(k);
+                   if (it != ref.end()) sum += it->second;
+               }
+               sink = sum;
+               return (long)probes.size();
+           }));
+}
+
+//
+// Times each of n inserts on its own and prints the percentiles, in
+// nanoseconds.  put is called with each key.
+//
+template<typename Put>
+static void insertLatency(const char* what, const vector<int>& keys, Put put) {
+    vector<float> ns(keys.size());
+    Clock::time_point begin = Clock::now();
+    for (size_t i = 0; i < keys.size(); i++) {
+        Clock::time_point start = Clock::now();
+        put(keys[i], (int)i);
+        ns[i] = chrono::duration<float, nano>(Clock::now() - start).count();
+    }
+    double total = chrono::duration<double>(Clock::now() - begin).count();
+    sort(ns.begin(), ns.end());
+    size_t n = ns.size();
+    printf("  %-22s p50 %7.0f  p99 %7.0f  p99.9 %8.0f  max %10.0f ns   total %.2f s\n", what,
+           ns[n / 2], ns[n * 99 / 100], ns[n * 999 / 1000], ns[n - 1], total);
+}
+
+static void benchMymapInserts(int n) {
+    vector<int> ascending(n), shuffled(n);
+    srand(2);
+    for (int i = 0; i < n; i++) {
+        ascending[i] = i;
+        shuffled[i] = rand();
+    }
+    for (int order = 0; order < 2; order++) {
+        const vector<int>& keys = order ? shuffled : ascending;
+        printf("put() latency, %d %s keys\n", n, order ? "random" : "ascending");
+        {
+            mymap<int, int> m(BALANCE_REBUILD);
+            insertLatency("mymap BALANCE_REBUILD", keys, [&m](int k, int v) { m.put(k, v); });
+        }
+        {
+            mymap<int, int> m(BALANCE_ROTATE);
+            insertLatency("mymap BALANCE_ROTATE", keys, [&m](int k, int v) { m.put(k, v); });
+        }
+        map<int, int> ref;
+        insertLatency("std::map", keys, [&ref](int k, int v) { ref[k] = v; });
+    }
+}
+
+//
+// Runs readers threads calling lookup(key) for a fixed time while write()
+// runs every millisecond, and returns millions of lookups per second.
+//
+template<typename Lookup, typename Write>
+static double lookupRate(int readers, int nKeys, Lookup lookup, Write write) {
+    atomic<bool> done(false);
+    atomic<long> total(0);
+    vector<thread> threads;
+    for (int t = 0; t < readers; t++) {
+        threads.push_back(thread([&, t] {
+            unsigned k = 12345 + t;
+            long n = 0, sum = 0;
+            while (!done.load(memory_order_relaxed)) {
+                for (int i = 0; i < 256; i++) {
+                    k = k * 1103515245 + 12345;
+                    sum += lookup((int)(k % nKeys));
+                }
+                n += 256;
+            }
+            sink = sum;
+            total += n;
+        }));
+    }
+    Clock::time_point start = Clock::now();
+    while (Clock::now() - start < chrono::milliseconds(400)) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+        write();
+    }
+    done = true;
+    for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+    return total / chrono::duration<double>(Clock::now() - start).count() / 1e6;
+}
+
+static void benchSnapshotMap(int nKeys) {
+    SnapshotMap<int, int> shared;
+    mymap<int, int> locked(BALANCE_ROTATE);
+    mutex lock;
+    shared.update([nKeys](mymap<int, int>& m) {
+        for (int k = 0; k < nKeys; k++) m.put(k, k);
+    });
+    for (int k = 0; k < nKeys; k++) locked.put(k, k);
+
+    int version = 0;
+    printf("lookups from reader threads, %d keys, one write per ms (%u cores)\n", nKeys,
+           thread::hardware_concurrency());
+    for (int readers = 1; readers <= 8; readers *= 2) {
+        double mine = lookupRate(readers, nKeys,
+                                 [&shared](int k) { return shared.get(k); },
+                                 [&shared, &version] { shared.put(-1, ++version); });
+        double theirs = lookupRate(readers, nKeys,
+                                   [&locked, &lock](int k) {
+                                       lock_guard<mutex> hold(lock);
+                                       return locked.get(k);
+                                   },
+                                   [&locked, &lock, &version] {
+                                       lock_guard<mutex> hold(lock);
+                                       locked.put(-1, ++version);
+                                   });
+        printf("  %d readers   SnapshotMap %7.2f M/s   mutex + mymap %7.2f M/s\n", readers, mine,
+               theirs);
+    }
+}
+
+static void reportFormats(const char* what, double binary, double text) {
+    printf("  %-26s %8.2f ns   text %8.2f ns   %.2fx\n", what, binary, text, text / binary);
+}
+
+static void benchSerialization(int n) {
+    hashmap freqs;
+    for (int c = 0; c <= 256; c++) freqs.put(c, rand() % 100000);
+    printf("frequency table, 257 entries, per entry\n");
+    vector<uint8_t> bytes;
+    string text;
+    reportFormats("write", bestOf([&freqs, &bytes] {
+                      long count = 0;
+                      for (int r = 0; r < 100; r++) {
+                          bytes.clear();
+                          serializeMap(freqs, bytes);
+                          count += 257;
+                      }
+                      return count;
+                  }),
+                  bestOf([&freqs, &text] {
+                      long count = 0;
+                      for (int r = 0; r < 100; r++) {
+                          ostringstream out;
+                          out << freqs;
+                          text = out.str();
+                          count += 257;
+                      }
+                      return count;
+                  }));
+    reportFormats("read", bestOf([&bytes] {
+                      long count = 0;
+                      for (int r = 0; r < 100; r++) {
+                          hashmap back;
+                          size_t pos = 0;
+                          deserializeMap(bytes.data(), bytes.size(), pos, back);
+                          count += 257;
+                      }
+                      return count;
+                  }),
+                  bestOf([&text] {
+                      long count = 0;
+                      for (int r = 0; r < 100; r++) {
+                          hashmap back;
+                          istringstream in(text);
+                          in >> back;
+                          count += 257;
+                      }
+                      return count;
+                  }));
+    printf("  size %zu bytes binary, %zu bytes text\n", bytes.size(), text.size());
+
+    mymap<int, int> m(BALANCE_ROTATE);
+    for (int i = 0; i < n; i++) m.put(rand(), i);
+    vector<uint8_t> image;
+    double write = bestOf([&m, &image] {
+        image.clear();
+        serializeMap(m, image);
+        return (long)m.Size();
+    });
+    double read = bestOf([&image] {
+        mymap<int, int> back(BALANCE_ROTATE);
+        size_t pos = 0;
+        deserializeMap(image.data(), image.size(), pos, back);
+        return (long)back.Size();
+    });
+    double view = bestOf([&image] {
+        SerializedView<int, int> v;
+        size_t pos = 0;
+        long sum = 0;
+        v.open(image.data(), image.size(), pos);
+        v.forEach([&sum](int, int value) { sum += value; });
+        sink = sum;
+        return (long)v.size();
+    });
+    printf("mymap<int, int>, %d keys, per entry\n", m.Size());
+    printf("  write %.2f ns   read into a map %.2f ns   scan a view %.2f ns   %.2f bytes/entry\n",
+           write, read, view, (double)image.size() / m.Size());
+}
+
+static void benchHistogram() {
+    vector<uint8_t> data((size_t)256 << 20);
+    for (size_t i = 0; i < data.size(); i++) data[i] = (uint8_t)(rand() % 3 ? 'a' + rand() % 26 : rand());
+    int cores = max(1, (int)thread::hardware_concurrency());
+    printf("histogram of %zu MiB (%d cores)\n", data.size() >> 20, cores);
+    for (int threads = 1;; threads = min(threads * 2, cores)) {
+        ByteHistogram h;
+        double ns = bestOf([&data, &h, threads] {
+            parallelHistogram(data.data(), data.size(), h, threads);
+            return (long)data.size();
+        });
+        printf("  %2d threads   %6.2f GB/s\n", threads, 1 / ns);
+        if (threads == cores) break;
+    }
+
+    {
+        ofstream out("bench.histogram", ios::binary);
+        out.write((const char*)data.data(), 64 << 20);
+    }
+    double fast = bestOf([] {
+        hashmap map;
+        buildFrequencyMap("bench.histogram", true, map);
+        return 64L << 20;
+    });
+    double slow = bestOf([] {
+        hashmap map;
+        ifstream in("bench.histogram");
+        char ch;
+        while (in.get(ch)) map.put(ch, map.containsKey(ch) ? map.get(ch) + 1 : 1);
+        map.put(256, 1);
+        return 64L << 20;
+    });
+    printf("  buildFrequencyMap, 64 MiB file   %.2f GB/s   ifstream loop %.3f GB/s   %.0fx\n",
+           1 / fast, 1 / slow, slow / fast);
+    remove("bench.histogram");
+}
+
+static void benchStreamDecode() {
+    const char* log = "GET /index.html 200\nGET /favicon.ico 404\nPOST /login 302\n";
+    const char* prose = "the quick brown fox jumps over the lazy dog while five wizards box and "
+                        "jump quickly, Pack my box with five dozen liquor jugs.\n";
+    const int N = 1 << 20;
+    printf("four-stream decode, 1 MiB block\n");
+    for (int kind = 0; kind < 4; kind++) {
+        vector<uint8_t> raw(N);
+        for (int i = 0; i < N; i++) {
+            if (kind == 0) raw[i] = (uint8_t)"aaaabbc\n"[rand() % 8];
+            if (kind == 1) raw[i] = (uint8_t)(i % 50 == 49 ? rand() : log[rand() % strlen(log)]);
+            if (kind == 2) raw[i] = (uint8_t)prose[rand() % strlen(prose)];
+            if (kind == 3) raw[i] = (uint8_t)(rand() % 3 ? rand() % 64 : rand());
+        }
+        uint64_t counts[256] = {0};
+        for (int i = 0; i < N; i++) counts[raw[i]]++;
+        MultiStreamCoder coder;
+        vector<uint8_t> block, out;
+        size_t size = coder.plan(counts, raw.data(), N);
+        coder.encode(raw.data(), N, block);
+        double mbs[3];
+        bool multi = false;
+        DecodeTableMode modes[] = {TABLE_SINGLE, TABLE_MULTI, TABLE_AUTO};
+        for (int m = 0; m < 3; m++) {
+            coder.setTableMode(modes[m]);
+            double ns = bestOf([&coder, &block, &out, N] {
+                size_t pos = 0;
+                out.clear();
+                coder.decode(block.data(), block.size(), pos, out);
+                return (long)N;
+            });
+            mbs[m] = 1e3 / ns;
+            if (modes[m] == TABLE_AUTO) multi = coder.usedMultiTable();
+        }
+        const char* names[] = {"short codes", "log lines", "prose", "wide bytes"};
+        printf("  %-12s %.2f bits/byte   single %7.1f MB/s   multi %7.1f MB/s   %.2fx   auto: %s\n",
+               names[kind], 8.0 * size / N, mbs[0], mbs[1], mbs[1] / mbs[0],
+               multi ? "multi" : "single");
+    }
+}
+
+static void benchDecompressToPipe() {
+    const int N = 64 << 20;
+    printf("decompress %d MiB into a pipe\n", N >> 20);
+    for (int kind = 0; kind < 2; kind++) {
+        vector<uint8_t> raw(N);
+        for (int i = 0; i < N; i++) raw[i] = (uint8_t)(kind ? rand() : "to be or not to be\n"[rand() % 19]);
+        ofstream("bench.pipe", ios::binary).write((const char*)raw.data(), N);
+        compressFile("bench.pipe", "bench.pipe.huf");
+        double mbs[2];
+        for (int way = 0; way < 2; way++) {
+            mbs[way] = 1e3 / bestOf([way] {
+                int p[2];
+                if (pipe(p) != 0) return 1L;
+                long got = 0;
+                thread reader([&p, &got] {
+                    static uint8_t buf[1 << 16];
+                    ssize_t n;
+                    while ((n = read(p[0], buf, sizeof(buf))) > 0) got += n;
+                });
+                if (way == 0) {
+                    int in = open("bench.pipe.huf", O_RDONLY);
+                    decompressStream(in, p[1], threadContext());
+                    close(in);
+                } else {
+                    HuffmanContext& ctx = threadContext();
+                    vector<uint8_t> packed, out;
+                    _readFile("bench.pipe.huf", packed);
+                    decompressBuffer(packed.data(), packed.size(), out, ctx);
+                    _writeAll(p[1], out.data(), out.size());
+                }
+                close(p[1]);
+                reader.join();
+                close(p[0]);
+                return got;
+            });
+        }
+        printf("  %-6s  decompressStream %7.1f MB/s   buffer + write %7.1f MB/s   %.2fx\n",
+               kind ? "stored" : "text", mbs[0], mbs[1], mbs[0] / mbs[1]);
+    }
+    remove("bench.pipe");
+    remove("bench.pipe.huf");
+}
+
+static void benchQuantizedHeader() {
+    const char* log = "GET /index.html 200\nGET /favicon.ico 404\nPOST /login 302\n";
+    printf("quantized header vs {k:v}, log lines\n");
+    for (int n = 100; n <= (1 << 20); n *= 8) {
+        vector<uint8_t> raw(n);
+        for (int i = 0; i < n; i++)
+            raw[i] = (uint8_t)(i % 50 == 49 ? rand() : log[rand() % strlen(log)]);
+        HuffmanContext ctx;
+        ctx.countSymbols(raw.data(), n);
+        ctx.buildTree();
+        ctx.buildCodes();
+        long long exact = ctx.codedBits();
+        double ns = bestOf([&ctx] {
+            ctx.quantize();
+            return 1L;
+        });
+        printf("  %8d bytes  header %6zu -> %4zu bytes   codes +%.4f%%   quantize %6.0f ns\n", n,
+               ctx.headerSize(), ctx.quantizedHeaderSize(n),
+               100.0 * (ctx.codedBits() - exact) / exact, ns);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int n = (argc > 1) ? atoi(argv[1]) : 200000;
+    benchMymap(n);
+    benchMymapInserts((argc > 2) ? atoi(argv[2]) : 1000000);
+    benchSnapshotMap(1000);
+    benchSerialization(n);
+    benchHistogram();
+    benchStreamDecode();
+    benchDecompressToPipe();
+    benchQuantizedHeader();
+    return 0;
+}
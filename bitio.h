@@ -0,0 +1,107 @@
+//
+// bitio.h
+//
+// Bit-at-a-time reading and writing over plain byte buffers, in the bit
+// order of ibitstream and obitstream: the first bit goes in bit 0 of its
+// byte.  BitWriter appends to a vector<uint8_t> and BitReader reads any span
+// of bytes, with no stream state, sentry or virtual call between the caller
+// and the buffer.  istringbitstream and ostringbitstream are built on them.
+//
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#pragma once
+
+using namespace std;
+
+class BitWriter {
+ public:
+  BitWriter(vector<uint8_t>& out) : out(&out), nBits(8) {}
+
+  // appends one bit, 0 or 1
+  void writeBit(int bit) {
+    if (nBits == 8) {
+      out->push_back(0);
+      nBits = 0;
+    }
+    out->back() |= (uint8_t)((bit & 1) << nBits);
+    nBits++;
+  }
+
+  // appends the low n bits of v, bit 0 first
+  void writeBits(uint64_t v, int n) {
+    while (n > 0) {
+      if (nBits == 8) {
+        out->push_back(0);
+        nBits = 0;
+      }
+      int take = (n < 8 - nBits) ? n : 8 - nBits;
+      out->back() |= (uint8_t)((v & ((1u << take) - 1)) << nBits);
+      v >>= take;
+      n -= take;
+      nBits += take;
+    }
+  }
+
+  //
+  // align:
+  // Starts the next bit on a new byte, leaving the rest of the current one
+  // zero.  Call it after appending whole bytes to the buffer directly.
+  //
+  void align() { nBits = 8; }
+
+  vector<uint8_t>& bytes() { return *out; }
+
+ private:
+  vector<uint8_t>* out;
+  int nBits;  // bits used in out->back(); 8 when the next bit needs a new byte
+};
+
+class BitReader {
+ public:
+  BitReader(const uint8_t* data, size_t len) : data(data), len(len), pos(0) {}
+  BitReader(const vector<uint8_t>& v) : data(v.data()), len(v.size()), pos(0) {}
+
+  // returns the next bit, or EOF once every bit has been read
+  int readBit() {
+    if (pos >= 8 * len) return EOF;
+    int bit = (data[pos >> 3] >> (pos & 7)) & 1;
+    pos++;
+    return bit;
+  }
+
+  //
+  // readBits:
+  // Reads the next n bits, the first into bit 0 of v.  Returns false, having
+  // read nothing, if fewer than n are left.
+  //
+  bool readBits(int n, uint64_t& v) {
+    if (8 * len - pos < (size_t)n) return false;
+    v = 0;
+    for (int got = 0; got < n;) {
+      int take = 8 - (int)(pos & 7);
+      if (take > n - got) take = n - got;
+      v |= (uint64_t)((data[pos >> 3] >> (pos & 7)) & ((1u << take) - 1)) << got;
+      got += take;
+      pos += take;
+    }
+    return true;
+  }
+
+  // skips to the start of the next byte, unless already at one
+  void align() { pos = (pos + 7) & ~(size_t)7; }
+
+  void seekBit(size_t bit) { pos = (bit < 8 * len) ? bit : 8 * len; }
+  size_t bitPosition() const { return pos; }
+
+  // bytes touched so far, the one holding the last bit read included
+  size_t bytePosition() const { return (pos + 7) >> 3; }
+
+  bool atEnd() const { return pos >= 8 * len; }
+
+ private:
+  const uint8_t* data;
+  size_t len;
+  size_t pos;  // next bit to read
+};
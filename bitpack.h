@@ -0,0 +1,227 @@
+//
+// bitpack.h
+//
+// The inner loop of encoding: turning bytes into their concatenated codes.
+// Bits are collected in a 64-bit word and written a whole word at a time.
+// When codes are short, two or four of them are merged into one word first,
+// so the serial part of the loop runs once per pair or quad of symbols.
+//
+// On x86-64 CPUs with AVX2 the merging is done eight symbols at a time: one
+// gather fetches each symbol's code and length together and variable shifts
+// join them in the vector registers.  Everywhere else a scalar loop does the
+// same work.  Both produce exactly the bytes of the one-bit-at-a-time
+// obitstream.
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "huffman.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#pragma once
+
+using namespace std;
+
+enum PackKernel { PACK_AUTO, PACK_SCALAR, PACK_AVX2 };
+
+// codes up to these lengths are merged four or two to a word before writing
+const int QUAD_CODE_BITS = 14;
+const int PAIR_CODE_BITS = 28;
+
+// codes up to this length also fit in packed[], leaving 8 bits for the length
+const int PACKED_CODE_BITS = 24;
+
+//
+// CodeTable is the flat code table encoding reads: every symbol's code, with
+// the first bit of its path in bit 0, and its length.
+//
+struct CodeTable {
+  uint64_t code[NUM_SYMBOLS];
+  int len[NUM_SYMBOLS];
+  int maxLen;            // longest code in the table
+  uint32_t packed[256];  // code | len << 24 for each byte, if maxLen <= 24
+
+  //
+  // finish:
+  // Works out maxLen and packed[] once code[] and len[] are filled in for
+  // the nSyms symbols in syms.
+  //
+  void finish(const int* syms, int nSyms) {
+    maxLen = 0;
+    memset(packed, 0, sizeof(packed));
+    for (int i = 0; i < nSyms; i++) maxLen = max(maxLen, len[syms[i]]);
+    for (int i = 0; i < nSyms && maxLen <= PACKED_CODE_BITS; i++) {
+      if (syms[i] < 256)
+        packed[syms[i]] = (uint32_t)code[syms[i]] | (uint32_t)len[syms[i]] << 24;
+    }
+  }
+};
+
+//
+// BitPacker appends codes, least significant bit first, to a buffer with at
+// least eight bytes of room past anything it writes.  Between flushes it can
+// take 56 bits, so flush() needs no branch: it always stores a whole word and
+// then moves forward by the whole bytes in it.
+//
+struct BitPacker {
+  uint8_t* dst;
+  uint64_t acc;   // bits not yet written, in the low nAcc bits
+  unsigned nAcc;  // below 8 right after a flush
+
+  // adds the low n bits of v, which must be zero above them
+  void add(uint64_t v, unsigned n) {
+    acc |= v << nAcc;
+    nAcc += n;
+  }
+
+  void flush() {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(dst, &acc, sizeof(acc));
+#else
+    for (int i = 0; i < 8; i++) dst[i] = (uint8_t)(acc >> (8 * i));
+#endif
+    unsigned bytes = nAcc / NUM_BITS_IN_BYTE;
+    dst += bytes;
+    acc >>= bytes * NUM_BITS_IN_BYTE;
+    nAcc -= bytes * NUM_BITS_IN_BYTE;
+  }
+};
+
+//
+// Codes are never longer than 56 bits (see assignCodes() in context.h), so
+// even one at a time they fit between flushes.
+//
+void _packScalar(const uint8_t* data, size_t len, const CodeTable& t,
+                 BitPacker& packer) {
+  // a local copy: stores through dst could alias the caller's packer, which
+  // would keep its fields from staying in registers
+  BitPacker p = packer;
+  const uint64_t* code = t.code;
+  const int* codeLen = t.len;
+  size_t i = 0;
+  if (t.maxLen <= QUAD_CODE_BITS) {
+    for (; i + 4 <= len; i += 4) {
+      int a = data[i], b = data[i + 1], c = data[i + 2], d = data[i + 3];
+      unsigned ab = codeLen[a] + codeLen[b], cd = codeLen[c] + codeLen[d];
+      uint64_t low = code[a] | code[b] << codeLen[a];
+      uint64_t high = code[c] | code[d] << codeLen[c];
+      p.add(low | high << ab, ab + cd);
+      p.flush();
+    }
+  } else if (t.maxLen <= PAIR_CODE_BITS) {
+    for (; i + 2 <= len; i += 2) {
+      int a = data[i], b = data[i + 1];
+      p.add(code[a] | code[b] << codeLen[a], codeLen[a] + codeLen[b]);
+      p.flush();
+    }
+  }
+  for (; i < len; i++) {
+    p.add(code[data[i]], codeLen[data[i]]);
+    p.flush();
+  }
+  packer = p;
+}
+
+#if defined(__x86_64__)
+//
+// Eight symbols per step.  Each 64-bit lane holds the packed entries of two
+// neighbouring symbols, which are merged into one pair; with maxLen <= 14
+// neighbouring pairs are merged again, leaving two words instead of four for
+// the serial part.
+//
+__attribute__((target("avx2,bmi2")))
+void _packAvx2(const uint8_t* data, size_t len, const CodeTable& t,
+               BitPacker& packer) {
+  BitPacker p = packer;
+  const __m256i lowCode = _mm256_set1_epi64x(0xffffff);
+  const __m256i lowLen = _mm256_set1_epi64x(0xff);
+  bool quads = t.maxLen <= QUAD_CODE_BITS;
+  alignas(32) uint64_t words[4], bits[4];
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    __m128i bytes = _mm_loadl_epi64((const __m128i*)(data + i));
+    __m256i e = _mm256_i32gather_epi32((const int*)t.packed,
+                                       _mm256_cvtepu8_epi32(bytes), 4);
+    __m256i firstLen = _mm256_and_si256(_mm256_srli_epi64(e, 24), lowLen);
+    __m256i secondCode = _mm256_and_si256(_mm256_srli_epi64(e, 32), lowCode);
+    __m256i pair = _mm256_or_si256(_mm256_and_si256(e, lowCode),
+                                   _mm256_sllv_epi64(secondCode, firstLen));
+    __m256i pairLen = _mm256_add_epi64(firstLen, _mm256_srli_epi64(e, 56));
+    if (quads) {
+      // lanes 0 and 2 take lanes 1 and 3 shifted past themselves
+      __m256i next = _mm256_srli_si256(pair, 8);
+      __m256i nextLen = _mm256_srli_si256(pairLen, 8);
+      pair = _mm256_or_si256(pair, _mm256_sllv_epi64(next, pairLen));
+      pairLen = _mm256_add_epi64(pairLen, nextLen);
+    }
+    _mm256_store_si256((__m256i*)words, pair);
+    _mm256_store_si256((__m256i*)bits, pairLen);
+    if (quads) {
+      p.add(words[0], (unsigned)bits[0]);
+      p.flush();
+      p.add(words[2], (unsigned)bits[2]);
+      p.flush();
+    } else {
+      for (int k = 0; k < 4; k++) {
+        p.add(words[k], (unsigned)bits[k]);
+        p.flush();
+      }
+    }
+  }
+  _packScalar(data + i, len - i, t, p);
+  packer = p;
+}
+#endif
+
+// true when this CPU can run the AVX2 kernel
+bool packAvx2Supported() {
+#if defined(__x86_64__)
+  static const bool supported =
+      __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+  return supported;
+#else
+  return false;
+#endif
+}
+
+//
+// *This function appends the codes for len bytes at data, then the code for
+// PSEUDO_EOF, to out and pads the last byte with zeros.  kernel picks the
+// implementation; PACK_AUTO uses the fastest one this CPU supports.
+//
+void packCodes(const uint8_t* data, size_t len, const CodeTable& t,
+               vector<uint8_t>& out, PackKernel kernel = PACK_AUTO) {
+  // a chunk at a time, so out never grows far past what is really written
+  const size_t CHUNK = 1 << 16;
+  bool avx2 = t.maxLen <= PACKED_CODE_BITS && kernel != PACK_SCALAR &&
+              packAvx2Supported();
+  BitPacker p = {nullptr, 0, 0};
+  size_t at = 0;
+  do {
+    size_t n = min(CHUNK, len - at);
+    size_t start = out.size();
+    // room for every code, the pending bits, EOF, and the spare word
+    out.resize(start + (n * t.maxLen + t.maxLen) / NUM_BITS_IN_BYTE + 2 * 8);
+    p.dst = out.data() + start;
+#if defined(__x86_64__)
+    if (avx2)
+      _packAvx2(data + at, n, t, p);
+    else
+#endif
+      _packScalar(data + at, n, t, p);
+    at += n;
+    if (at == len) {
+      // EOF, then the last partial byte, zero padded
+      p.add(t.code[PSEUDO_EOF], t.len[PSEUDO_EOF]);
+      p.flush();
+      if (p.nAcc > 0) {
+        p.nAcc = NUM_BITS_IN_BYTE;
+        p.flush();
+      }
+    }
+    out.resize(p.dst - out.data());
+  } while (at < len);
+}
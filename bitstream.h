@@ -29,10 +29,15 @@
 #ifndef _bitstream_h
 #define _bitstream_h
 
+#include <algorithm>
+#include <cstdint>
 #include <istream>
 #include <ostream>
 #include <fstream>
 #include <sstream>
+#include <string>
+#include <vector>
+#include "bitio.h"
 
 /**
  * Constant: PSEUDO_EOF
@@ -163,16 +168,16 @@ public:
      * In order to not disrupt reading, we also record cur streampos and
      * re-seek to there before returning.
      */
-    long size() {
+    int64_t size() {
         if (!is_open()) {
             //error("ibitstream::size: Cannot get size of stream which is not open.");
         }
         clear();                    // clear any error state
-        streampos cur = tellg();    // save current streampos
+        std::streampos cur = tellg();    // save current streampos
         seekg(0, std::ios::end);            // seek to end
-        streampos end = tellg();    // get offset
+        std::streampos end = tellg();    // get offset
         seekg(cur);                    // seek back to original pos
-        return long(end);
+        return int64_t(end);
     }
     /**
      * Returns the size in bytes of the data attached to this stream.
@@ -198,6 +203,8 @@ private:
     std::streampos lastTell;
     int curByte;
     int pos;
+
+protected:
     bool fake;
 };
 
@@ -286,16 +293,16 @@ public:
      * In order to not disrupt writing, we also record cur streampos and
      * re-seek to there before returning.
      */
-    long size() {
+    int64_t size() {
         //if (!is_open()) {
             //error("obitstream::size: stream is not open");
         //}
         clear();                    // clear any error state
-        streampos cur = tellp();    // save current streampos
+        std::streampos cur = tellp();    // save current streampos
         seekp(0, std::ios::end);            // seek to end
-        streampos end = tellp();    // get offset
+        std::streampos end = tellp();    // get offset
         seekp(cur);                    // seek back to original pos
-        return long(end);
+        return int64_t(end);
     }
     /**
      * Returns the size in bytes of the file attached to this stream.
@@ -320,6 +327,8 @@ private:
     std::streampos lastTell;
     int curByte;
     int pos;
+
+protected:
     bool fake;
 };
 
@@ -537,24 +546,124 @@ private:
     std::filebuf fb;
 };
 
+/*
+ * Class: _bytespanbuf
+ * -------------------
+ * A stream buffer reading straight out of a byte array, which the
+ * istringbitstream owns.  The whole array is the get area, so get() and >>
+ * never call back into the buffer until the data runs out.
+ */
+class _bytespanbuf: public std::streambuf {
+public:
+    void reset(std::vector<uint8_t>& bytes) {
+        char* begin = (char*)bytes.data();
+        setg(begin, begin, begin + bytes.size());
+    }
+
+    size_t offset() const {
+        return gptr() - eback();
+    }
+
+    void seekTo(size_t n) {
+        setg(eback(), eback() + n, egptr());
+    }
+
+protected:
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which = std::ios_base::in) {
+        off_type base = (dir == std::ios_base::beg) ? 0
+                      : (dir == std::ios_base::cur) ? (off_type)offset()
+                      : (off_type)(egptr() - eback());
+        return seekpos(pos_type(base + off), which);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which = std::ios_base::in) {
+        off_type n = pos;
+        if (!(which & std::ios_base::in) || n < 0 || n > egptr() - eback()) {
+            return pos_type(off_type(-1));
+        }
+        seekTo((size_t)n);
+        return pos;
+    }
+};
+
+/*
+ * Class: _bytevectorbuf
+ * ---------------------
+ * A stream buffer writing to a byte vector, which the ostringbitstream
+ * owns.  Writes append unless the stream has been moved back, as
+ * obitstream::writeBit does to rewrite the last byte; the position is kept
+ * as a distance from the end, so bytes appended to the vector directly
+ * leave it at the end.
+ */
+class _bytevectorbuf: public std::streambuf {
+public:
+    _bytevectorbuf(std::vector<uint8_t>& bytes) : bytes(bytes), back(0) {}
+
+protected:
+    int_type overflow(int_type ch) {
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            char c = (char)ch;
+            xsputn(&c, 1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) {
+        size_t over = std::min(back, (size_t)n);
+        std::copy(s, s + over, bytes.end() - back);
+        bytes.insert(bytes.end(), (const uint8_t*)s + over, (const uint8_t*)s + n);
+        back -= over;
+        return n;
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which = std::ios_base::out) {
+        off_type base = (dir == std::ios_base::beg) ? 0
+                      : (dir == std::ios_base::cur) ? (off_type)(bytes.size() - back)
+                      : (off_type)bytes.size();
+        return seekpos(pos_type(base + off), which);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which = std::ios_base::out) {
+        off_type n = pos;
+        if (!(which & std::ios_base::out) || n < 0 || n > (off_type)bytes.size()) {
+            return pos_type(off_type(-1));
+        }
+        back = bytes.size() - (size_t)n;
+        return pos;
+    }
+
+private:
+    std::vector<uint8_t>& bytes;
+    size_t back;   // how far before the end the next byte goes
+};
+
 /**
  * A variant on C++'s istringstream class, which acts as a stream that
  * reads its data from a string.  This is mostly used by the testing
  * code to test your Huffman encoding without having to read or write
  * files on disk, but you can use it in your own testing if you would
  * like.
+ *
+ * Bits are read by a BitReader (see bitio.h) straight out of the string's
+ * bytes, so readBit costs no stream calls except when it moves on to a new
+ * byte.  Reading bytes with get or >> in between works as it does for any
+ * ibitstream: the next readBit starts on the byte after them.  readBit is
+ * not virtual, so through an ibitstream& the slower ibitstream::readBit
+ * reads the same bits from the same buffer.
  */
 class istringbitstream: public ibitstream {
 public:
     
     /* Constructor istringbitstream::istringbitstream
      * ----------------------------------------------
-     * Sets the stream to use the string buffer, then sets
+     * Sets the stream to use the byte buffer, then sets
      * the initial string to the specified value.
      */
-    istringbitstream(const std::string& s) {
+    istringbitstream(const std::string& s) : reader(NULL, 0) {
         init(&sb);
-        sb.str(s);
+        str(s);
     }
     /**
      * Constructs an istringbitstream reading the specified string.
@@ -563,19 +672,53 @@ public:
     
     /* Member function istringbitstream::str
      * -------------------------------------
-     * Sets the underlying string in the buffer to the
-     * specified string.
+     * Replaces the bytes, and starts reading bits and bytes
+     * from the first one.
      */
     void str(const std::string& s) {
-        sb.str(s);
+        bytes.assign(s.begin(), s.end());
+        sb.reset(bytes);
+        reader = BitReader(bytes);
+        lastOffset = 0;
     }
     /**
      * Sets the underlying string of the istringbitstream.
      */
-
+    
+    /* Member function istringbitstream::readBit
+     * -----------------------------------------
+     * If bytes were read or the stream was moved since the last bit,
+     * carry on from the byte it is at now.  The byte holding the bit
+     * just read counts as read, as it does for ibitstream.
+     */
+    int readBit() {
+        if (fake) {
+            int bit = get();
+            return (bit == 0 || bit == '0') ? 0 : 1;
+        }
+        if (sb.offset() != lastOffset) {
+            reader.seekBit(8 * sb.offset());
+        }
+        int bit = reader.readBit();
+        if (bit == EOF) {
+            setstate(std::ios::eofbit | std::ios::failbit);
+            return EOF;
+        }
+        lastOffset = reader.bytePosition();
+        sb.seekTo(lastOffset);
+        return bit;
+    }
+    /**
+     * Reads a single bit from the string and returns 0 or 1 depending on
+     * the bit value.  If the string is exhausted, EOF (-1) is returned.
+     */
+    
 private:
-    // the actual string buffer that does character storage
-    std::stringbuf sb;
+    // the bytes of the string, and a buffer and bit reader over them
+    std::vector<uint8_t> bytes;
+    _bytespanbuf sb;
+    BitReader reader;
+    size_t lastOffset = 0;   // where the last readBit left the byte buffer
 };
 
 /**
@@ -584,34 +727,83 @@ private:
  * code to test your Huffman encoding without having to read or write
  * files on disk, but you can use it in your own testing if you would
  * like.
+ *
+ * Bits are appended by a BitWriter (see bitio.h) straight into a byte
+ * vector, instead of seeking back and rewriting the last byte of a string
+ * stream for every bit.  writeBit is not virtual, so through an obitstream&
+ * the slower obitstream::writeBit runs instead and writes the same bits,
+ * seeking back in the same buffer.  Switching between the two starts a
+ * fresh byte, as writing whole bytes in between does.
  */
 class ostringbitstream: public obitstream {
 public:
     /* Member function ostringbitstream::ostringbitstream
      * --------------------------------------------------
-     * Sets the stream to use the string buffer.
+     * Sets the stream to use the byte buffer.
      */
-    ostringbitstream() {
+    ostringbitstream() : sb(bytes), writer(bytes) {
         init(&sb);
     }
     /**
      * Constructs an ostringbitstream.
      */
     
+    /* Member function ostringbitstream::writeBit
+     * ------------------------------------------
+     * If bytes were written since the last bit, start a fresh
+     * byte after them, as obitstream does.
+     */
+    void writeBit(int bit) {
+        if (fake) {
+            bytes.push_back(bit == 1 ? '1' : '0');
+            return;
+        }
+        if (bytes.size() != lastSize) {
+            writer.align();
+        }
+        writer.writeBit(bit);
+        lastSize = bytes.size();
+    }
+    /**
+     * Writes a single bit to the string.
+     */
+    
+    /* Member function ostringbitstream::writeBits
+     * -------------------------------------------
+     * Same as n calls to writeBit, the low bit of value first.
+     */
+    void writeBits(uint64_t value, int n) {
+        if (fake) {
+            for (int i = 0; i < n; i++) writeBit((value >> i) & 1);
+            return;
+        }
+        if (bytes.size() != lastSize) {
+            writer.align();
+        }
+        writer.writeBits(value, n);
+        lastSize = bytes.size();
+    }
+    /**
+     * Writes the low n bits of value to the string, least significant first.
+     */
+    
     /* Member function ostringbitstream::str
      * -------------------------------------
      * Retrives the underlying string data.
      */
     std::string str() {
-        return sb.str();
+        return std::string(bytes.begin(), bytes.end());
     }
     /**
-     * Retrieves the underlying string of the istringbitstream.
+     * Retrieves the underlying string of the ostringbitstream.
      */
     
 private:
-    // the actual string buffer that does character storage
-    std::stringbuf sb;
+    // the bytes written, and a buffer and bit writer appending to them
+    std::vector<uint8_t> bytes;
+    _bytevectorbuf sb;
+    BitWriter writer;
+    size_t lastSize = 0;     // bytes.size() after the last writeBit
 };
 
 /**
@@ -0,0 +1,298 @@
+//
+// buffer.h
+//
+// In-memory versions of compress() and decompress().  They take a byte range
+// instead of a filename, never touch the disk, and produce exactly the bytes
+// compress() writes to "filename.huf", so the two paths are interchangeable.
+//
+// Callers coding many small inputs should pass the same HuffmanContext each
+// time; the overloads without one use the calling thread's context.
+//
+// Compressed data may carry CRC32C checksums: a TAG_CHECKSUM after each
+// block and a TAG_END at the end.  decompressBuffer() checks any it finds,
+// summing each block right after decoding it.
+//
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "checksum.h"
+#include "context.h"
+#include "dictionary.h"
+#include "format.h"
+#pragma once
+
+// four streams decode several times faster than one, so encodeBlock() takes
+// them over a single-stream block up to 1/STREAM_SLACK smaller
+const size_t STREAM_SLACK = 256;
+
+//
+// *This function appends one block coding len bytes at data to out.  It
+// builds the code lengths first and, without encoding anything, works out
+// the size of a single-stream block with a "{k:v}" header and with
+// quantized counts, a four-stream block and a stored one, then writes the
+// smallest.  Ties go to the stored block, then to four streams, also when
+// they are only slightly bigger, then to the "{k:v}" header.  Input that is
+// one byte repeated becomes a run.
+//
+void encodeBlock(const uint8_t* data, size_t len, vector<uint8_t>& out,
+                 HuffmanContext& ctx) {
+  size_t capacity = out.capacity();
+  ctx.countSymbols(data, len);
+  if (len > 0 && ctx.symbolCount() == 2) {
+    StageTimer timer(STAGE_ENCODE);
+    out.push_back(TAG_RLE);
+    out.push_back(data[0]);
+    putVarint(len, out);
+    timer.finish(len, 2 + varintSize(len));
+    statsRecordGrowth(capacity, out.capacity());
+    return;
+  }
+
+  ctx.buildTree();
+  ctx.buildCodes();
+  size_t coded = ctx.headerSize() + (size_t)((ctx.codedBits() + 7) / 8);
+  size_t streams = ctx.planStreams(data, len);
+  // leaves the quantized codes built, which is the likelier pick of the two
+  ctx.quantize();
+  size_t quantized = ctx.quantizedHeaderSize(len) + (size_t)((ctx.codedBits() + 7) / 8);
+  size_t single = min(coded, quantized);
+  size_t stored = 1 + varintSize(len) + len;
+  if (stored <= single && (streams == 0 || stored <= streams)) {
+    StageTimer timer(STAGE_ENCODE);
+    out.push_back(TAG_STORED);
+    putVarint(len, out);
+    out.insert(out.end(), data, data + len);
+    timer.finish(len, stored);
+  } else if (streams != 0 && streams - streams / STREAM_SLACK <= single) {
+    ctx.encodeStreams(data, len, out);
+  } else if (quantized < coded) {
+    ctx.writeQuantized(len, out);
+    ctx.encode(data, len, out);
+  } else {
+    ctx.buildTree();
+    ctx.buildCodes();
+    ctx.writeHeader(out);
+    ctx.encode(data, len, out);
+  }
+  statsRecordGrowth(capacity, out.capacity());
+}
+
+//
+// *This function decodes the block starting at data[pos], appending its bytes
+// to out and leaving pos just past it.  It returns false if the block is
+// malformed or cut short, and ctx.decodeError() says which.  Every length is
+// checked against the input before anything is decoded or allocated.  Coded
+// and stored blocks never produce more bytes than they hold bits, but a run
+// block of a few bytes may ask for up to MAX_BLOCK_LENGTH, so that is what
+// one hostile block can cost; callers taking untrusted input bound the total.
+//
+bool decodeBlock(const uint8_t* data, size_t len, size_t& pos,
+                 vector<uint8_t>& out, HuffmanContext& ctx) {
+  uint64_t n;
+  if (pos >= len) return ctx.fail(DECODE_TRUNCATED);
+  switch (data[pos]) {
+    case TAG_STORED: {
+      StageTimer timer(STAGE_DECODE);
+      size_t start = pos++;
+      if (!getVarint(data, len, pos, n) || n > len - pos) return ctx.fail(DECODE_TRUNCATED);
+      size_t capacity = out.capacity();
+      out.insert(out.end(), data + pos, data + pos + n);
+      pos += n;
+      timer.finish(pos - start, n);
+      statsRecordGrowth(capacity, out.capacity());
+      return true;
+    }
+    case TAG_STREAMS:
+      return ctx.decodeStreams(data, len, pos, out);
+    case TAG_RLE: {
+      StageTimer timer(STAGE_DECODE);
+      size_t start = pos++;
+      if (pos >= len) return ctx.fail(DECODE_TRUNCATED);
+      uint8_t byte = data[pos++];
+      if (!getVarint(data, len, pos, n)) return ctx.fail(DECODE_TRUNCATED);
+      if (n > MAX_BLOCK_LENGTH) return ctx.fail(DECODE_BAD_HEADER);
+      size_t capacity = out.capacity();
+      out.resize(out.size() + n, byte);
+      timer.finish(pos - start, n);
+      statsRecordGrowth(capacity, out.capacity());
+      return true;
+    }
+    case '{': {
+      if (!ctx.readHeader(data, len, pos)) return false;
+      ctx.buildTree();
+      ctx.buildCodes();
+      // the header says exactly how many bytes and bits the block holds
+      n = ctx.messageLength();
+      uint64_t bits = ctx.codedBits();
+      if ((bits + 7) / NUM_BITS_IN_BYTE > len - pos) return ctx.fail(DECODE_TRUNCATED);
+      size_t before = out.size(), capacity = out.capacity();
+      out.reserve(before + n);
+      statsRecordGrowth(capacity, out.capacity());
+      if (!ctx.decode(data, len, pos, out, n) || out.size() - before != n)
+        return ctx.fail(DECODE_BAD_DATA);
+      return true;
+    }
+    case TAG_QUANTIZED: {
+      if (!ctx.readQuantized(data, len, pos, n)) return false;
+      // every byte takes at least a bit, which bounds what is reserved
+      if (n > (uint64_t)(len - pos) * NUM_BITS_IN_BYTE) return ctx.fail(DECODE_TRUNCATED);
+      ctx.buildTree();
+      ctx.buildCodes();
+      size_t before = out.size(), capacity = out.capacity();
+      out.reserve(before + n);
+      statsRecordGrowth(capacity, out.capacity());
+      // with no bit count in the header, running out of bits is the only
+      // sign the block was cut short
+      if (!ctx.decode(data, len, pos, out, n))
+        return ctx.fail(pos >= len ? DECODE_TRUNCATED : DECODE_BAD_DATA);
+      if (out.size() - before != n) return ctx.fail(DECODE_BAD_DATA);
+      return true;
+    }
+    default:
+      return ctx.fail(DECODE_BAD_HEADER);
+  }
+}
+
+//
+// *This function appends a TAG_CHECKSUM for the len raw bytes at data to out
+// and returns their CRC32C.
+//
+uint32_t appendChecksum(const uint8_t* data, size_t len, vector<uint8_t>& out) {
+  StageTimer timer(STAGE_CHECKSUM);
+  uint32_t crc = crc32c(data, len);
+  timer.finish(len, 4);
+  out.push_back(TAG_CHECKSUM);
+  _putFixed(crc, 4, out);
+  return crc;
+}
+
+//
+// *This function appends the TAG_END closing a checked stream of rawLength
+// bytes whose CRC32C is crc.
+//
+void appendEnd(uint64_t rawLength, uint32_t crc, vector<uint8_t>& out) {
+  out.push_back(TAG_END);
+  putVarint(rawLength, out);
+  _putFixed(crc, 4, out);
+}
+
+//
+// ChecksumChecker checks the TAG_CHECKSUM and TAG_END records of one stream
+// against the output decoded so far.  Each one covers the bytes since the
+// one before, which were decoded just now and are still in cache.  Callers
+// that send output on as they go call drop() before emptying out, and add()
+// for bytes that never pass through it.
+//
+struct ChecksumChecker {
+  size_t checked;   // out[0, checked) is summed into part
+  uint32_t part;    // CRC32C of the bytes since the last record
+  uint32_t crc;     // CRC32C of the bytes up to it
+  uint64_t summed;  // how many bytes those are
+  uint64_t before;  // bytes of the stream that came before out[0]
+
+  ChecksumChecker() : checked(0), part(0), crc(0), summed(0), before(0) {}
+
+  // sums the bytes out gained since the last call
+  void sum(const vector<uint8_t>& out) {
+    StageTimer timer(STAGE_CHECKSUM);
+    part = crc32c(out.data() + checked, out.size() - checked, part);
+    timer.finish(out.size() - checked, 0);
+    checked = out.size();
+  }
+
+  // sums out, which the caller is about to empty
+  void drop(const vector<uint8_t>& out) {
+    sum(out);
+    before += out.size();
+    checked = 0;
+  }
+
+  // sums len bytes of output that follow out without going into it
+  void add(const uint8_t* data, size_t len, const vector<uint8_t>& out) {
+    drop(out);
+    StageTimer timer(STAGE_CHECKSUM);
+    part = crc32c(data, len, part);
+    timer.finish(len, 0);
+    before += len;
+  }
+
+  //
+  // read:
+  // Checks the record at data[pos] and moves pos past it.  out holds
+  // everything decoded from the start of the stream, or since the last
+  // drop().  Returns
+  // DECODE_BAD_CHECKSUM if a checksum does not match, or if a TAG_END gets
+  // the length wrong or is not the last thing in data.
+  //
+  DecodeError read(const uint8_t* data, size_t len, size_t& pos,
+                   const vector<uint8_t>& out) {
+    uint8_t tag = data[pos++];
+    sum(out);
+    uint64_t decoded = before + out.size();
+    uint32_t covered = part;
+    crc = crc32cCombine(crc, part, decoded - summed);
+    summed = decoded;
+    part = 0;
+    uint64_t total = decoded;
+    if (tag == TAG_END && !getVarint(data, len, pos, total)) return DECODE_TRUNCATED;
+    if (len - pos < 4) return DECODE_TRUNCATED;
+    uint32_t stored = (uint32_t)_getFixed(data + pos, 4);
+    pos += 4;
+    bool ok = (tag == TAG_CHECKSUM) ? stored == covered
+                                    : total == decoded && stored == crc && pos == len;
+    return ok ? DECODE_OK : DECODE_BAD_CHECKSUM;
+  }
+};
+
+//
+// *This function compresses len bytes at data into out, replacing whatever
+// out held.  The result is byte-for-byte what compress() writes for a file
+// with the same contents, as long as it fits in one block.  Inputs longer
+// than MAX_BLOCK_LENGTH are split into blocks of that size.
+//
+void compressBuffer(const uint8_t* data, size_t len, vector<uint8_t>& out,
+                    HuffmanContext& ctx) {
+  out.clear();
+  size_t at = 0;
+  do {
+    size_t n = min((size_t)MAX_BLOCK_LENGTH, len - at);
+    encodeBlock(data + at, n, out, ctx);
+    at += n;
+  } while (at < len);
+}
+
+void compressBuffer(const uint8_t* data, size_t len, vector<uint8_t>& out) {
+  compressBuffer(data, len, out, threadContext());
+}
+
+//
+// *This function decompresses len bytes at data, in the format compress()
+// writes, into out.  The input may hold several blocks back to back.
+// Messages coded with a shared dictionary are decoded with
+// dictionaryRegistry().  It returns false if the data is not a complete
+// compressed stream or fails a checksum; ctx.decodeError() says which.
+//
+bool decompressBuffer(const uint8_t* data, size_t len, vector<uint8_t>& out,
+                      HuffmanContext& ctx) {
+  size_t pos = 0;
+  ChecksumChecker checker;
+  ctx.reset();
+  out.clear();
+  if (len == 0) return ctx.fail(DECODE_TRUNCATED);
+  if (data[0] == TAG_DICTIONARY)
+    return decompressWithDictionary(data, len, out, dictionaryRegistry(), ctx);
+  while (pos < len) {
+    if (data[pos] == TAG_CHECKSUM || data[pos] == TAG_END) {
+      DecodeError e = checker.read(data, len, pos, out);
+      if (e != DECODE_OK) return ctx.fail(e);
+    } else if (!decodeBlock(data, len, pos, out, ctx)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool decompressBuffer(const uint8_t* data, size_t len, vector<uint8_t>& out) {
+  return decompressBuffer(data, len, out, threadContext());
+}
@@ -0,0 +1,138 @@
+//
+// checksum.h
+//
+// CRC32C (the Castagnoli polynomial), used to check blocks and whole files.
+// x86-64 CPUs with SSE4.2 compute it with one instruction per eight bytes;
+// everywhere else a slicing-by-8 table loop handles eight bytes per step.
+// Both give the standard CRC32C: "123456789" sums to 0xe3069283.
+//
+// Checksums of neighbouring ranges can be joined without the data (see
+// crc32cCombine()), so blocks coded on different threads are each summed
+// while they are still in cache and the file's checksum is assembled from
+// theirs.
+//
+
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#pragma once
+
+enum CrcKernel { CRC_AUTO, CRC_SOFTWARE, CRC_SSE42 };
+
+// the polynomial, bit-reversed
+const uint32_t CRC32C_POLY = 0x82f63b78;
+
+//
+// The slicing-by-8 tables: t[0] is the classic byte-at-a-time table, and
+// t[k][b] is the CRC of byte b followed by k zero bytes.
+//
+struct Crc32cTables {
+  uint32_t t[8][256];
+
+  Crc32cTables() {
+    for (int b = 0; b < 256; b++) {
+      uint32_t c = b;
+      for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+      t[0][b] = c;
+    }
+    for (int b = 0; b < 256; b++) {
+      for (int k = 1; k < 8; k++) t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xff];
+    }
+  }
+};
+
+const Crc32cTables& _crc32cTables() {
+  static const Crc32cTables tables;
+  return tables;
+}
+
+// c is the raw register, without the final inversion
+uint32_t _crc32cSoftware(const uint8_t* data, size_t len, uint32_t c) {
+  const uint32_t(*t)[256] = _crc32cTables().t;
+  for (; len > 0 && ((uintptr_t)data & 7) != 0; len--)
+    c = (c >> 8) ^ t[0][(c ^ *data++) & 0xff];
+  for (; len >= 8; len -= 8, data += 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, data, 4);
+    memcpy(&hi, data + 4, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    lo = __builtin_bswap32(lo);
+    hi = __builtin_bswap32(hi);
+#endif
+    lo ^= c;
+    c = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^
+        t[4][lo >> 24] ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+        t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+  }
+  for (; len > 0; len--) c = (c >> 8) ^ t[0][(c ^ *data++) & 0xff];
+  return c;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t _crc32cSse42(const uint8_t* data, size_t len, uint32_t c) {
+  for (; len > 0 && ((uintptr_t)data & 7) != 0; len--) c = _mm_crc32_u8(c, *data++);
+  uint64_t c64 = c;
+  for (; len >= 8; len -= 8, data += 8) {
+    uint64_t v;
+    memcpy(&v, data, 8);
+    c64 = _mm_crc32_u64(c64, v);
+  }
+  c = (uint32_t)c64;
+  for (; len > 0; len--) c = _mm_crc32_u8(c, *data++);
+  return c;
+}
+#endif
+
+// true when this CPU has the CRC32 instruction
+bool crc32cHardwareSupported() {
+#if defined(__x86_64__)
+  static const bool supported = __builtin_cpu_supports("sse4.2");
+  return supported;
+#else
+  return false;
+#endif
+}
+
+//
+// *This function returns the CRC32C of len bytes at data.  Passing the
+// result for the bytes before them as crc continues it, so a range can be
+// summed in pieces.  kernel picks the implementation; CRC_AUTO uses the
+// instruction when this CPU has it.
+//
+uint32_t crc32c(const uint8_t* data, size_t len, uint32_t crc = 0,
+                CrcKernel kernel = CRC_AUTO) {
+#if defined(__x86_64__)
+  if (kernel != CRC_SOFTWARE && crc32cHardwareSupported())
+    return ~_crc32cSse42(data, len, ~crc);
+#endif
+  return ~_crc32cSoftware(data, len, ~crc);
+}
+
+// a * b modulo the polynomial, both bit-reversed
+uint32_t _crc32cMultiply(uint32_t a, uint32_t b) {
+  uint32_t p = 0;
+  for (uint32_t m = 1u << 31; m != 0; m >>= 1) {
+    if (a & m) p ^= b;
+    b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+//
+// *This function returns the CRC32C of two ranges back to back, given the
+// CRC32C of each and the length of the second.  It takes a few hundred
+// steps however long the ranges are.
+//
+uint32_t crc32cCombine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+  // multiplying crc1 by x^(8 * len2) shifts it past the second range;
+  // square is x^(2^k), starting from x^8 for one byte
+  uint32_t shift = 1u << 31, square = 1u << 23;
+  for (; len2 != 0; len2 >>= 1) {
+    if (len2 & 1) shift = _crc32cMultiply(shift, square);
+    square = _crc32cMultiply(square, square);
+  }
+  return _crc32cMultiply(shift, crc1) ^ crc2;
+}
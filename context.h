@@ -0,0 +1,630 @@
+//
+// context.h
+//
+// HuffmanContext owns everything one compression or decompression needs: the
+// histogram, an arena for the tree, the flat code table and a pair of byte
+// buffers.  Keeping one context around and calling reset() between inputs
+// means that, once its storage has grown to fit, coding more inputs does not
+// touch the heap at all.
+//
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include "bitio.h"
+#include "bitpack.h"
+#include "format.h"
+#include "huffman.h"
+#include "hashmap.h"
+#include "multistream.h"
+#include "stats.h"
+#pragma once
+
+// most bytes a "{k:v}" header may say its block holds; 2^48 keeps
+// codedBits() well inside 64 bits
+const long long MAX_HEADER_TOTAL = 1LL << 48;
+
+class HuffmanContext {
+ public:
+  HuffmanContext() {
+    nodes.reserve(2 * NUM_SYMBOLS);
+    heap.reserve(NUM_SYMBOLS);
+    reset();
+  }
+
+  //
+  // reset:
+  // Forgets the previous input.  All storage is kept for the next one.
+  //
+  void reset() {
+    error = DECODE_OK;
+    memset(counts, 0, sizeof(counts));
+    nOrder = 0;
+    table.maxLen = 0;
+    root = nullptr;
+    nodes.clear();
+    heap.clear();
+  }
+
+  //
+  // countSymbols:
+  // Builds the histogram for data, the same one buildFrequencyMap() would,
+  // PSEUDO_EOF included.
+  //
+  void countSymbols(const uint8_t* data, size_t len) {
+    countSampled(data, len, len, 1);
+  }
+
+  //
+  // countSampled:
+  // countSymbols() over a sample of data: nBlocks runs of block bytes, the
+  // first at the start, the last at the end and the rest evenly between.
+  // Runs that would overlap are counted once, so asking for more than len
+  // bytes counts all of data.
+  //
+  void countSampled(const uint8_t* data, size_t len, size_t block, size_t nBlocks) {
+    StageTimer timer(STAGE_HISTOGRAM);
+    int seen[NUM_SYMBOLS];
+    int nSeen = 0;
+    size_t counted = 0;
+    reset();
+    if (block == 0 || nBlocks == 0 || block >= len / nBlocks) {
+      block = len;
+      nBlocks = 1;
+    }
+    for (size_t b = 0; b < nBlocks; b++) {
+      size_t at = (nBlocks == 1) ? 0 : (len - block) / (nBlocks - 1) * b;
+      for (size_t i = at; i < at + block; i++) {
+        if (counts[data[i]]++ == 0) seen[nSeen++] = data[i];
+      }
+      counted += block;
+    }
+    counts[PSEUDO_EOF] = 1;
+    seen[nSeen++] = PSEUDO_EOF;
+    orderLikeHashmap(seen, nSeen);
+    timer.finish(counted, 0);
+  }
+
+  //
+  // setHistogram:
+  // Loads the histogram from a frequency map, in keys() order so the tree
+  // matches what buildEncodingTree() builds from the same map.  Returns false
+  // if the map holds a key that is not a byte or PSEUDO_EOF.
+  //
+  bool setHistogram(const hashmap& map) {
+    reset();
+    vector<int> keys = map.keys();
+    for (size_t i = 0; i < keys.size(); i++) {
+      int sym = keySymbol(keys[i]);
+      long long value = map.get(keys[i]);
+      if (sym < 0 || value <= 0 || counts[sym] != 0) return false;
+      counts[sym] = value;
+      order[nOrder++] = sym;
+    }
+    return true;
+  }
+
+  //
+  // writeHeader:
+  // Appends the histogram to out as "{k:v, k:v}", exactly as
+  // operator<<(ostream&, hashmap&) would print a map built from the same input.
+  //
+  void writeHeader(vector<uint8_t>& out) const {
+    out.push_back('{');
+    for (int i = 0; i < nOrder; i++) {
+      if (i != 0) {
+        out.push_back(',');
+        out.push_back(' ');
+      }
+      appendInt(symbolKey(order[i]), out);
+      out.push_back(':');
+      appendInt((long long)counts[order[i]], out);
+    }
+    out.push_back('}');
+  }
+
+  //
+  // headerSize:
+  // Number of bytes writeHeader() would append, without writing them.
+  //
+  size_t headerSize() const {
+    // braces, one ':' per entry and ", " between entries
+    size_t n = 2 + nOrder + (nOrder > 0 ? 2 * (nOrder - 1) : 0);
+    for (int i = 0; i < nOrder; i++)
+      n += intLength(symbolKey(order[i])) + intLength((long long)counts[order[i]]);
+    return n;
+  }
+
+  //
+  // readHeader:
+  // Loads the histogram from a header written by writeHeader(), leaving pos
+  // just past the closing brace.  Returns false if the header is malformed,
+  // with decodeError() saying how.  A header that parses still has to hold
+  // PSEUDO_EOF, and its counts have to add up to at most MAX_HEADER_TOTAL.
+  //
+  bool readHeader(const uint8_t* data, size_t len, size_t& pos) {
+    long long total = 0;
+    reset();
+    if (pos >= len) return fail(DECODE_TRUNCATED);
+    if (data[pos++] != '{') return fail(DECODE_BAD_HEADER);
+    while (true) {
+      long long key, value;
+      bool ok = parseInt(data, len, pos, key, 2147483647LL) && pos < len && data[pos] == ':' &&
+                parseInt(data, len, ++pos, value, MAX_HEADER_TOTAL);
+      if (!ok) return fail(pos >= len ? DECODE_TRUNCATED : DECODE_BAD_HEADER);
+
+      int sym = keySymbol((int)key);
+      if (sym < 0 || value <= 0 || counts[sym] != 0) return fail(DECODE_BAD_HEADER);
+      counts[sym] = value;
+      order[nOrder++] = sym;
+      total += value;
+      if (total > MAX_HEADER_TOTAL) return fail(DECODE_BAD_CODES);
+
+      if (pos >= len) return fail(DECODE_TRUNCATED);
+      if (data[pos] == '}') {
+        pos++;
+        break;
+      }
+      if (len - pos < 2) return fail(DECODE_TRUNCATED);
+      if (data[pos] != ',' || data[pos + 1] != ' ') return fail(DECODE_BAD_HEADER);
+      pos += 2;
+    }
+    if (counts[PSEUDO_EOF] == 0) return fail(DECODE_BAD_CODES);
+    return true;
+  }
+
+  //
+  // buildTree:
+  // Builds the same tree buildEncodingTree() would for the histogram, out of
+  // the arena, counts scaled the same way.
+  //
+  HuffmanNode* buildTree() { return buildTreeFrom(counts, order, nOrder); }
+
+  //
+  // buildCodes:
+  // Fills the flat code table from the tree, mirroring buildEncodingMap().
+  //
+  void buildCodes() {
+    StageTimer timer(STAGE_CODES);
+    assignCodes(root, 0, 0);
+    table.finish(order, nOrder);
+    statsRecordTreeDepth(table.maxLen);
+  }
+
+  //
+  // quantize:
+  // Scales the histogram to counts that add up to QUANT_TOTAL, none below 1,
+  // and builds the tree and codes for those in place of the exact ones.
+  // codedBits() still weighs the codes by the real counts, so it is the size
+  // of the codes in a TAG_QUANTIZED block.
+  //
+  void quantize() {
+    uint64_t total = 0, rest;
+    int sum = 0, rare = 0;
+    nQuant = 0;
+    for (int i = 0; i < nOrder; i++) total += counts[order[i]];
+    if (total == 0) return;
+    // symbols that would round below 1 get 1, and the rest share what is
+    // left, to nearest, so only a few units are left over below
+    rest = total;
+    for (int i = 0; i < nOrder; i++) {
+      if ((unsigned __int128)counts[order[i]] * QUANT_TOTAL < total) {
+        rest -= counts[order[i]];
+        rare++;
+      }
+    }
+    for (int sym = 0; sym < NUM_SYMBOLS; sym++) {
+      quant[sym] = 0;
+      if (counts[sym] == 0) continue;
+      if ((unsigned __int128)counts[sym] * QUANT_TOTAL < total) {
+        quant[sym] = 1;
+      } else {
+        unsigned __int128 share = (unsigned __int128)counts[sym] * (QUANT_TOTAL - rare);
+        quant[sym] = max<uint64_t>((uint64_t)((share + rest / 2) / rest), 1);
+      }
+      sum += (int)quant[sym];
+      quantOrder[nQuant++] = sym;
+    }
+    // each unit left over goes to, or comes from, the symbol whose codes it
+    // changes least: a unit is worth about count / quant bits to a symbol
+    while (sum < QUANT_TOTAL) {
+      int best = quantOrder[0];
+      for (int i = 1; i < nQuant; i++) {
+        int s = quantOrder[i];
+        if ((double)counts[s] / quant[s] > (double)counts[best] / quant[best]) best = s;
+      }
+      quant[best]++;
+      sum++;
+    }
+    while (sum > QUANT_TOTAL) {
+      int best = -1;
+      for (int i = 0; i < nQuant; i++) {
+        int s = quantOrder[i];
+        if (quant[s] > 1 && (best < 0 || (double)counts[s] / (quant[s] - 1) <
+                                             (double)counts[best] / (quant[best] - 1)))
+          best = s;
+      }
+      quant[best]--;
+      sum--;
+    }
+    buildTreeFrom(quant, quantOrder, nQuant);
+    buildCodes();
+  }
+
+  //
+  // writeQuantized:
+  // Appends everything of a TAG_QUANTIZED block for len bytes that comes
+  // before the codes encode() appends, once quantize() has run.  The counts
+  // are bit-packed for symbols 0 to PSEUDO_EOF, each in just enough bits to
+  // hold what is left of QUANT_TOTAL, so they get cheaper as it is used up
+  // and stop when it is.  A zero is followed by the length of the run of
+  // zeros it starts, Elias gamma coded, so absent bytes cost a few bits a run.
+  //
+  void writeQuantized(size_t len, vector<uint8_t>& out) const {
+    out.push_back(TAG_QUANTIZED);
+    putVarint(len, out);
+    BitWriter bits(out);
+    packQuantized(&bits);
+  }
+
+  // bytes writeQuantized() appends
+  size_t quantizedHeaderSize(size_t len) const {
+    return 1 + varintSize(len) + (packQuantized(nullptr) + 7) / 8;
+  }
+
+  //
+  // readQuantized:
+  // Reads what writeQuantized() wrote at data[pos] into the histogram, sets
+  // n to the block's length and leaves pos on the codes.  Returns false if
+  // it is malformed, with decodeError() saying how.  Like readHeader(), the
+  // counts have to hold PSEUDO_EOF.
+  //
+  bool readQuantized(const uint8_t* data, size_t len, size_t& pos, uint64_t& n) {
+    reset();
+    if (pos >= len) return fail(DECODE_TRUNCATED);
+    if (data[pos++] != TAG_QUANTIZED) return fail(DECODE_BAD_HEADER);
+    if (!getVarint(data, len, pos, n)) return fail(DECODE_TRUNCATED);
+    if (n > MAX_BLOCK_LENGTH) return fail(DECODE_BAD_HEADER);
+    BitReader bits(data + pos, len - pos);
+    int left = QUANT_TOTAL;
+    for (int sym = 0; left > 0; sym++) {
+      uint64_t q, run;
+      if (sym >= NUM_SYMBOLS) return fail(DECODE_BAD_HEADER);
+      if (!bits.readBits(bitWidth(left), q)) return fail(DECODE_TRUNCATED);
+      if (q > (uint64_t)left) return fail(DECODE_BAD_HEADER);
+      if (q == 0) {
+        // no run is longer than NUM_SYMBOLS, which takes 8 zeros
+        int k = 0, bit;
+        while ((bit = bits.readBit()) == 0)
+          if (++k > 8) return fail(DECODE_BAD_HEADER);
+        if (bit == EOF || !bits.readBits(k, run)) return fail(DECODE_TRUNCATED);
+        sym += (int)(run | (uint64_t)1 << k) - 1;
+        continue;
+      }
+      counts[sym] = q;
+      order[nOrder++] = sym;
+      left -= (int)q;
+    }
+    if (counts[PSEUDO_EOF] == 0) return fail(DECODE_BAD_CODES);
+    pos += bits.bytePosition();
+    return true;
+  }
+
+  //
+  // encode:
+  // Appends the codes for data followed by PSEUDO_EOF to out, least
+  // significant bit first like obitstream, and pads the last byte with zeros.
+  //
+  void encode(const uint8_t* data, size_t len, vector<uint8_t>& out) const {
+    StageTimer timer(STAGE_ENCODE);
+    size_t before = out.size();
+    packCodes(data, len, table, out);
+    timer.finish(len, out.size() - before);
+    statsRecordCodes(len + 1, 8 * (out.size() - before));
+  }
+
+  //
+  // decode:
+  // Walks the tree over the bits starting at data[pos], appending symbols to
+  // out until PSEUDO_EOF.  pos is left on the byte after the one holding the
+  // end of PSEUDO_EOF.  Returns false if the bits run out first or more than
+  // limit symbols come before PSEUDO_EOF.
+  //
+  // The tree comes from buildTree(), so every inner node has both children
+  // and the walk needs no null checks.
+  //
+  bool decode(const uint8_t* data, size_t len, size_t& pos,
+              vector<uint8_t>& out, uint64_t limit = UINT64_MAX) const {
+    StageTimer timer(STAGE_DECODE);
+    size_t start = pos, before = out.size();
+    bool ok = walkTree(data, len, pos, out, limit);
+    timer.finish(pos - start, out.size() - before);
+    return ok;
+  }
+
+  //
+  // planStreams:
+  // Builds the multi-stream codes for the histogram from countSymbols() on the
+  // same data and returns the size of that block, or 0 if it cannot be used.
+  //
+  size_t planStreams(const uint8_t* data, size_t len) {
+    StageTimer timer(STAGE_CODES);
+    return streams.plan(counts, data, len);
+  }
+
+  // appends the block planStreams() measured
+  void encodeStreams(const uint8_t* data, size_t len, vector<uint8_t>& out) const {
+    StageTimer timer(STAGE_ENCODE);
+    size_t before = out.size();
+    streams.encode(data, len, out);
+    timer.finish(len, out.size() - before);
+    statsRecordCodes(len, 8 * (out.size() - before));
+  }
+
+  bool decodeStreams(const uint8_t* data, size_t len, size_t& pos,
+                     vector<uint8_t>& out) {
+    StageTimer timer(STAGE_DECODE);
+    size_t start = pos, before = out.size();
+    bool ok = streams.decode(data, len, pos, out);
+    timer.finish(pos - start, out.size() - before);
+    return ok || fail(streams.lastError());
+  }
+
+  //
+  // decodeError:
+  // Why the last readHeader(), decodeStreams(), decodeBlock() or
+  // decompressBuffer() on this context failed; DECODE_OK after reset().
+  //
+  DecodeError decodeError() const { return error; }
+
+  // records e as the reason decoding failed, and returns false
+  bool fail(DecodeError e) {
+    error = e;
+    return false;
+  }
+
+  //
+  // messageLength:
+  // Number of bytes the histogram's counts add up to, PSEUDO_EOF aside: what
+  // a block with this header decodes to.
+  //
+  uint64_t messageLength() const {
+    uint64_t n = 0;
+    for (int i = 0; i < nOrder; i++)
+      if (order[i] != PSEUDO_EOF) n += counts[order[i]];
+    return n;
+  }
+
+  uint64_t count(int sym) const { return counts[sym]; }
+  int symbolCount() const { return nOrder; }
+  uint64_t codeOf(int sym) const { return table.code[sym]; }
+  int codeLength(int sym) const { return table.len[sym]; }
+  int maxCodeLength() const { return table.maxLen; }
+  const CodeTable& codeTable() const { return table; }
+  HuffmanNode* tree() const { return root; }
+
+  //
+  // codedBits:
+  // Number of bits encode() produces for the current histogram and codes.
+  //
+  long long codedBits() const {
+    long long bits = 0;
+    for (int i = 0; i < nOrder; i++)
+      bits += (long long)counts[order[i]] * table.len[order[i]];
+    return bits;
+  }
+
+  // scratch byte buffers for callers that need to stage input or output
+  vector<uint8_t>& inputBuffer() { return input; }
+  vector<uint8_t>& outputBuffer() { return output; }
+
+ private:
+  uint64_t counts[NUM_SYMBOLS];
+  int order[NUM_SYMBOLS];      // symbols in the order hashmap::keys() reports
+  int nOrder;
+  uint64_t quant[NUM_SYMBOLS];  // counts quantize() scaled to QUANT_TOTAL
+  int quantOrder[NUM_SYMBOLS];  // the symbols they are not 0 for, in order
+  int nQuant;
+  CodeTable table;
+  MultiStreamCoder streams;
+  vector<HuffmanNode> nodes;   // tree arena, never grows past 2 * NUM_SYMBOLS
+  vector<HuffmanNode*> heap;   // stands in for buildEncodingTree's queue
+  HuffmanNode* root;
+  vector<uint8_t> input;
+  vector<uint8_t> output;
+  DecodeError error;
+
+  // contexts own pointers into their own arena, so they are not copyable
+  HuffmanContext(const HuffmanContext&) = delete;
+  HuffmanContext& operator=(const HuffmanContext&) = delete;
+
+  //
+  // Converts between symbol indexes and the keys buildFrequencyMap() stores.
+  // It keys bytes by (int)char, so bytes above 0x7f show up as negative keys.
+  //
+  static int symbolKey(int sym) {
+    return (sym == PSEUDO_EOF) ? PSEUDO_EOF : (int)(signed char)sym;
+  }
+
+  static int keySymbol(int key) {
+    if (key == PSEUDO_EOF) return PSEUDO_EOF;
+    if (key < -128 || key > 255) return -1;
+    return key & 0xFF;
+  }
+
+  //
+  // Sorts symbols, given in first-seen order, into the order a hashmap
+  // filled in that order would list them: bucket by bucket, and within a
+  // bucket in insertion order.
+  //
+  void orderLikeHashmap(const int* seen, int nSeen) {
+    nOrder = 0;
+    for (int b = 0; b < hashmap::DEFAULT_BUCKETS; b++) {
+      for (int i = 0; i < nSeen; i++) {
+        if (hashmap::bucketOf(symbolKey(seen[i])) == b)
+          order[nOrder++] = seen[i];
+      }
+    }
+  }
+
+  //
+  // Builds the tree for the weights of the n symbols in syms, adding leaves
+  // in that order.  std::priority_queue is specified in terms of push_heap
+  // and pop_heap, so doing that by hand keeps ties broken identically.
+  //
+  HuffmanNode* buildTreeFrom(const uint64_t* weights, const int* syms, int n) {
+    StageTimer timer(STAGE_TREE);
+    Compare cmp;
+    nodes.clear();
+    heap.clear();
+    uint64_t total = 0;
+    for (int i = 0; i < n; i++) total += weights[syms[i]];
+    int shift = treeWeightShift(total, n);
+    for (int i = 0; i < n; i++) {
+      HuffmanNode leaf = {syms[i], treeWeight(weights[syms[i]], shift), nullptr, nullptr};
+      nodes.push_back(leaf);
+      heap.push_back(&nodes.back());
+      push_heap(heap.begin(), heap.end(), cmp);
+    }
+
+    while (heap.size() > 1) {
+      pop_heap(heap.begin(), heap.end(), cmp);
+      HuffmanNode* l = heap.back();
+      heap.pop_back();
+      pop_heap(heap.begin(), heap.end(), cmp);
+      HuffmanNode* r = heap.back();
+      heap.pop_back();
+      HuffmanNode node = {NOT_A_CHAR, l->count + r->count, l, r};
+      nodes.push_back(node);
+      heap.push_back(&nodes.back());
+      push_heap(heap.begin(), heap.end(), cmp);
+    }
+    root = heap.empty() ? nullptr : heap.front();
+    return root;
+  }
+
+  // bits needed to write any number from 0 to v
+  static int bitWidth(int v) { return 32 - __builtin_clz((unsigned)v | 1); }
+
+  //
+  // Writes the counts quantize() made to bits as writeQuantized() describes,
+  // or only measures them if bits is null.  Returns the number of bits.
+  // PSEUDO_EOF is never 0, so every run of zeros ends before it.
+  //
+  size_t packQuantized(BitWriter* bits) const {
+    size_t n = 0;
+    int left = QUANT_TOTAL;
+    for (int sym = 0; left > 0; sym++) {
+      int width = bitWidth(left);
+      if (bits != nullptr) bits->writeBits(quant[sym], width);
+      n += width;
+      if (quant[sym] != 0) {
+        left -= (int)quant[sym];
+        continue;
+      }
+      int run = 1;
+      while (quant[sym + run] == 0) run++;
+      int k = bitWidth(run) - 1;
+      if (bits != nullptr) {
+        bits->writeBits(0, k);
+        bits->writeBit(1);
+        bits->writeBits(run, k);
+      }
+      n += 2 * k + 1;
+      sym += run - 1;
+    }
+    return n;
+  }
+
+  // decode() without the timer
+  bool walkTree(const uint8_t* data, size_t len, size_t& pos,
+                vector<uint8_t>& out, uint64_t limit) const {
+    if (root == nullptr) return false;
+    if (isLeaf(root)) {
+      // a lone PSEUDO_EOF is coded as "1" even though the tree is one leaf
+      if (root->character != PSEUDO_EOF || pos >= len) return false;
+      pos++;
+      return true;
+    }
+    HuffmanNode* cur = root;
+    for (; pos < len; pos++) {
+      int byte = data[pos];
+      for (int b = 0; b < NUM_BITS_IN_BYTE; b++) {
+        cur = ((byte >> b) & 1) ? cur->one : cur->zero;
+        if (isLeaf(cur)) {
+          if (cur->character == PSEUDO_EOF) {
+            pos++;
+            return true;
+          }
+          if (limit-- == 0) return false;
+          out.push_back((uint8_t)cur->character);
+          cur = root;
+        }
+      }
+    }
+    return false;
+  }
+
+  //
+  // Codes stay well under the 56 bits BitPacker takes at once: a depth-45
+  // tree already needs counts that add up to more than an int can hold,
+  // and buildTree() scales bigger ones down to fit one.
+  //
+  void assignCodes(HuffmanNode* node, uint64_t path, int depth) {
+    if (node == nullptr) return;
+    if (isLeaf(node)) {
+      table.code[node->character] = (depth != 0) ? path : 1;
+      table.len[node->character] = (depth != 0) ? depth : 1;
+      return;
+    }
+    assignCodes(node->zero, path, depth + 1);
+    assignCodes(node->one, path | ((uint64_t)1 << depth), depth + 1);
+  }
+
+  static void appendInt(long long value, vector<uint8_t>& out) {
+    char digits[24];
+    int n = 0;
+    unsigned long long v = (value < 0) ? -(unsigned long long)value : value;
+    do {
+      digits[n++] = (char)('0' + v % 10);
+      v /= 10;
+    } while (v != 0);
+    if (value < 0) out.push_back('-');
+    while (n > 0) out.push_back(digits[--n]);
+  }
+
+  static int intLength(long long value) {
+    int n = (value < 0) ? 2 : 1;
+    unsigned long long v = (value < 0) ? -(unsigned long long)value : value;
+    while (v >= 10) {
+      v /= 10;
+      n++;
+    }
+    return n;
+  }
+
+  // reads a decimal no bigger than limit either side of zero
+  static bool parseInt(const uint8_t* data, size_t len, size_t& pos,
+                       long long& value, long long limit) {
+    bool negative = (pos < len && data[pos] == '-');
+    if (negative) pos++;
+    if (pos >= len || data[pos] < '0' || data[pos] > '9') return false;
+    long long v = 0;
+    while (pos < len && data[pos] >= '0' && data[pos] <= '9') {
+      v = v * 10 + (data[pos++] - '0');
+      if (v > limit) return false;
+    }
+    value = negative ? -v : v;
+    return true;
+  }
+};
+
+//
+// Returns the calling thread's context, for callers that do not manage their
+// own.
+//
+HuffmanContext& threadContext() {
+  static thread_local HuffmanContext ctx;
+  return ctx;
+}
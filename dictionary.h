@@ -0,0 +1,216 @@
+//
+// dictionary.h
+//
+// Shared code tables for small messages.  A dictionary is a frequency table
+// trained ahead of time (see trainDictionary() in util.h) and saved under a
+// numeric id.  Messages coded with it carry only the id instead of their own
+// "{k:v, ...}" header, which for inputs of a few KB is most of the output.
+//
+// A dictionary file is the line "HUFDICT <id>" followed by the table in the
+// same text form compress() writes.
+//
+
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "context.h"
+#include "format.h"
+#include "mymap.h"
+#include "snapshotmap.h"
+#pragma once
+
+class HuffmanDictionary {
+ public:
+  //
+  // Builds a dictionary from a trained frequency map.  Check complete()
+  // before using it: a dictionary has to give every byte a code.
+  //
+  HuffmanDictionary(uint32_t id, const hashmap& freq) : dictId(id) {
+    if (ctx.setHistogram(freq)) prepare();
+  }
+
+  HuffmanDictionary(uint32_t id) : dictId(id) {}
+
+  uint32_t id() const { return dictId; }
+
+  //
+  // complete:
+  // True when the table covers all 256 bytes plus PSEUDO_EOF, so any message
+  // can be coded with it.
+  //
+  bool complete() const { return ctx.tree() != nullptr; }
+
+  // the prepared tree and code table; shared read-only by every user
+  const HuffmanContext& codes() const { return ctx; }
+
+  bool save(const string& filename) const {
+    vector<uint8_t> header;
+    ctx.writeHeader(header);
+    ofstream out(filename, ios::binary);
+    out << "HUFDICT " << dictId << "\n";
+    out.write((const char*)header.data(), header.size());
+    return (bool)out;
+  }
+
+  //
+  // load:
+  // Reads a dictionary written by save().  Returns false if the file is
+  // missing, malformed, or does not cover every symbol.
+  //
+  bool load(const string& filename) {
+    ifstream in(filename, ios::binary);
+    string magic;
+    long long id = -1;
+    if (!(in >> magic >> id) || magic != "HUFDICT" || id < 0 ||
+        id > 0xffffffffLL || in.get() != '\n')
+      return false;
+    vector<uint8_t> header((istreambuf_iterator<char>(in)),
+                           istreambuf_iterator<char>());
+    size_t pos = 0;
+    dictId = (uint32_t)id;
+    return read(header.data(), header.size(), pos);
+  }
+
+  //
+  // read:
+  // Loads the table from its "{k:v, ...}" text starting at data[pos], leaving
+  // pos just past it.  Returns false if it is malformed or incomplete.
+  //
+  bool read(const uint8_t* data, size_t len, size_t& pos) {
+    if (!ctx.readHeader(data, len, pos)) return false;
+    prepare();
+    return complete();
+  }
+
+ private:
+  uint32_t dictId;
+  HuffmanContext ctx;
+
+  void prepare() {
+    if (ctx.symbolCount() != NUM_SYMBOLS) return;
+    ctx.buildTree();
+    ctx.buildCodes();
+  }
+};
+
+//
+// DictionaryRegistry caches loaded dictionaries by id so decoders build each
+// table once.  On a miss it looks for "<directory>/<id>.dict".  Lookups of
+// loaded dictionaries take no lock (see snapshotmap.h), so any number of
+// decoding threads can share one registry while others add to it.
+//
+class DictionaryRegistry {
+ public:
+  DictionaryRegistry() : directory(".") {}
+
+  ~DictionaryRegistry() {
+    vector<pair<uint32_t, HuffmanDictionary*> > all = dicts.snapshot().toVector();
+    for (size_t i = 0; i < all.size(); i++) delete all[i].second;
+  }
+
+  void setDirectory(const string& dir) { directory = dir; }
+
+  //
+  // add:
+  // Takes ownership of dict.  Returns false (and deletes it) if it is
+  // incomplete or its id is already registered.
+  //
+  bool add(HuffmanDictionary* dict) {
+    if (!dict->complete() || !dicts.putIfAbsent(dict->id(), dict)) {
+      delete dict;
+      return false;
+    }
+    return true;
+  }
+
+  bool load(const string& filename) {
+    HuffmanDictionary* dict = new HuffmanDictionary(0);
+    if (!dict->load(filename)) {
+      delete dict;
+      return false;
+    }
+    return add(dict);
+  }
+
+  //
+  // find:
+  // Returns the dictionary with the given id, loading it from the registry's
+  // directory the first time it is asked for, or nullptr if there is none.
+  // Threads that miss at the same time may each load the file; the first to
+  // add it wins and the rest use that one.
+  //
+  const HuffmanDictionary* find(uint32_t id) {
+    HuffmanDictionary* dict = dicts.get(id);
+    if (dict == nullptr) {
+      stringstream path;
+      path << directory << "/" << id << ".dict";
+      load(path.str());
+      dict = dicts.get(id);
+    }
+    return dict;
+  }
+
+ private:
+  SnapshotMap<uint32_t, HuffmanDictionary*> dicts;
+  string directory;
+
+  DictionaryRegistry(const DictionaryRegistry&) = delete;
+  DictionaryRegistry& operator=(const DictionaryRegistry&) = delete;
+};
+
+//
+// Returns the registry decompressBuffer() uses for dictionary messages.  Set
+// its directory before sharing it between threads; adding and finding
+// dictionaries is safe from any of them.
+//
+DictionaryRegistry& dictionaryRegistry() {
+  static DictionaryRegistry registry;
+  return registry;
+}
+
+//
+// *This function codes len bytes at data with a shared dictionary, replacing
+// the contents of out.  No frequency header is written, only the id.
+//
+void compressWithDictionary(const uint8_t* data, size_t len,
+                            const HuffmanDictionary& dict,
+                            vector<uint8_t>& out) {
+  out.clear();
+  out.push_back(TAG_DICTIONARY);
+  putVarint(dict.id(), out);
+  dict.codes().encode(data, len, out);
+}
+
+//
+// *This function decodes a message written by compressWithDictionary(),
+// finding its dictionary in registry.  It returns false if the dictionary is
+// unknown, the message is incomplete, or anything follows it, and
+// ctx.decodeError() says which.
+//
+bool decompressWithDictionary(const uint8_t* data, size_t len,
+                              vector<uint8_t>& out,
+                              DictionaryRegistry& registry,
+                              HuffmanContext& ctx) {
+  size_t pos = 1;
+  uint64_t id;
+  out.clear();
+  if (len == 0) return ctx.fail(DECODE_TRUNCATED);
+  if (data[0] != TAG_DICTIONARY) return ctx.fail(DECODE_BAD_HEADER);
+  if (!getVarint(data, len, pos, id)) return ctx.fail(DECODE_TRUNCATED);
+  const HuffmanDictionary* dict =
+      (id > 0xffffffffULL) ? nullptr : registry.find((uint32_t)id);
+  if (dict == nullptr) return ctx.fail(DECODE_BAD_HEADER);
+  if (!dict->codes().decode(data, len, pos, out))
+    return ctx.fail(pos >= len ? DECODE_TRUNCATED : DECODE_BAD_DATA);
+  return pos == len || ctx.fail(DECODE_BAD_DATA);
+}
+
+bool decompressWithDictionary(const uint8_t* data, size_t len,
+                              vector<uint8_t>& out,
+                              DictionaryRegistry& registry) {
+  HuffmanContext& ctx = threadContext();
+  ctx.reset();
+  return decompressWithDictionary(data, len, out, registry, ctx);
+}
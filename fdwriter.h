@@ -0,0 +1,207 @@
+//
+// fdwriter.h
+//
+// Writing decoded output to a file descriptor without copying it more than
+// it has to be.  FdWriter hands out a buffer to decode into and sends it on
+// once it holds FD_WRITE_CHUNK bytes: with vmsplice() when the descriptor is
+// a pipe, which gives the pipe the buffer's pages instead of copying them,
+// and with write() otherwise.  Bytes that already sit in a file, like a
+// stored block of a .huf file, are copied by the kernel with copyFrom()
+// and never enter user space at all.
+//
+// A spliced page stays in the pipe until the reader takes it, so a buffer
+// is not decoded into again until that has happened.  The pipe is sized to
+// one chunk, which makes it so once the next full chunk has gone in after
+// it; finish() waits for the reader to take whatever is still spliced.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#pragma once
+
+using namespace std;
+
+// bytes FdWriter collects before sending them on
+const size_t FD_WRITE_CHUNK = 1 << 20;
+
+bool _writeAll(int fd, const uint8_t* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+//
+// Copies n bytes starting at offset in fdIn to the current position of fdOut
+// inside the kernel: copy_file_range() between files, sendfile() when that is
+// not supported, and a plain read/write loop as the last resort.
+//
+bool _copyRange(int fdIn, off_t offset, size_t n, int fdOut) {
+  while (n > 0) {
+    ssize_t done = copy_file_range(fdIn, &offset, fdOut, nullptr, n, 0);
+    if (done < 0 && errno == EINTR) continue;
+    if (done <= 0) done = sendfile(fdOut, fdIn, &offset, n);
+    if (done < 0 && errno == EINTR) continue;
+    if (done <= 0) {
+      char buf[1 << 16];
+      done = pread(fdIn, buf, min(n, sizeof(buf)), offset);
+      if (done < 0 && errno == EINTR) continue;
+      if (done <= 0 || !_writeAll(fdOut, (const uint8_t*)buf, done)) return false;
+      offset += done;
+    }
+    n -= done;
+  }
+  return true;
+}
+
+class FdWriter {
+ public:
+  explicit FdWriter(int fd, size_t chunk = FD_WRITE_CHUNK)
+      : fd(fd), chunk(chunk), current(0), written(0), pipeSize(0), failed(false) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+      // fails quietly past /proc/sys/fs/pipe-max-size; the size is read back
+      fcntl(fd, F_SETPIPE_SZ, (int)chunk);
+      int size = fcntl(fd, F_GETPIPE_SZ);
+      if (size > 0) pipeSize = size;
+    }
+    for (int i = 0; i < 2; i++) spliceEnd[i] = 0;
+  }
+
+  // gives up on unflushed output, but not before spliced pages are read
+  ~FdWriter() {
+    for (int i = 0; i < 2 && !failed; i++) failed = !_waitUntilRead(spliceEnd[i]);
+  }
+
+  //
+  // buffer:
+  // Where the next output goes.  Append to it, then call flush() once
+  // full() says so.
+  //
+  vector<uint8_t>& buffer() { return bufs[current]; }
+
+  bool full() const { return bufs[current].size() >= chunk; }
+
+  //
+  // flush:
+  // Sends the buffer on and switches to the other one.  Returns false if
+  // the descriptor stopped taking output.
+  //
+  bool flush() {
+    vector<uint8_t>& buf = bufs[current];
+    if (!failed && !buf.empty()) {
+      // splicing a pipe's worth pushes the buffer before it out of the pipe;
+      // anything smaller is cheaper to copy
+      if (pipeSize > 0 && buf.size() >= pipeSize) {
+        failed = !_splice(buf.data(), buf.size());
+        spliceEnd[current] = written + buf.size();
+      } else {
+        failed = !_writeAll(fd, buf.data(), buf.size());
+      }
+      written += buf.size();
+    }
+    current ^= 1;
+    // the next buffer may still be in the pipe if little went in after it
+    if (!failed && !_waitUntilRead(spliceEnd[current])) failed = true;
+    bufs[current].clear();
+    return !failed;
+  }
+
+  //
+  // copyFrom:
+  // Flushes, then has the kernel copy n bytes at offset in fdIn to the
+  // output.
+  //
+  bool copyFrom(int fdIn, uint64_t offset, uint64_t n) {
+    if (!flush()) return false;
+    failed = !_copyRange(fdIn, offset, n, fd);
+    written += n;
+    return !failed;
+  }
+
+  //
+  // finish:
+  // Flushes and, if anything was spliced, waits for the reader to take it,
+  // after which the buffers can go.  Returns false if any output was lost.
+  //
+  bool finish() {
+    flush();
+    for (int i = 0; i < 2 && !failed; i++) failed = !_waitUntilRead(spliceEnd[i]);
+    return !failed;
+  }
+
+  // bytes sent on so far
+  uint64_t bytesWritten() const { return written; }
+
+  // whether output goes to a pipe by vmsplice()
+  bool splicing() const { return pipeSize > 0; }
+
+ private:
+  int fd;
+  size_t chunk;
+  vector<uint8_t> bufs[2];
+  int current;
+  uint64_t written;      // bytes given to fd
+  uint64_t spliceEnd[2]; // written just after each buffer was last spliced
+  size_t pipeSize;       // 0 unless fd is a pipe
+  bool failed;
+
+  bool _splice(const uint8_t* data, size_t len) {
+    struct iovec iov;
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+    while (iov.iov_len > 0) {
+      ssize_t n = vmsplice(fd, &iov, 1, 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      iov.iov_base = (uint8_t*)iov.iov_base + n;
+      iov.iov_len -= n;
+    }
+    return true;
+  }
+
+  //
+  // Waits until the reader has taken every byte up to end: the bytes still
+  // in the pipe are all ones written after it.  Returns false if the reader
+  // went away first.
+  //
+  // A pipe wakes its writer when it has room, not when it has drained to a
+  // given level.  So while the pipe is full this blocks in poll() for
+  // POLLOUT.  Once it has room, the reader is taking pages and FIONREAD is
+  // checked again after a pause.  The pause starts at 50us and doubles up to
+  // a millisecond, so a slow reader costs next to no CPU.  poll() still
+  // wakes at once if the reader hangs up.
+  //
+  bool _waitUntilRead(uint64_t end) {
+    if (pipeSize == 0 || written - end >= pipeSize) return true;
+    long pause = 50;  // microseconds
+    while (true) {
+      int unread = 0;
+      if (ioctl(fd, FIONREAD, &unread) != 0) return false;
+      if ((uint64_t)unread <= written - end) return true;
+      bool full = (uint64_t)unread >= pipeSize;
+      struct pollfd p = {fd, (short)(full ? POLLOUT : 0), 0};
+      struct timespec t = {0, pause * 1000};
+      int r = ppoll(&p, 1, full ? nullptr : &t, nullptr);
+      if (r < 0 && errno != EINTR) return false;
+      if (r > 0 && (p.revents & (POLLERR | POLLHUP))) return false;
+      if (!full) pause = min(2 * pause, 1000L);
+    }
+  }
+
+  FdWriter(const FdWriter&) = delete;
+  FdWriter& operator=(const FdWriter&) = delete;
+};
@@ -0,0 +1,118 @@
+//
+// format.h
+//
+// Compressed data starts either with '{', for the single-table stream
+// compress() has always written, or with one of the tag bytes below.  Tags
+// all have the high bit set so they can never be mistaken for a header.
+//
+
+#include <cstdint>
+#include <vector>
+#pragma once
+
+// a message coded with a shared dictionary: tag, varint dictionary id, bits
+const uint8_t TAG_DICTIONARY = 0x80;
+
+// bytes that did not shrink, copied as is: tag, varint length, bytes
+const uint8_t TAG_STORED = 0x81;
+
+// one byte value repeated: tag, the byte, varint repeat count
+const uint8_t TAG_RLE = 0x82;
+
+// interleaved bit streams with a jump table (see multistream.h)
+const uint8_t TAG_STREAMS = 0x83;
+
+// CRC32C of the raw bytes since the previous checksum or the start: tag, the
+// 4-byte CRC
+const uint8_t TAG_CHECKSUM = 0x84;
+
+// the last thing in a checked file: tag, varint raw length, 4-byte CRC32C of
+// all the raw bytes
+const uint8_t TAG_END = 0x85;
+
+// a Huffman block whose counts are scaled to add up to QUANT_TOTAL, so its
+// table does not grow with the input: tag, varint length, the counts packed
+// as HuffmanContext::writeQuantized() describes, then the codes as in a '{'
+// block
+const uint8_t TAG_QUANTIZED = 0x86;
+
+// 2^13 keeps what rounding costs the codes under 0.1% on text and binaries
+const int QUANT_BITS = 13;
+const int QUANT_TOTAL = 1 << QUANT_BITS;
+
+// the longest block decoders accept; a run or length beyond it is taken for
+// corruption rather than a request for that much memory
+const uint64_t MAX_BLOCK_LENGTH = 1 << 28;
+
+//
+// Why decoding failed.  Every check runs before the bits it protects are
+// decoded, so the decoding loops themselves need few branches.
+//
+enum DecodeError {
+  DECODE_OK,
+  DECODE_TRUNCATED,     // the input ends inside a block
+  DECODE_BAD_HEADER,    // a tag, header or length field that cannot be right
+  DECODE_BAD_CODES,     // counts or code lengths that make no usable code
+  DECODE_BAD_DATA,      // bits that do not decode to what the header says
+  DECODE_BAD_CHECKSUM,  // a checksum or end record that does not match
+};
+
+const char* decodeErrorName(DecodeError e) {
+  switch (e) {
+    case DECODE_OK: return "ok";
+    case DECODE_TRUNCATED: return "truncated";
+    case DECODE_BAD_HEADER: return "bad header";
+    case DECODE_BAD_CODES: return "bad code lengths";
+    case DECODE_BAD_DATA: return "bad data";
+    case DECODE_BAD_CHECKSUM: return "bad checksum";
+  }
+  return "unknown";
+}
+
+//
+// Appends v to out seven bits at a time, low bits first, with the high bit
+// of each byte set when more bytes follow.
+//
+void putVarint(uint64_t v, std::vector<uint8_t>& out) {
+  while (v >= 0x80) {
+    out.push_back((uint8_t)(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((uint8_t)v);
+}
+
+// number of bytes putVarint() writes for v
+int varintSize(uint64_t v) {
+  int n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+//
+// Reads a varint written by putVarint() starting at data[pos].  Returns false
+// if it runs past len or does not fit in 64 bits.
+//
+bool getVarint(const uint8_t* data, size_t len, size_t& pos, uint64_t& v) {
+  v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (pos >= len) return false;
+    uint8_t byte = data[pos++];
+    v |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+// appends v to out as a little-endian integer of the given number of bytes
+void _putFixed(uint64_t v, int bytes, std::vector<uint8_t>& out) {
+  for (int i = 0; i < bytes; i++) out.push_back((uint8_t)(v >> (8 * i)));
+}
+
+uint64_t _getFixed(const uint8_t* data, int bytes) {
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; i++) v |= (uint64_t)data[i] << (8 * i);
+  return v;
+}
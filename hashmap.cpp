@@ -11,7 +11,7 @@ using namespace std;
 // creates a bucket array with nBuckets number of pointers to linked lists.
 //
 hashmap::hashmap() {
-    this->nBuckets=10;
+    this->nBuckets=DEFAULT_BUCKETS;
     this->nElems=0;
     this->buckets=createBucketArray(nBuckets);
 }
@@ -50,7 +50,7 @@ hashmap::~hashmap() {
 // This method puts key/value pair in the map.  It checks to see if key is
 // already in map while traversing the list to find the end of it.
 //
-void hashmap::put(int key, int value) {
+void hashmap::put(int key, long long value) {
     int ind = hashFunction(key) % nBuckets;
     key_val_pair * cur = buckets[ind];
     key_val_pair * prev = nullptr;
@@ -84,7 +84,7 @@ void hashmap::put(int key, int value) {
 //
 // This method returns the value associated with key.
 //
-int hashmap::get(int key) const {
+long long hashmap::get(int key) const {
     int ind = hashFunction(key) % nBuckets;
     key_val_pair * ptr = buckets[ind];
 
@@ -136,11 +136,11 @@ vector<int> hashmap::keys() const {
 // @param input - an integer to be hashed
 // return the hashed integer
 //
-int hashmap::hashFunction(int input) const {
+int hashmap::hashFunction(int input) {
     // use unsigned integers for calculation
     // we are also using so-called "magic numbers"
     // see https://stackoverflow.com/a/12996028/561677 for details
-    unsigned int temp = ((input >> 16) ^ input) * 0x45d9f3b;
+    unsigned int temp = (unsigned int)((input >> 16) ^ input) * 0x45d9f3b;
     temp = (temp >> 16) ^ temp;
 
     // convert back to positive signed int
@@ -153,6 +153,14 @@ int hashmap::hashFunction(int input) const {
     return hash;
 }
 
+//
+// This function returns the bucket key would be stored in by a map built with
+// the default constructor.
+//
+int hashmap::bucketOf(int key) {
+    return hashFunction(key) % DEFAULT_BUCKETS;
+}
+
 //
 // This function returns the number of elements in the hashmap.
 //
@@ -173,7 +181,7 @@ hashmap::hashmap(const hashmap &myMap) {
     vector<int> keys = myMap.keys();
     for (size_t i=0; i < keys.size(); i++) {
         int key = keys[i];
-        int value = myMap.get(key);
+        long long value = myMap.get(key);
         put(key,value);
     }
 
@@ -206,7 +214,7 @@ hashmap& hashmap::operator= (const hashmap &myMap) {
     vector<int> keys = myMap.keys();
     for (size_t i=0; i < keys.size(); i++) {
         int key = keys[i];
-        int value = myMap.get(key);
+        long long value = myMap.get(key);
         put(key,value);
     }
 
@@ -223,7 +231,7 @@ ostream &operator<<(ostream &out, hashmap &myMap) {
     vector<int> keys = myMap.keys();
     for (size_t i=0; i < keys.size(); i++) {
         int key = keys[i];
-        int value = myMap.get(key);
+        long long value = myMap.get(key);
         out << key << ":" << value;
         if (i < keys.size() - 1) { // no commas after the last one
             out << ", ";
@@ -235,37 +243,36 @@ ostream &operator<<(ostream &out, hashmap &myMap) {
 
 //
 // This function overloads the >> operator, which allows for ease at extraction
-// from streams/files.
+// from streams/files.  It reads the "{k:v, k:v}" form operator<< writes and
+// sets failbit, leaving the entries read so far in myMap, if the input ends
+// early or holds anything else.
 //
 istream &operator>>(istream &in, hashmap &myMap) {
-    // assume the format {1:2, 3:4}
-    bool done = false;
-    in.get(); // get the first char, {
-    int nextChar = in.get(); // get the first real character
-    while (!done) {
-        string nextInput;
-        while (nextChar != ',' and nextChar != '}') {
-                nextInput += nextChar;
-                nextChar = in.get();
+    if (in.get() != '{') {
+        in.setstate(ios::failbit);
+        return in;
+    }
+    if (in.peek() == '}') { // an empty map
+        in.get();
+        return in;
+    }
+    while (true) {
+        int key;
+        long long value;
+        if (!(in >> key) || in.get() != ':' || !(in >> value)) {
+            in.setstate(ios::failbit);
+            return in;
         }
-        if (nextChar == ',') {
-            // read the space as well
-            in.get(); // should be a space
-            nextChar = in.get(); // get the next character
-        } else {
-            done = true; // we have reached }
+        myMap.put(key, value);
+        int next = in.get();
+        if (next == '}') {
+            return in;
         }
-        // at this point, nextInput should be in the form 1:2
-        // (we should have two integers separated by a colon)
-        // BUT, we might have an empty map (special case)
-        if (nextInput != "") {
-            //vector<string> kvp;
-            size_t pos = nextInput.find(":");
-            myMap.put(stoi(nextInput.substr(0, pos)),
-                      stoi(nextInput.substr(pos+1, nextInput.length() - 1)));
+        if (next != ',' || in.get() != ' ') {
+            in.setstate(ios::failbit);
+            return in;
         }
     }
-    return in;
 }
 
 
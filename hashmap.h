@@ -11,11 +11,16 @@ public:
     hashmap();
     ~hashmap();
 
-    int get(int key) const;
-    void put(int key, int value);
+    // values are 64-bit so byte counts of files past 2 GiB fit
+    long long get(int key) const;
+    void put(int key, long long value);
     bool containsKey(int key);
     vector<int> keys() const;
     int size();
+    // bucket a key lands in for a default-sized map.  keys() walks buckets in
+    // this order, so code that needs to reproduce it can do so without a map.
+    static int bucketOf(int key);
+    static const int DEFAULT_BUCKETS = 10;
 
     void sanityCheck();
     hashmap(const hashmap &myMap); // copy constructor
@@ -29,14 +34,14 @@ public:
 private:
     struct key_val_pair {
         int key;
-        int value;
+        long long value;
         key_val_pair* next;
     };
 
     typedef key_val_pair** bucketArray; 
 
     bucketArray createBucketArray(int nBuckets);
-    int hashFunction(int input) const;
+    static int hashFunction(int input);
 
     bucketArray buckets;
 
@@ -0,0 +1,202 @@
+//
+// histogram.h
+//
+// parallelHistogram() counts the bytes of a large input on every core.  The
+// input is cut into one contiguous range per thread; each thread counts its
+// range into counters of its own, so threads share nothing while they scan,
+// and the counters are added up once they are all done.
+//
+// Threads are spread over the NUMA nodes listed in /sys, each pinned to a
+// CPU of its node and handed ranges next to the other threads on that node.
+// For an mmapped file, the pages a thread faults in are placed on its own
+// node, so every thread reads local memory.  Ranges start on
+// HISTOGRAM_ALIGN boundaries so no two threads touch the same huge page,
+// and no thread gets less than minChunk bytes, since below that starting a
+// thread costs more than the counting it saves.
+//
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "hashmap.h"
+#include "mappedfile.h"
+#include "stats.h"
+#pragma once
+
+using namespace std;
+
+const size_t HISTOGRAM_ALIGN = 2 << 20;
+const size_t HISTOGRAM_MIN_CHUNK = 8 << 20;
+
+//
+// ByteHistogram holds the count of every byte value and the order the
+// values first appear in, which is what fixes the order a hashmap lists
+// them in.
+//
+struct ByteHistogram {
+  uint64_t counts[256];
+  int order[256];  // byte values in first-seen order
+  int nOrder;
+
+  void clear() {
+    memset(counts, 0, sizeof(counts));
+    nOrder = 0;
+  }
+
+  // counts data into this histogram
+  void add(const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+      if (counts[data[i]]++ == 0) order[nOrder++] = data[i];
+    }
+  }
+
+  // adds other, counted over bytes that come after these
+  void merge(const ByteHistogram& other) {
+    for (int i = 0; i < other.nOrder; i++) {
+      int b = other.order[i];
+      if (counts[b] == 0) order[nOrder++] = b;
+      counts[b] += other.counts[b];
+    }
+  }
+};
+
+//
+// The CPUs of each NUMA node, from /sys/devices/system/node.  Machines
+// without that directory are one node holding every CPU we may run on.
+//
+vector<vector<int> > numaNodes() {
+  vector<vector<int> > nodes;
+  for (int node = 0;; node++) {
+    string path = "/sys/devices/system/node/node" + to_string(node) + "/cpulist";
+    FILE* f = fopen(path.c_str(), "r");
+    if (f == nullptr) break;
+    vector<int> cpus;
+    int lo, hi;
+    while (fscanf(f, "%d", &lo) == 1) {
+      hi = lo;
+      int c = fgetc(f);
+      if (c == '-') {
+        if (fscanf(f, "%d", &hi) != 1) break;
+        c = fgetc(f);
+      }
+      for (int cpu = lo; cpu <= hi; cpu++) cpus.push_back(cpu);
+      if (c != ',') break;
+    }
+    fclose(f);
+    if (!cpus.empty()) nodes.push_back(cpus);
+  }
+  if (nodes.empty()) {
+    cpu_set_t set;
+    nodes.push_back(vector<int>());
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &set)) nodes[0].push_back(cpu);
+    }
+  }
+  return nodes;
+}
+
+// the CPU thread t of nThreads runs on, filling nodes in turn so that
+// neighbouring threads, and so neighbouring ranges, share a node
+int _histogramCpu(const vector<vector<int> >& nodes, int t, int nThreads) {
+  size_t total = 0;
+  for (size_t n = 0; n < nodes.size(); n++) total += nodes[n].size();
+  if (total == 0) return -1;
+  size_t slot = (size_t)t * total / nThreads;
+  for (size_t n = 0; n < nodes.size(); n++) {
+    if (slot < nodes[n].size()) return nodes[n][slot];
+    slot -= nodes[n].size();
+  }
+  return -1;
+}
+
+//
+// parallelHistogram:
+// Counts data into h on up to threads threads (0 for one per core).  h ends
+// up exactly as h.clear() and h.add(data, len) would leave it.
+//
+void parallelHistogram(const uint8_t* data, size_t len, ByteHistogram& h, int threads = 0,
+                       size_t minChunk = HISTOGRAM_MIN_CHUNK) {
+  StageTimer timer(STAGE_HISTOGRAM);
+  h.clear();
+  if (threads <= 0) threads = max(1, (int)thread::hardware_concurrency());
+  size_t chunk = max(minChunk, (size_t)1);
+  int nThreads = (int)min((size_t)threads, max((size_t)1, len / chunk));
+  if (nThreads == 1) {
+    h.add(data, len);
+    timer.finish(len, 0);
+    return;
+  }
+
+  // range t is [cut[t], cut[t + 1]), each cut rounded down to HISTOGRAM_ALIGN
+  // when that leaves every range non-empty
+  size_t align = (len / nThreads > HISTOGRAM_ALIGN) ? HISTOGRAM_ALIGN : 1;
+  vector<size_t> cut(nThreads + 1);
+  for (int t = 0; t <= nThreads; t++) {
+    size_t at = (size_t)((unsigned __int128)len * t / nThreads);
+    cut[t] = (t == nThreads) ? len : at / align * align;
+  }
+
+  vector<vector<int> > nodes = numaNodes();
+  vector<ByteHistogram> partial(nThreads);
+  vector<thread> workers;
+  for (int t = 1; t < nThreads; t++) {
+    workers.push_back(thread([&, t] {
+      int cpu = _histogramCpu(nodes, t, nThreads);
+      if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      }
+      // counted on this thread's stack, on its own node and cache lines
+      ByteHistogram local;
+      local.clear();
+      local.add(data + cut[t], cut[t + 1] - cut[t]);
+      partial[t] = local;
+    }));
+  }
+  // the calling thread takes the first range where it already runs
+  partial[0].clear();
+  partial[0].add(data, cut[1]);
+  for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+  for (int t = 0; t < nThreads; t++) h.merge(partial[t]);
+  timer.finish(len, 0);
+}
+
+//
+// histogramFile:
+// Maps filename and counts it with parallelHistogram().  What cannot be
+// mapped, or says it is empty, like a pipe, a device or a file in /proc, is
+// read from the same descriptor and counted on this thread instead.
+// Returns false if the file cannot be opened or read, leaving h empty.
+//
+bool histogramFile(const string& filename, ByteHistogram& h, int threads = 0) {
+  MappedFile file;
+  h.clear();
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  if (file.map(fd) && file.size() > 0) {
+    parallelHistogram(file.data(), file.size(), h, threads);
+    close(fd);
+    return true;
+  }
+  uint8_t buf[1 << 16];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) != 0) {
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) break;
+    h.add(buf, n);
+  }
+  close(fd);
+  if (n < 0) h.clear();
+  return n == 0;
+}
@@ -0,0 +1,69 @@
+//
+// huffman.h
+//
+// The Huffman tree node and the helpers every stage of the compressor shares.
+//
+
+#include <cstdlib>
+#include "bitstream.h"
+#pragma once
+
+// every byte value plus PSEUDO_EOF
+const int NUM_SYMBOLS = 257;
+
+struct HuffmanNode {
+  int character;
+  long long count;
+  HuffmanNode* zero;
+  HuffmanNode* one;
+};
+
+//
+// Counts are scaled down before a tree is built from them once they add up
+// to more than an int holds.  That keeps every code under 46 bits, since a
+// deeper tree needs Fibonacci-sized counts, and it is deterministic, so the
+// decoder scales a header's counts the same way and gets the same tree.
+//
+const long long TREE_WEIGHT_LIMIT = 2147483647LL;
+
+//
+// *This function returns how many bits counts adding up to total, n of them
+// nonzero, are shifted right by for tree building.  Shifting rounds up, so
+// no count drops to zero; each adds at most one to the scaled total.
+//
+int treeWeightShift(unsigned long long total, int n) {
+  int shift = 0;
+  while ((total >> shift) + (shift != 0 ? n : 0) > (unsigned long long)TREE_WEIGHT_LIMIT) shift++;
+  return shift;
+}
+
+// count as it is weighed in the tree, after treeWeightShift()
+long long treeWeight(long long count, int shift) {
+  return (shift == 0) ? count : ((count - 1) >> shift) + 1;
+}
+
+class Compare {
+ public:
+  bool operator()(HuffmanNode* x, HuffmanNode* y) {
+    return x->count > y->count;
+  }
+};
+
+//
+// *This method frees the memory allocated for the Huffman tree.
+//
+void freeTree(HuffmanNode* node) {
+  if (node == nullptr) return;
+
+  freeTree(node->zero);
+  freeTree(node->one);
+  delete node;
+}
+
+bool isLeaf(HuffmanNode* node) {
+  if (node->zero == nullptr && node->one == nullptr) {
+    return true;
+  } else {
+    return false;
+  }
+}
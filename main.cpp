@@ -0,0 +1,300 @@
+//
+// main.cpp
+//
+// Command line front end.
+//
+//   program.exe compress [-c] FILE     writes FILE.huf
+//   program.exe decompress FILE.huf    writes FILE
+//   program.exe decompress FILE.huf -  writes it to standard output
+//   program.exe verify FILE.huf        decodes FILE.huf without writing it
+//   program.exe probe FILE...          predicts how well each FILE compresses
+//   program.exe batch [-d] [-j N] INPUT...
+//   program.exe archive create [-s] ARCHIVE INPUT...
+//   program.exe archive list ARCHIVE
+//   program.exe archive extract ARCHIVE [NAME...]
+//   program.exe archive verify ARCHIVE
+//
+// --stats=json or --stats=prometheus before any command prints the per-stage
+// counters of stats.h to stderr once it finishes; they are all zero unless
+// the program was built with "make build-stats".
+//
+// compress -c adds CRC32C checksums to every block and the whole file, which
+// decompress and verify then check.  decompress to "-" splices the output
+// into a pipe, or copies it into a file or socket, a chunk at a time.  probe
+// samples each file rather than reading it all (see probe.h), so it answers
+// in microseconds.  archive verify decodes and checks every entry without
+// writing anything.
+//
+// Each INPUT is a file, a directory (every file directly in it), or @LIST
+// naming a file with one path per line.  In batch mode all of them are
+// handled in this one process on a work-stealing pool, and one line of
+// stats is printed per file.  archive create packs them into one archive
+// instead; with -s, files under SHARED_TABLE_LIMIT bytes are coded with one
+// code table trained on all of them.  Each file is stored under its path
+// made relative (see archiveName()), and archive extract writes entries
+// under the current directory, never over a file that is already there.
+//
+
+#include "hashmap.h"
+#include "util.h"
+#include "batch.h"
+#include "archive.h"
+#include "probe.h"
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+using namespace std;
+
+const size_t SHARED_TABLE_LIMIT = 64 * 1024;
+
+static int usage() {
+    cerr << "usage: program.exe [--stats=json|prometheus] COMMAND..." << endl
+         << "       program.exe compress [-c] FILE" << endl
+         << "       program.exe decompress FILE.huf [-]" << endl
+         << "       program.exe verify FILE.huf" << endl
+         << "       program.exe probe FILE..." << endl
+         << "       program.exe batch [-d] [-j THREADS] FILE|DIR|@LIST..." << endl
+         << "       program.exe archive create [-s] ARCHIVE FILE|DIR|@LIST..." << endl
+         << "       program.exe archive list ARCHIVE" << endl
+         << "       program.exe archive extract ARCHIVE [NAME...]" << endl
+         << "       program.exe archive verify ARCHIVE" << endl;
+    return 2;
+}
+
+static bool endsWith(const string& s, const string& suffix) {
+    return s.size() >= suffix.size() &&
+           s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+//
+// Adds the files named by one INPUT argument to files.
+//
+static void addInput(const string& arg, bool compressed, vector<string>& files) {
+    struct stat st;
+    if (arg[0] == '@') {
+        ifstream list(arg.substr(1));
+        string line;
+        while (getline(list, line))
+            if (!line.empty()) files.push_back(line);
+    } else if (stat(arg.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        vector<string> found = listDirectory(arg, compressed);
+        files.insert(files.end(), found.begin(), found.end());
+    } else {
+        files.push_back(arg);
+    }
+}
+
+static int batch(int argc, char* argv[]) {
+    BatchOptions opt;
+    vector<string> files;
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-d") {
+            opt.decompress = true;
+        } else if (arg == "-j" && i + 1 < argc) {
+            opt.threads = max(1, atoi(argv[++i]));
+        } else {
+            addInput(arg, opt.decompress, files);
+        }
+    }
+    if (files.empty()) return usage();
+
+    vector<FileStats> stats = runBatch(files, opt);
+    uint64_t in = 0, out = 0;
+    int failed = 0;
+    for (size_t i = 0; i < stats.size(); i++) {
+        const FileStats& s = stats[i];
+        if (!s.ok) {
+            printf("%-40s FAILED\n", s.name.c_str());
+            failed++;
+            continue;
+        }
+        printf("%-40s %12llu -> %12llu  %6.1f%%  %8.2f ms\n", s.name.c_str(),
+               (unsigned long long)s.bytesIn, (unsigned long long)s.bytesOut,
+               s.bytesIn ? 100.0 * s.bytesOut / s.bytesIn : 100.0, s.seconds * 1000);
+        in += s.bytesIn;
+        out += s.bytesOut;
+    }
+    printf("%zu files, %llu -> %llu bytes, %d failed\n", stats.size(),
+           (unsigned long long)in, (unsigned long long)out, failed);
+    return failed == 0 ? 0 : 1;
+}
+
+static int archiveCreate(int argc, char* argv[]) {
+    int i = 3;
+    bool shared = (i < argc && string(argv[i]) == "-s");
+    if (shared) i++;
+    if (i + 1 >= argc) return usage();
+    string name = argv[i++];
+    vector<string> files;
+    for (; i < argc; i++) addInput(argv[i], false, files);
+
+    ArchiveWriter writer;
+    uint32_t table = 0;
+    if (shared) {
+        vector<string> small;
+        struct stat st;
+        for (size_t k = 0; k < files.size(); k++) {
+            if (stat(files[k].c_str(), &st) == 0 && (size_t)st.st_size < SHARED_TABLE_LIMIT)
+                small.push_back(files[k]);
+        }
+        hashmap freq;
+        trainDictionary(small, freq);
+        table = writer.addTable(freq);
+    }
+    if (!writer.open(name)) {
+        cerr << "cannot create " << name << endl;
+        return 1;
+    }
+    int failed = 0;
+    for (size_t k = 0; k < files.size(); k++) {
+        struct stat st;
+        bool useTable = stat(files[k].c_str(), &st) == 0 && (size_t)st.st_size < SHARED_TABLE_LIMIT;
+        if (!writer.addFile(archiveName(files[k]), files[k], useTable ? table : 0)) {
+            cerr << "cannot add " << files[k] << endl;
+            failed++;
+        }
+    }
+    return (writer.close() && failed == 0) ? 0 : 1;
+}
+
+static int archive(int argc, char* argv[]) {
+    if (argc < 4) return usage();
+    string cmd = argv[2];
+    if (cmd == "create") return archiveCreate(argc, argv);
+
+    ArchiveReader reader;
+    if (!reader.open(argv[3])) {
+        cerr << argv[3] << " is not an archive" << endl;
+        return 1;
+    }
+    if (cmd == "list") {
+        for (size_t i = 0; i < reader.size(); i++) {
+            const ArchiveEntry& e = reader.entry(i);
+            printf("%-40s %12llu -> %12llu  %zu blocks%s\n", e.name.c_str(),
+                   (unsigned long long)e.rawSize, (unsigned long long)e.packedSize(),
+                   e.blockEnd.size(), e.table ? "  shared table" : "");
+        }
+        return 0;
+    } else if (cmd == "extract") {
+        vector<size_t> wanted;
+        for (int i = 4; i < argc; i++) {
+            int index = reader.find(archiveName(argv[i]));
+            if (index < 0) {
+                cerr << argv[i] << " is not in the archive" << endl;
+                return 1;
+            }
+            wanted.push_back(index);
+        }
+        if (argc == 4)
+            for (size_t i = 0; i < reader.size(); i++) wanted.push_back(i);
+        int failed = 0;
+        for (size_t k = 0; k < wanted.size(); k++) {
+            if (!reader.extractFile(wanted[k])) {
+                cerr << "cannot extract " << reader.entry(wanted[k]).name << endl;
+                failed++;
+            }
+        }
+        return failed == 0 ? 0 : 1;
+    } else if (cmd == "verify") {
+        int failed = 0;
+        for (size_t i = 0; i < reader.size(); i++) {
+            if (!reader.verify(i)) {
+                cout << reader.entry(i).name << ": FAILED" << endl;
+                failed++;
+            }
+        }
+        printf("%zu entries, %d failed\n", reader.size(), failed);
+        return failed == 0 ? 0 : 1;
+    }
+    return usage();
+}
+
+static int verify(const string& file) {
+    HuffmanContext& ctx = threadContext();
+    vector<uint8_t>& packed = ctx.inputBuffer();
+    if (!_readFile(file, packed)) {
+        cerr << "cannot read " << file << endl;
+        return 1;
+    }
+    bool ok = decompressBuffer(packed.data(), packed.size(), ctx.outputBuffer(), ctx);
+    cout << file << ": " << (ok ? "ok" : decodeErrorName(ctx.decodeError())) << endl;
+    return ok ? 0 : 1;
+}
+
+static int probe(int argc, char* argv[]) {
+    int status = 0;
+    for (int i = 2; i < argc; i++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        CompressionEstimate e;
+        if (!estimateFile(argv[i], e)) {
+            cerr << "cannot read " << argv[i] << endl;
+            status = 1;
+            continue;
+        }
+        double micros = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+        printf("%s: %llu bytes, sampled %llu, entropy %.3f bits/byte, codes %.3f bits/byte, "
+               "predicted ratio %.3f (%s) in %.0f us\n",
+               argv[i], (unsigned long long)e.length, (unsigned long long)e.sampled, e.entropy,
+               e.codeLength, e.predictedRatio, probeModeName(e.mode), micros);
+    }
+    return status;
+}
+
+static int cannotDecompress(const string& file) {
+    DecodeError e = threadContext().decodeError();
+    cerr << "cannot decompress " << file;
+    if (e != DECODE_OK) cerr << ": " << decodeErrorName(e);
+    cerr << endl;
+    return 1;
+}
+
+static int run(int argc, char* argv[]) {
+    if (argc < 2) return usage();
+    string cmd = argv[1];
+    if (cmd == "batch") return batch(argc, argv);
+    if (cmd == "archive") return archive(argc, argv);
+    if (cmd == "probe") return argc > 2 ? probe(argc, argv) : usage();
+    if (cmd == "compress" && argc == 4 && string(argv[2]) == "-c") {
+        PipelineOptions opt;
+        opt.checksums = true;
+        return compressFile(argv[3], string(argv[3]) + ".huf", opt) ? 0 : 1;
+    }
+    if (cmd == "decompress" && argc == 4 && string(argv[3]) == "-") {
+        int fd = open(argv[2], O_RDONLY);
+        bool ok = fd >= 0 && decompressStream(fd, STDOUT_FILENO, threadContext());
+        if (fd >= 0) close(fd);
+        return ok ? 0 : cannotDecompress(argv[2]);
+    }
+    if (argc != 3) return usage();
+
+    string file = argv[2];
+    if (cmd == "compress") {
+        return compressFile(file, file + ".huf") ? 0 : 1;
+    } else if (cmd == "decompress") {
+        if (!endsWith(file, ".huf")) return usage();
+        if (decompressFile(file, file.substr(0, file.size() - 4))) return 0;
+        return cannotDecompress(file);
+    } else if (cmd == "verify") {
+        return verify(file);
+    }
+    return usage();
+}
+
+int main(int argc, char* argv[]) {
+    string stats;
+    if (argc > 1 && string(argv[1]).compare(0, 8, "--stats=") == 0) {
+        stats = argv[1] + 8;
+        if (stats != "json" && stats != "prometheus") return usage();
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+    int status = run(argc, argv);
+    if (stats == "json")
+        cerr << statsJson(statsSnapshot()) << endl;
+    else if (stats == "prometheus")
+        cerr << statsPrometheus(statsSnapshot());
+    return status;
+}
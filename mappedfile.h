@@ -0,0 +1,68 @@
+//
+// mappedfile.h
+//
+// MappedFile maps a whole file read-only, so its bytes can be read in place
+// instead of copied into a buffer first.
+//
+
+#include <cstdint>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#pragma once
+
+using namespace std;
+
+class MappedFile {
+ public:
+  MappedFile() : addr(nullptr), length(0) {}
+  ~MappedFile() { close(); }
+
+  //
+  // open:
+  // Maps filename, unmapping whatever was mapped before.  Returns false if
+  // it cannot be opened or mapped.  An empty file maps to no bytes.
+  //
+  bool open(const string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool ok = map(fd);
+    ::close(fd);
+    return ok;
+  }
+
+  //
+  // map:
+  // open() for a file that is already open.  fd stays open and may be closed
+  // once this returns.  Returns false for anything but a regular file.
+  //
+  bool map(int fd) {
+    close();
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    if (st.st_size == 0) return true;
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) return false;
+    addr = (const uint8_t*)p;
+    length = st.st_size;
+    return true;
+  }
+
+  void close() {
+    if (addr != nullptr) munmap((void*)addr, length);
+    addr = nullptr;
+    length = 0;
+  }
+
+  const uint8_t* data() const { return addr; }
+  size_t size() const { return length; }
+
+ private:
+  const uint8_t* addr;
+  size_t length;
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+};
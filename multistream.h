@@ -0,0 +1,525 @@
+//
+// multistream.h
+//
+// Blocks split into independently decodable bit streams.  Decoding one
+// serial stream is a chain: where a symbol starts depends on the length of
+// the one before it.  With four streams the decoder advances four readers in
+// the same loop, so the CPU works on four chains at once.  Blocks shorter
+// than MULTI_STREAM_MIN use one stream, which saves three sizes and the
+// padding.
+//
+// A block is
+//
+//   TAG_STREAMS, varint symbol count, stream count, lengths,
+//   one varint size per stream, streams
+//
+// The input is cut into equal segments (the last one shorter), coded in
+// order into streams 0, 1, ...  Codes are canonical and no longer than
+// STREAM_CODE_BITS, so the block needs only each byte's code length and the
+// decoder finds a symbol with one table lookup.  Lengths are stored for bytes
+// 0 to n - 1, after a byte holding n - 1: a nibble each, the even byte in the
+// low half.  Each stream is zero-padded to a byte, with no PSEUDO_EOF.
+//
+// The decoding loop is a template on the longest code and the stream count,
+// so the table mask and the loop counts are constants and the inner loops
+// unroll.  decode() picks the instantiation from the block header.
+//
+// When codes are short, one lookup can resolve several symbols: an entry of
+// the multi-symbol table holds every code, up to MULTI_SYMBOLS of them, that
+// fits whole in its STREAM_CODE_BITS-bit index.  Text whose common bytes
+// have 2 to 5 bit codes then decodes two or three symbols per lookup.  The
+// table takes longer to fill, so decode() only builds it for blocks long
+// enough, and codes short enough, to pay that back.
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "bitpack.h"
+#include "format.h"
+#pragma once
+
+using namespace std;
+
+// the most streams a block can have, and the count large blocks use
+const int STREAM_COUNT = 4;
+
+// blocks shorter than this are coded as one stream
+const size_t MULTI_STREAM_MIN = 4096;
+
+// longest code, and so the widest the decode table's index gets
+const int STREAM_CODE_BITS = 11;
+
+// the narrower table, for blocks whose codes all fit in a byte
+const int SHORT_TABLE_BITS = 8;
+
+// most symbols one multi-symbol table entry resolves
+const int MULTI_SYMBOLS = 4;
+
+// fewest symbols per stream worth filling the multi-symbol table for
+const uint64_t MULTI_TABLE_MIN = 4096;
+
+// the multi-symbol table is used when codes average at most this many bits,
+// as weighted by the probabilities their lengths imply; past it a lookup
+// rarely resolves a second symbol and the bigger table only costs misses
+const double MULTI_TABLE_MAX_LENGTH = 6.5;
+
+// which table decode() uses; tests and benchmarks pin one
+enum DecodeTableMode { TABLE_AUTO, TABLE_SINGLE, TABLE_MULTI };
+
+//
+// Computes Huffman code lengths for the n weights in w into lens, leaving 0
+// for weights of 0.  Ties are broken by index so the result is deterministic.
+//
+void _huffmanLengths(const uint64_t* w, int n, uint8_t* lens) {
+  uint64_t weight[512];
+  int parent[512], depth[512], heap[256];
+  int nHeap = 0, nNodes = n;
+  auto greater = [&weight](int a, int b) {
+    return weight[a] != weight[b] ? weight[a] > weight[b] : a > b;
+  };
+  for (int i = 0; i < n; i++) {
+    lens[i] = 0;
+    weight[i] = w[i];
+    if (w[i] == 0) continue;
+    heap[nHeap++] = i;
+    push_heap(heap, heap + nHeap, greater);
+  }
+  if (nHeap == 1) lens[heap[0]] = 1;
+  if (nHeap <= 1) return;
+
+  while (nHeap > 1) {
+    pop_heap(heap, heap + nHeap--, greater);
+    int a = heap[nHeap];
+    pop_heap(heap, heap + nHeap--, greater);
+    int b = heap[nHeap];
+    weight[nNodes] = weight[a] + weight[b];
+    parent[a] = parent[b] = nNodes;
+    heap[nHeap++] = nNodes++;
+    push_heap(heap, heap + nHeap, greater);
+  }
+  // every node's parent was made after it, so one pass down from the root
+  depth[nNodes - 1] = 0;
+  for (int i = nNodes - 2; i >= 0; i--) {
+    if (i < n && w[i] == 0) continue;
+    depth[i] = depth[parent[i]] + 1;
+    if (i < n) lens[i] = (uint8_t)depth[i];
+  }
+}
+
+class MultiStreamCoder {
+ public:
+  MultiStreamCoder()
+      : nLens(0),
+        nStreams(1),
+        tableBits(STREAM_CODE_BITS),
+        tableMode(TABLE_AUTO),
+        multi(false),
+        error(DECODE_OK) {}
+
+  //
+  // plan:
+  // Builds length-limited codes for the 256 byte counts and works out the
+  // block coding len bytes at data would take.  Returns its size in bytes,
+  // or 0 if fewer than two byte values occur.
+  //
+  size_t plan(const uint64_t* counts, const uint8_t* data, size_t len) {
+    int nUsed = 0;
+    uint64_t w[256];
+    for (int i = 0; i < 256; i++) {
+      w[i] = counts[i];
+      if (counts[i] != 0) nUsed++;
+    }
+    if (nUsed < 2) return 0;
+    // halving the counts flattens the tree until it fits the limit
+    while (true) {
+      _huffmanLengths(w, 256, lens);
+      if (*max_element(lens, lens + 256) <= STREAM_CODE_BITS) break;
+      for (int i = 0; i < 256; i++) w[i] = (w[i] + 1) / 2;
+    }
+    assignCodes();
+
+    nStreams = (len < MULTI_STREAM_MIN) ? 1 : STREAM_COUNT;
+    size_t seg = segmentSize(len);
+    size_t size = 1 + varintSize(len) + 2 + (nLens + 1) / 2;
+    for (int s = 0; s < nStreams; s++) {
+      size_t from = min(len, s * seg), to = min(len, from + seg);
+      uint64_t bits = 0;
+      for (size_t i = from; i < to; i++) bits += lens[data[i]];
+      streamSize[s] = (bits + 7) / 8;
+      size += varintSize(streamSize[s]) + streamSize[s];
+    }
+    return size;
+  }
+
+  //
+  // encode:
+  // Appends the block plan() measured for the same data to out.
+  //
+  void encode(const uint8_t* data, size_t len, vector<uint8_t>& out) const {
+    out.push_back(TAG_STREAMS);
+    putVarint(len, out);
+    out.push_back((uint8_t)nStreams);
+    out.push_back((uint8_t)(nLens - 1));
+    for (int i = 0; i < nLens; i += 2)
+      out.push_back((uint8_t)(lens[i] | (i + 1 < nLens ? lens[i + 1] << 4 : 0)));
+    for (int s = 0; s < nStreams; s++) putVarint(streamSize[s], out);
+
+    size_t seg = segmentSize(len);
+    for (int s = 0; s < nStreams; s++) {
+      size_t from = min(len, s * seg), to = min(len, from + seg);
+      if (to > from) packCodes(data + from, to - from, codes, out, PACK_AUTO);
+    }
+  }
+
+  //
+  // decode:
+  // Decodes the block starting at data[pos], appending its bytes to out and
+  // leaving pos just past it.  Returns false if the block is malformed, and
+  // lastError() says how.  Sizes and code lengths are all checked before
+  // any bits are decoded.
+  //
+  bool decode(const uint8_t* data, size_t len, size_t& pos, vector<uint8_t>& out) {
+    uint64_t n, sizes[STREAM_COUNT], total = 0;
+    if (pos >= len) return fail(DECODE_TRUNCATED);
+    if (data[pos++] != TAG_STREAMS) return fail(DECODE_BAD_HEADER);
+    if (!getVarint(data, len, pos, n) || len - pos < 2) return fail(DECODE_TRUNCATED);
+    nStreams = data[pos++];
+    if (nStreams != 1 && nStreams != STREAM_COUNT) return fail(DECODE_BAD_HEADER);
+    nLens = data[pos++] + 1;
+    if ((size_t)(nLens + 1) / 2 > len - pos) return fail(DECODE_TRUNCATED);
+    memset(lens, 0, sizeof(lens));
+    for (int i = 0; i < nLens; i++)
+      lens[i] = (data[pos + i / 2] >> (4 * (i % 2))) & 0xf;
+    pos += (nLens + 1) / 2;
+    for (int s = 0; s < nStreams; s++) {
+      if (!getVarint(data, len, pos, sizes[s]) || sizes[s] > len - pos)
+        return fail(DECODE_TRUNCATED);
+      total += sizes[s];
+    }
+    if (total > len - pos) return fail(DECODE_TRUNCATED);
+    // every symbol takes at least one bit, which also bounds the output
+    if (n > total * 8) return fail(DECODE_BAD_HEADER);
+    if (!buildDecodeTable(n)) return fail(DECODE_BAD_CODES);
+
+    size_t base = out.size(), seg = segmentSize(n);
+    out.resize(base + n);
+    uint64_t start = pos;
+    for (int s = 0; s < nStreams; s++) {
+      uint64_t from = min(n, s * seg);
+      reader[s].dst = out.data() + base + from;
+      reader[s].left = min(n, from + seg) - from;
+      reader[s].bit = start * 8;
+      reader[s].end = start + sizes[s];
+      start += sizes[s];
+    }
+    (this->*fastDecoder())(data, len);
+    for (int s = 0; s < nStreams; s++) {
+      // the stream has to end in the byte its size says it does
+      if (!decodeTail(data, reader[s]) || (reader[s].bit + 7) / 8 != reader[s].end)
+        return fail(DECODE_BAD_DATA);
+    }
+    pos = start;
+    error = DECODE_OK;
+    return true;
+  }
+
+  // why the last decode() failed
+  DecodeError lastError() const { return error; }
+
+  // overrides the choice of decode table, TABLE_AUTO by default
+  void setTableMode(DecodeTableMode mode) { tableMode = mode; }
+
+  // whether the last decode() used the multi-symbol table
+  bool usedMultiTable() const { return multi; }
+
+ private:
+  struct Entry {
+    uint8_t symbol;
+    uint8_t length;  // 0 for an index no code starts
+  };
+
+  struct MultiEntry {
+    uint8_t symbols[MULTI_SYMBOLS];  // count of them are real
+    uint8_t count;
+    uint8_t length;                  // bits the count codes take together
+    uint8_t unused[2];               // keeps entries eight bytes
+  };
+
+  struct Reader {
+    uint8_t* dst;
+    uint64_t left;  // symbols still to decode
+    uint64_t bit;   // absolute bit position of the next code
+    uint64_t end;   // byte just past the stream
+  };
+
+  typedef void (MultiStreamCoder::*FastDecoder)(const uint8_t*, size_t);
+
+  uint8_t lens[256];
+  int nLens;      // bytes 0 to nLens - 1 may have codes
+  int nStreams;   // of the block being coded
+  int tableBits;  // index width of the decode table in use
+  DecodeTableMode tableMode;
+  bool multi;     // multiTable is in use for this block
+  DecodeError error;
+  CodeTable codes;
+  uint64_t streamSize[STREAM_COUNT];
+  Entry table[1 << STREAM_CODE_BITS];
+  MultiEntry multiTable[1 << STREAM_CODE_BITS];
+  Reader reader[STREAM_COUNT];
+
+  bool fail(DecodeError e) {
+    error = e;
+    return false;
+  }
+
+  size_t segmentSize(size_t len) const {
+    return (len + nStreams - 1) / nStreams;
+  }
+
+  //
+  // Canonical codes: shorter codes first, and within a length in byte order.
+  // Streams are read least significant bit first, so each code is stored
+  // reversed.
+  //
+  void assignCodes() {
+    int count[STREAM_CODE_BITS + 1] = {0}, used[256], nUsed = 0;
+    uint32_t next[STREAM_CODE_BITS + 1];
+    nLens = 0;
+    for (int i = 0; i < 256; i++) {
+      count[lens[i]]++;
+      if (lens[i] != 0) {
+        nLens = i + 1;
+        used[nUsed++] = i;
+      }
+    }
+    count[0] = 0;
+    uint32_t code = 0;
+    for (int l = 1; l <= STREAM_CODE_BITS; l++) {
+      code = (code + count[l - 1]) << 1;
+      next[l] = code;
+    }
+    for (int i = 0; i < NUM_SYMBOLS; i++) {
+      codes.code[i] = 0;
+      codes.len[i] = (i < 256) ? lens[i] : 0;
+      if (i < 256 && lens[i] != 0) codes.code[i] = reverse(next[lens[i]]++, lens[i]);
+    }
+    codes.finish(used, nUsed);
+  }
+
+  static uint32_t reverse(uint32_t code, int len) {
+    uint32_t r = 0;
+    for (int i = 0; i < len; i++) r |= ((code >> i) & 1) << (len - 1 - i);
+    return r;
+  }
+
+  //
+  // Fills the decode table from lens, only as wide as the longest code needs,
+  // and the multi-symbol table too if useMultiTable() says so for a block of
+  // n symbols.  The lengths have to describe a complete code of at least two
+  // symbols, or some index would match no code; returns false if they do not.
+  //
+  bool buildDecodeTable(uint64_t n) {
+    uint32_t kraft = 0;
+    int nUsed = 0;
+    for (int i = 0; i < nLens; i++) {
+      if (lens[i] == 0) continue;
+      if (lens[i] > STREAM_CODE_BITS) return false;
+      kraft += 1u << (STREAM_CODE_BITS - lens[i]);
+      nUsed++;
+    }
+    if (nUsed < 2 || kraft != (1u << STREAM_CODE_BITS)) return false;
+    assignCodes();
+    multi = useMultiTable(n);
+    // the multi-symbol table is built from a full-width one
+    tableBits = (!multi && codes.maxLen <= SHORT_TABLE_BITS) ? SHORT_TABLE_BITS : STREAM_CODE_BITS;
+    for (int i = 0; i < nLens; i++) {
+      if (lens[i] == 0) continue;
+      Entry e = {(uint8_t)i, lens[i]};
+      for (uint32_t k = (uint32_t)codes.code[i]; k < (1u << tableBits); k += 1u << lens[i])
+        table[k] = e;
+    }
+    if (multi) buildMultiTable();
+    return true;
+  }
+
+  //
+  // The multi-symbol table pays off when each stream is long and a lookup
+  // often resolves more than one symbol.  With no counts at hand, byte i
+  // is taken to occur 2^-lens[i] of the time, which is what its length says.
+  //
+  bool useMultiTable(uint64_t n) const {
+    if (tableMode != TABLE_AUTO) return tableMode == TABLE_MULTI;
+    if (n / nStreams < MULTI_TABLE_MIN) return false;
+    uint64_t weighted = 0;
+    for (int i = 0; i < nLens; i++)
+      if (lens[i] != 0) weighted += (uint64_t)lens[i] << (STREAM_CODE_BITS - lens[i]);
+    return weighted <= MULTI_TABLE_MAX_LENGTH * (1u << STREAM_CODE_BITS);
+  }
+
+  // decodes each index greedily with table, as many whole codes as fit
+  void buildMultiTable() {
+    const uint32_t mask = (1u << STREAM_CODE_BITS) - 1;
+    for (uint32_t i = 0; i <= mask; i++) {
+      MultiEntry e = {{0}, 0, 0, {0}};
+      while (e.count < MULTI_SYMBOLS) {
+        Entry next = table[(i >> e.length) & mask];
+        if (e.length + next.length > STREAM_CODE_BITS) break;
+        e.symbols[e.count++] = next.symbol;
+        e.length += next.length;
+      }
+      multiTable[i] = e;
+    }
+  }
+
+  //
+  // The instantiations decode() can run: one or four streams, and a table
+  // of 2^SHORT_TABLE_BITS entries when no code is longer than that.
+  //
+  FastDecoder fastDecoder() const {
+    if (multi)
+      return (nStreams == STREAM_COUNT) ? &MultiStreamCoder::decodeFastMulti<STREAM_COUNT>
+                                        : &MultiStreamCoder::decodeFastMulti<1>;
+    static const FastDecoder decoders[2][2] = {
+        {&MultiStreamCoder::decodeFast<SHORT_TABLE_BITS, 1>,
+         &MultiStreamCoder::decodeFast<SHORT_TABLE_BITS, STREAM_COUNT>},
+        {&MultiStreamCoder::decodeFast<STREAM_CODE_BITS, 1>,
+         &MultiStreamCoder::decodeFast<STREAM_CODE_BITS, STREAM_COUNT>}};
+    return decoders[tableBits == STREAM_CODE_BITS][nStreams == STREAM_COUNT];
+  }
+
+  static uint64_t load64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  //
+  // PER_READ symbols from every stream per round, while every stream has
+  // that many left and eight bytes to read at its position.  Eight bytes
+  // shifted by at most seven bits leave 57, which is how many bits of
+  // MaxLen-bit codes a round may take.  The readers are copied into locals:
+  // stores through the output pointers could alias the members and keep
+  // them out of registers.
+  //
+  template <int MaxLen, int Streams>
+  void decodeFast(const uint8_t* data, size_t len) {
+    static const int PER_READ = 57 / MaxLen;
+    // how far a round can move a reader, counting its starting bit offset
+    static const int ROUND_BYTES = (7 + PER_READ * MaxLen) / 8;
+    static const uint64_t MASK = (1u << MaxLen) - 1;
+    const Entry* t = table;
+    uint8_t* dst[Streams];
+    uint64_t bit[Streams];
+    uint64_t left = UINT64_MAX;
+    for (int s = 0; s < Streams; s++) {
+      dst[s] = reader[s].dst;
+      bit[s] = reader[s].bit;
+      left = min(left, reader[s].left);
+    }
+    uint64_t done = 0;
+    while (true) {
+      // streams are back to back, so only the last one can reach the end of
+      // the input
+      uint64_t last = bit[Streams - 1] / 8;
+      uint64_t rounds = min((left - done) / PER_READ,
+                            last + 8 <= len ? (len - 8 - last) / ROUND_BYTES : 0);
+      if (rounds == 0) break;
+      for (uint64_t r = 0; r < rounds; r++) {
+        uint64_t v[Streams];
+#pragma GCC unroll 4
+        for (int s = 0; s < Streams; s++)
+          v[s] = load64(data + bit[s] / 8) >> (bit[s] % 8);
+#pragma GCC unroll 8
+        for (int k = 0; k < PER_READ; k++) {
+#pragma GCC unroll 4
+          for (int s = 0; s < Streams; s++) {
+            Entry e = t[v[s] & MASK];
+            dst[s][k] = e.symbol;
+            v[s] >>= e.length;
+            bit[s] += e.length;
+          }
+        }
+#pragma GCC unroll 4
+        for (int s = 0; s < Streams; s++) dst[s] += PER_READ;
+      }
+      done += rounds * PER_READ;
+    }
+    for (int s = 0; s < Streams; s++) {
+      reader[s].dst = dst[s];
+      reader[s].bit = bit[s];
+      reader[s].left -= done;
+    }
+  }
+
+  //
+  // decodeFast() with the multi-symbol table.  Every entry stores all
+  // MULTI_SYMBOLS of its bytes and the output moves on by its count, so a
+  // round may write up to PER_READ * MULTI_SYMBOLS bytes; rounds run only
+  // while every stream has that many symbols left, which keeps a stream from
+  // writing into the next one's output or decoding its padding.
+  //
+  template <int Streams>
+  void decodeFastMulti(const uint8_t* data, size_t len) {
+    static const int PER_READ = 57 / STREAM_CODE_BITS;
+    static const int ROUND_SYMBOLS = PER_READ * MULTI_SYMBOLS;
+    static const int ROUND_BYTES = (7 + PER_READ * STREAM_CODE_BITS) / 8;
+    static const uint64_t MASK = (1u << STREAM_CODE_BITS) - 1;
+    const MultiEntry* t = multiTable;
+    uint8_t* dst[Streams];
+    uint8_t* end[Streams];
+    uint64_t bit[Streams];
+    for (int s = 0; s < Streams; s++) {
+      dst[s] = reader[s].dst;
+      end[s] = reader[s].dst + reader[s].left;
+      bit[s] = reader[s].bit;
+    }
+    while (true) {
+      uint64_t last = bit[Streams - 1] / 8;
+      uint64_t rounds = last + 8 <= len ? (len - 8 - last) / ROUND_BYTES : 0;
+      for (int s = 0; s < Streams; s++)
+        rounds = min(rounds, (uint64_t)(end[s] - dst[s]) / ROUND_SYMBOLS);
+      if (rounds == 0) break;
+      for (uint64_t r = 0; r < rounds; r++) {
+        uint64_t v[Streams];
+#pragma GCC unroll 4
+        for (int s = 0; s < Streams; s++)
+          v[s] = load64(data + bit[s] / 8) >> (bit[s] % 8);
+#pragma GCC unroll 8
+        for (int k = 0; k < PER_READ; k++) {
+#pragma GCC unroll 4
+          for (int s = 0; s < Streams; s++) {
+            const MultiEntry& e = t[v[s] & MASK];
+            memcpy(dst[s], e.symbols, MULTI_SYMBOLS);
+            dst[s] += e.count;
+            v[s] >>= e.length;
+            bit[s] += e.length;
+          }
+        }
+      }
+    }
+    for (int s = 0; s < Streams; s++) {
+      reader[s].left = end[s] - dst[s];
+      reader[s].dst = dst[s];
+      reader[s].bit = bit[s];
+    }
+  }
+
+  //
+  // Finishes one stream a symbol at a time, treating bytes past its end as
+  // zeros.  Returns false if it runs more than a code past the end.
+  //
+  bool decodeTail(const uint8_t* data, Reader& r) {
+    const uint64_t mask = (1u << tableBits) - 1;
+    for (; r.left > 0; r.left--) {
+      uint64_t v = 0, at = r.bit / 8;
+      if (at >= r.end) return false;
+      for (int i = 0; i < 3 && at + i < r.end; i++) v |= (uint64_t)data[at + i] << (8 * i);
+      Entry e = table[(v >> (r.bit % 8)) & mask];
+      *r.dst++ = e.symbol;
+      r.bit += e.length;
+    }
+    return true;
+  }
+};
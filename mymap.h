@@ -1,14 +1,29 @@
 // mymap.h
 //
 // TODO: write this file header comment.
+//
+// Two ways of keeping the tree balanced, picked per map:
+//
+//   BALANCE_REBUILD  when an insert leaves a node's subtree sizes more than
+//                    about 2:1 apart, the highest such subtree is flattened
+//                    and rebuilt perfectly balanced.  Cheap on average, but
+//                    one insert can rebuild a subtree of half the map.
+//   BALANCE_ROTATE   a weight-balanced tree: after an insert each node on
+//                    the path back up is fixed with at most two rotations,
+//                    so no insert does more than O(logn) work.
+//
 #pragma once
 
 #include <iostream>
 #include <sstream>
 #include <stack>
+#include <utility>
+#include <vector>
 
 using namespace std;
 
+enum BalanceMode { BALANCE_REBUILD, BALANCE_ROTATE };
+
 template<typename keyType, typename valueType>
 class mymap {
  private:
@@ -23,58 +38,176 @@ class mymap {
     };
     NODE* root;  // pointer to root node of the BST
     int size;  // # of key/value pairs in the mymap
+    BalanceMode mode;
+
+    //
+    // Weight-balance parameters for BALANCE_ROTATE (Hirai and Yamamoto's
+    // <3, 2>), with a subtree's weight being its size plus one: neither
+    // child may weigh more than DELTA times the other, and a child is
+    // rotated up in one step unless its inner grandchild weighs at least
+    // GAMMA times its outer one.
+    //
+    static const int DELTA = 3;
+    static const int GAMMA = 2;
+
+    // deepest path a put() can take; a weight-balanced tree of 2^31 keys is
+    // at most 75 deep and a rebuilt one less
+    static const int MAX_DEPTH = 128;
+
+    //
+    // _leftmost:
+    // Returns the first in-order node of the subtree at cur.
+    //
+    static NODE* _leftmost(NODE* cur) {
+        while (cur != NULL && cur->left != NULL)
+            cur = cur->left;
+        return cur;
+    }
+
+    //
+    // _last:
+    // Returns the last in-order node of the subtree at cur.
+    //
+    static NODE* _last(NODE* cur) {
+        while (cur != NULL && !cur->isThreaded && cur->right != NULL)
+            cur = cur->right;
+        return cur;
+    }
+
+    //
+    // _next:
+    // Returns the in-order successor of cur, or NULL after the last node.
+    // A threaded node points straight at it; otherwise it is the leftmost
+    // node of the right subtree.
+    //
+    static NODE* _next(NODE* cur) {
+        if (cur->isThreaded || cur->right == NULL)
+            return cur->right;
+        return _leftmost(cur->right);
+    }
+
+    //
+    // _prev:
+    // Returns the in-order predecessor of cur (the last node if cur is
+    // NULL), or NULL before the first node.  There are no left threads, so
+    // without a left subtree it is the last node the search for cur went
+    // right from.
+    //
+    NODE* _prev(NODE* cur) const {
+        if (cur == NULL)
+            return _last(root);
+        if (cur->left != NULL)
+            return _last(cur->left);
+        NODE* pred = NULL;
+        for (NODE* n = root; n != cur;) {
+            if (n->key < cur->key) {
+                pred = n;
+                n = n->right;
+            } else {
+                n = n->left;
+            }
+        }
+        return pred;
+    }
+
+    //
+    // _lowerBound:
+    // Returns the first node whose key is not less than key (greater than
+    // key if strict), or NULL if there is none.
+    //
+    NODE* _lowerBound(const keyType& key, bool strict) const {
+        NODE* cur = root;
+        NODE* found = NULL;
+        while (cur != NULL) {
+            if (strict ? key < cur->key : !(cur->key < key)) {
+                found = cur;
+                cur = cur->left;
+            } else {
+                cur = cur->isThreaded ? NULL : cur->right;
+            }
+        }
+        return found;
+    }
 
+ public:
     //
     // iterator:
-    // This iterator is used so that mymap will work with a foreach loop.
+    // A bidirectional iterator over the keys in order, so mymap works with a
+    // foreach loop.  ++ follows the threads, so a whole scan takes O(n) with
+    // no recursion or stack; -- searches down from the root, O(logn).
+    // Decrementing end() gives the last key.  Inserting into the mymap may
+    // rebalance it and invalidates its iterators.
     //
-    struct iterator {
+    class iterator {
      private:
-        NODE* curr;  // points to current in-order node for begin/end
+        NODE* curr;  // points to current in-order node, NULL at end
+        const mymap* owner;
+
+        friend class mymap;
 
      public:
-        iterator(NODE* node) {
+        iterator(NODE* node, const mymap* owner = nullptr) {
             curr = node;
+            this->owner = owner;
         }
 
-        keyType operator *() {
+        keyType operator *() const {
             return curr -> key;
         }
 
-        bool operator ==(const iterator& rhs) {
+        const keyType& key() const {
+            return curr->key;
+        }
+
+        valueType& value() const {
+            return curr->value;
+        }
+
+        bool operator ==(const iterator& rhs) const {
             return curr == rhs.curr;
         }
 
-        bool operator !=(const iterator& rhs) {
+        bool operator !=(const iterator& rhs) const {
             return curr != rhs.curr;
         }
 
-        bool isDefault() {
+        bool isDefault() const {
             return !curr;
         }
 
         //
         // operator++:
+        // Advances curr to the next in-order node, or to end() after the last.
+        // O(1) amortized, O(logn) at worst
         //
-        // This function should advance curr to the next in-order node.
-        // O(logN)
+        iterator& operator++() {
+            curr = _next(curr);
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator old = *this;
+            curr = _next(curr);
+            return old;
+        }
+
         //
-        iterator operator++() {
-            if(curr->isThreaded) {
-		curr = curr->right;
-            } else {
-		if(curr->right == NULL)
-		    return NULL;
-		curr = curr->right;
-		while(curr->left != NULL) {
-		    curr = curr->left;
-		}
-            }
-	    return iterator(curr);
+        // operator--:
+        // Moves curr back to the previous in-order node.
+        // O(logn)
+        //
+        iterator& operator--() {
+            curr = owner->_prev(curr);
+            return *this;
+        }
+
+        iterator operator--(int) {
+            iterator old = *this;
+            curr = owner->_prev(curr);
+            return old;
         }
     };
 
- public:
     //
     // default constructor:
     //
@@ -84,6 +217,19 @@ class mymap {
     mymap() {
 	root = nullptr;
 	size = 0;
+	mode = BALANCE_REBUILD;
+    }
+
+    //
+    // constructor:
+    //
+    // Creates an empty mymap balanced the given way.
+    // Time complexity: O(1)
+    //
+    explicit mymap(BalanceMode mode) {
+        root = nullptr;
+        size = 0;
+        this->mode = mode;
     }
 
     //
@@ -97,6 +243,7 @@ class mymap {
     mymap(const mymap& other) {
 	root = nullptr;
 	size = 0;
+	mode = other.mode;
 	NODE* nRoot = other.root;
 	_copy(nRoot);
 	size = other.size;
@@ -114,6 +261,7 @@ class mymap {
 	if(this == &other)
 		return *this;
 	clear();
+	mode = other.mode;
 	NODE* nRoot = other.root;
 	_copy(nRoot);
 	return *this;
@@ -151,10 +299,14 @@ class mymap {
     // the key.
     // Time complexity: O(logn + mlogm), where n is total number of nodes in the
     // threaded, self-balancing BST and m is the number of nodes in the
-    // sub-tree that needs to be re-balanced.
+    // sub-tree that needs to be re-balanced; O(logn) with BALANCE_ROTATE.
     // Space complexity: O(1)
     //
     void put(keyType key, valueType value) {
+	if (mode == BALANCE_ROTATE) {
+	    _putRotate(key, value);
+	    return;
+	}
 	NODE * prev = NULL;
 	NODE * cur = root;
 	NODE * curv = NULL;
@@ -244,12 +396,7 @@ class mymap {
     // threaded, self-balancing BST
     //
     iterator begin() {
-	NODE * cur = root;
-
-	while(cur != NULL) {
-	    cur = cur->left;
-	}
-	return iterator(cur);
+        return iterator(_leftmost(root), this);
     }
 
     //
@@ -261,7 +408,57 @@ class mymap {
     // Time Complexity: O(1)
     //
     iterator end() {
-        return iterator(nullptr);
+        return iterator(nullptr, this);
+    }
+
+    //
+    // lower_bound:
+    //
+    // Returns an iterator to the first key not less than key, or end().
+    // Time complexity: O(logn), where n is total number of nodes in the
+    // threaded, self-balancing BST
+    //
+    iterator lower_bound(keyType key) {
+        return iterator(_lowerBound(key, false), this);
+    }
+
+    //
+    // upper_bound:
+    //
+    // Returns an iterator to the first key greater than key, or end().
+    // Time complexity: O(logn), where n is total number of nodes in the
+    // threaded, self-balancing BST
+    //
+    iterator upper_bound(keyType key) {
+        return iterator(_lowerBound(key, true), this);
+    }
+
+    //
+    // forRange:
+    //
+    // Calls visit(key, value) for every key in [lo, hi), in order.  Finds lo
+    // with one descent and then follows the threads, without recursion.
+    // Time complexity: O(logn + k), where n is total number of nodes in the
+    // threaded, self-balancing BST and k is the number of keys visited.
+    //
+    template<typename Visit>
+    void forRange(keyType lo, keyType hi, Visit visit) {
+        for (NODE* cur = _lowerBound(lo, false); cur != NULL && cur->key < hi; cur = _next(cur))
+            visit(cur->key, cur->value);
+    }
+
+    //
+    // range:
+    //
+    // Returns the key/value pairs with keys in [lo, hi), in order.
+    // Time complexity: O(logn + k), as forRange.
+    //
+    vector<pair<keyType, valueType> > range(keyType lo, keyType hi) {
+        vector<pair<keyType, valueType> > vec;
+        forRange(lo, hi, [&vec](const keyType& k, const valueType& v) {
+            vec.push_back(make_pair(k, v));
+        });
+        return vec;
     }
 
     //
@@ -274,9 +471,12 @@ class mymap {
     // threaded, self-balancing BST
     //
     string toString() {
-	stringstream ss("");
-	_string(root, ss);
-	return ss.str();
+        stringstream ss("");
+        for (NODE* cur = _leftmost(root); cur != NULL; cur = _next(cur)) {
+            ss << "key: " << cur->key;
+            ss << " value: " << cur->value << "\n";
+        }
+        return ss.str();
     }
 
     //
@@ -288,10 +488,11 @@ class mymap {
     // threaded, self-balancing BST
     //
     vector<pair<keyType, valueType> > toVector() {
-	vector<pair<keyType, valueType> > vec;
-	_buildVec(root, vec);
-	return vec;
-	
+        vector<pair<keyType, valueType> > vec;
+        vec.reserve(size);
+        for (NODE* cur = _leftmost(root); cur != NULL; cur = _next(cur))
+            vec.push_back(make_pair(cur->key, cur->value));
+        return vec;
     }
 
     //
@@ -305,9 +506,26 @@ class mymap {
     // threaded, self-balancing BST
     //
     string checkBalance() {
-	stringstream ss("");
-	_string(root, ss);
-	return ss.str();
+        stringstream ss("");
+        _checkBalance(root, ss);
+        return ss.str();
+    }
+
+    //
+    // isBalanced:
+    //
+    // Returns true if every node's nL and nR count its subtrees and, with
+    // BALANCE_ROTATE, every node is weight-balanced.
+    // Time complexity: O(n), where n is total number of nodes in the
+    // threaded, self-balancing BST
+    //
+    bool isBalanced() {
+        int n;
+        return _isBalanced(root, n) && n == size;
+    }
+
+    BalanceMode balanceMode() const {
+        return mode;
     }
 
     //
@@ -354,39 +572,20 @@ class mymap {
         }
     }
     //
-    // _buildVec:
-    // recursive helper function which uses in-order traversal
-    //
-    void _buildVec(NODE * cur, vector<pair<keyType, valueType>> &vec) {
-	if(cur == NULL)
-	    return;
-	_buildVec(cur->left, vec);
-    pair<keyType, valueType> temp(cur->key, cur->value);
-    vec.push_back(temp);
-	if(cur->isThreaded)
-	    _buildVec(NULL, vec);
-	else
-	    _buildVec(cur->right, vec);
-    }
-
-    void _nodeVec(NODE * cur, vector<NODE*> &vec) {
-        if(cur == NULL)
-            return;
-        _nodeVec(cur->left, vec);
-        vec.push_back(cur);
-        if(cur->isThreaded)
-            _nodeVec(NULL, vec);
-        else
-            _nodeVec(cur->right, vec);
-    }
-    //
     // nodeVec:
-    // uses recursive helper function in order to return a vector of nodes from a BST
+    // returns the nodes of the subtree at cur in order, following the threads
+    // from its first node to its last
     //
     vector<NODE*> nodeVec(NODE* cur) {
-	vector<NODE*> vec;
-	_nodeVec(cur,vec);
-	return vec;
+        vector<NODE*> vec;
+        if (cur == NULL)
+            return vec;
+        vec.reserve(cur->nL + cur->nR + 1);
+        NODE* last = _last(cur);
+        for (NODE* n = _leftmost(cur); n != last; n = _next(n))
+            vec.push_back(n);
+        vec.push_back(last);
+        return vec;
     }
 
     //
@@ -409,7 +608,8 @@ class mymap {
 	}
 	if(bal && curv != NULL) {
 	    vector<NODE*> vec = nodeVec(curv);
-	    NODE* nTree = _balanceT(0, vec.size() - 1, vec, NULL);
+	    // the subtree's last node keeps its thread to whatever follows it
+	    NODE* nTree = _balanceT(0, vec.size() - 1, vec, _next(vec.back()));
             if(prevv == NULL)
                 root = nTree;
             else if(nTree->key < prevv->key)
@@ -423,7 +623,7 @@ class mymap {
     //	recursive helper function for balancing the tree
     //	uses left right and middle and vectors in order to find the new root node
     //	
-    NODE* _balanceT(int l, int r, vector<NODE*> vec, NODE* rT) {
+    NODE* _balanceT(int l, int r, const vector<NODE*>& vec, NODE* rT) {
         if(l > r)
             return NULL;
         int m = (l + r) / 2;
@@ -506,19 +706,130 @@ class mymap {
     }		
 
     //
-    //	_string:
-    //	recursive helper function which converts BST to stringstream
+    // _putRotate:
+    // put() for BALANCE_ROTATE.  Descends once, remembering the path, links
+    // the new node in with its thread, then walks back up counting it and
+    // rotating wherever a node has fallen out of weight balance.
     //
-    void _string(NODE* cur, ostream& out) {
-	if(cur == NULL)
-	    return;
-        _string(cur->left, out);
-	out << "key: " << cur->key;
-	out << " value: " << cur->value << "\n";
-	if(cur->isThreaded)
-	    cur = NULL;
-	else
-	    _string(cur->right, out);
+    void _putRotate(const keyType& key, const valueType& value) {
+        NODE* path[MAX_DEPTH];
+        int depth = 0;
+        NODE* cur = root;
+        while (cur != NULL) {
+            if (cur->key == key) {
+                cur->value = value;
+                return;
+            }
+            path[depth++] = cur;
+            if (key < cur->key)
+                cur = cur->left;
+            else
+                cur = cur->isThreaded ? NULL : cur->right;
+        }
+        NODE* temp = new NODE();
+        temp->key = key;
+        temp->value = value;
+        temp->nL = 0;
+        temp->nR = 0;
+        temp->isThreaded = false;
+        size++;
+        NODE* prev = (depth > 0) ? path[depth - 1] : NULL;
+        NODE* none = NULL;
+        insert(false, temp, prev, key, none, none);
+
+        for (int i = depth - 1; i >= 0; i--) {
+            NODE* n = path[i];
+            if (key < n->key)
+                n->nL++;
+            else
+                n->nR++;
+            NODE* fixed = _rebalance(n);
+            if (fixed == n)
+                continue;
+            if (i == 0)
+                root = fixed;
+            else if (path[i - 1]->left == n)
+                path[i - 1]->left = fixed;
+            else
+                path[i - 1]->right = fixed;
+        }
+    }
+
+    //
+    // _rebalance:
+    // Restores weight balance at n, whose children are balanced, with a
+    // single or double rotation.  Returns the subtree's new root.
+    //
+    NODE* _rebalance(NODE* n) {
+        int wl = n->nL + 1, wr = n->nR + 1;
+        if (wr > DELTA * wl) {
+            NODE* r = n->right;
+            if (r->nL + 1 >= GAMMA * (r->nR + 1))
+                n->right = _rotateRight(r);
+            return _rotateLeft(n);
+        }
+        if (wl > DELTA * wr) {
+            NODE* l = n->left;
+            if (l->nR + 1 >= GAMMA * (l->nL + 1))
+                n->left = _rotateLeft(l);
+            return _rotateRight(n);
+        }
+        return n;
+    }
+
+    //
+    // _rotateLeft:
+    // Lifts n's right child above it.  If the child had no left subtree, n
+    // is left with none on its right either and threads to the child, its
+    // successor.
+    //
+    NODE* _rotateLeft(NODE* n) {
+        NODE* r = n->right;
+        if (r->left != NULL) {
+            n->right = r->left;
+        } else {
+            n->right = r;
+            n->isThreaded = true;
+        }
+        n->nR = r->nL;
+        r->left = n;
+        r->nL = n->nL + n->nR + 1;
+        return r;
+    }
+
+    //
+    // _rotateRight:
+    // Lifts n's left child above it.  A threaded child's thread already
+    // points at n, which becomes its real right child.
+    //
+    NODE* _rotateRight(NODE* n) {
+        NODE* l = n->left;
+        n->left = l->isThreaded ? NULL : l->right;
+        n->nL = l->nR;
+        l->right = n;
+        l->isThreaded = false;
+        l->nR = n->nL + n->nR + 1;
+        return l;
+    }
+
+    //
+    // _isBalanced:
+    // recursive helper for isBalanced, setting n to the subtree's size
+    //
+    bool _isBalanced(NODE* cur, int& n) {
+        if (cur == NULL) {
+            n = 0;
+            return true;
+        }
+        int nL, nR;
+        if (!_isBalanced(cur->left, nL) ||
+            !_isBalanced(cur->isThreaded ? NULL : cur->right, nR))
+            return false;
+        n = nL + nR + 1;
+        if (cur->nL != nL || cur->nR != nR)
+            return false;
+        return mode != BALANCE_ROTATE ||
+               (nL + 1 <= DELTA * (nR + 1) && nR + 1 <= DELTA * (nL + 1));
     }
 
     //
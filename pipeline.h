@@ -0,0 +1,522 @@
+//
+// pipeline.h
+//
+// Parallel compression with reads, coding and writes all overlapped.  A ring
+// of reusable block slots moves through three stages:
+//
+//   reader:  reads are queued on an IoEngine, several at once when the input
+//            is seekable
+//   coders:  worker threads, each with its own HuffmanContext, run
+//            encodeBlock() on whichever blocks have arrived
+//   writer:  coded blocks are written strictly in input order, each at the
+//            offset the blocks before it end at
+//
+// The engine is io_uring, driven through the raw system calls so there is no
+// library dependency, or a small pool of threads doing pread/pwrite when the
+// kernel does not allow io_uring or either end is not seekable.  The output
+// is byte-for-byte what compressStream() writes, unless checksums are asked
+// for: then each coder sums its block as it codes it, and the writer joins
+// those into the checksum for the whole file.
+//
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "stream.h"
+#pragma once
+
+//
+// One read or write handed to an IoEngine.  The engine keeps going until the
+// whole buffer is transferred, a write fails, or a read reaches end of input,
+// so callers only ever see finished requests.  offset -1 means "at the
+// current file position", for pipes and terminals.
+//
+struct IoRequest {
+  int fd;
+  uint8_t* buf;
+  size_t len;
+  off_t offset;
+  bool isWrite;
+  size_t done;   // bytes transferred so far
+  int error;     // errno of a failed transfer, or 0
+  void* owner;   // for the caller
+  struct iovec iov;
+};
+
+class IoEngine {
+ public:
+  virtual ~IoEngine() {}
+  virtual void submit(IoRequest* req) = 0;
+  // blocks until a request finishes; returns nullptr after wake()
+  virtual IoRequest* wait() = 0;
+  // makes one wait() return nullptr
+  virtual void wake() = 0;
+};
+
+//
+// Thread-pool engine: each request runs to completion on one of the pool's
+// threads with pread/pwrite (or read/write for offset -1).
+//
+class ThreadIoEngine : public IoEngine {
+ public:
+  ThreadIoEngine(int nThreads = 2) : stopping(false) {
+    for (int i = 0; i < nThreads; i++)
+      threads.push_back(thread(&ThreadIoEngine::run, this));
+  }
+
+  ~ThreadIoEngine() {
+    {
+      lock_guard<mutex> lock(m);
+      stopping = true;
+    }
+    queued.notify_all();
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+  }
+
+  void submit(IoRequest* req) {
+    lock_guard<mutex> lock(m);
+    pending.push_back(req);
+    queued.notify_one();
+  }
+
+  IoRequest* wait() {
+    unique_lock<mutex> lock(m);
+    finished.wait(lock, [this] { return !completed.empty(); });
+    IoRequest* req = completed.front();
+    completed.pop_front();
+    return req;
+  }
+
+  void wake() {
+    lock_guard<mutex> lock(m);
+    completed.push_back(nullptr);
+    finished.notify_one();
+  }
+
+ private:
+  vector<thread> threads;
+  deque<IoRequest*> pending;
+  deque<IoRequest*> completed;
+  bool stopping;
+  mutex m;
+  condition_variable queued;
+  condition_variable finished;
+
+  void run() {
+    while (true) {
+      IoRequest* req;
+      {
+        unique_lock<mutex> lock(m);
+        queued.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (stopping) return;
+        req = pending.front();
+        pending.pop_front();
+      }
+      transfer(req);
+      lock_guard<mutex> lock(m);
+      completed.push_back(req);
+      finished.notify_one();
+    }
+  }
+
+  static void transfer(IoRequest* req) {
+    while (req->done < req->len) {
+      uint8_t* p = req->buf + req->done;
+      size_t n = req->len - req->done;
+      off_t at = req->offset + req->done;
+      ssize_t got;
+      if (req->isWrite)
+        got = (req->offset < 0) ? write(req->fd, p, n) : pwrite(req->fd, p, n, at);
+      else
+        got = (req->offset < 0) ? read(req->fd, p, n) : pread(req->fd, p, n, at);
+      if (got < 0 && errno == EINTR) continue;
+      if (got < 0) {
+        req->error = errno;
+        return;
+      }
+      if (got == 0) {
+        if (req->isWrite) req->error = EIO;
+        return;
+      }
+      req->done += got;
+    }
+  }
+};
+
+//
+// io_uring engine.  The submission side may be used by two threads (the
+// caller, and wait() resubmitting the rest of a short transfer), so it is
+// locked; only wait() touches the completion side.
+//
+class UringIoEngine : public IoEngine {
+ public:
+  UringIoEngine(unsigned entries) : ringFd(-1) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) return;
+
+    sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) sqSize = cqSize = max(sqSize, cqSize);
+    sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    sqRing = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cqRing = single ? sqRing
+                    : mmap(nullptr, cqSize, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void* sqeMem = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqeMem == MAP_FAILED) {
+      if (sqRing != MAP_FAILED) munmap(sqRing, sqSize);
+      if (!single && cqRing != MAP_FAILED) munmap(cqRing, cqSize);
+      if (sqeMem != MAP_FAILED) munmap(sqeMem, sqesSize);
+      close(fd);
+      return;
+    }
+
+    char* sq = (char*)sqRing;
+    sqTail = (unsigned*)(sq + p.sq_off.tail);
+    sqMask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    sqArray = (unsigned*)(sq + p.sq_off.array);
+    sqes = (struct io_uring_sqe*)sqeMem;
+    char* cq = (char*)cqRing;
+    cqHead = (unsigned*)(cq + p.cq_off.head);
+    cqTail = (unsigned*)(cq + p.cq_off.tail);
+    cqMask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    singleMmap = single;
+    ringFd = fd;
+  }
+
+  ~UringIoEngine() {
+    if (ringFd < 0) return;
+    munmap(sqes, sqesSize);
+    if (!singleMmap) munmap(cqRing, cqSize);
+    munmap(sqRing, sqSize);
+    close(ringFd);
+  }
+
+  // false if the kernel refused to set up a ring
+  bool ok() const { return ringFd >= 0; }
+
+  void submit(IoRequest* req) {
+    req->iov.iov_base = req->buf + req->done;
+    req->iov.iov_len = req->len - req->done;
+    push(req->isWrite ? IORING_OP_WRITEV : IORING_OP_READV, req->fd,
+         &req->iov, req->offset + req->done, req);
+  }
+
+  IoRequest* wait() {
+    while (true) {
+      unsigned head = *cqHead;
+      if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+        syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS,
+                nullptr, 0);
+        continue;
+      }
+      struct io_uring_cqe cqe = cqes[head & cqMask];
+      __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+
+      IoRequest* req = (IoRequest*)(uintptr_t)cqe.user_data;
+      if (req == nullptr) return nullptr;
+      if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+        submit(req);
+        continue;
+      }
+      if (cqe.res < 0) {
+        req->error = -cqe.res;
+        return req;
+      }
+      if (cqe.res == 0) {
+        if (req->isWrite) req->error = EIO;
+        return req;
+      }
+      req->done += cqe.res;
+      if (req->done == req->len) return req;
+      submit(req);
+    }
+  }
+
+  void wake() {
+    push(IORING_OP_NOP, -1, nullptr, 0, nullptr);
+  }
+
+ private:
+  int ringFd;
+  void* sqRing;
+  void* cqRing;
+  size_t sqSize, cqSize, sqesSize;
+  bool singleMmap;
+  unsigned* sqTail;
+  unsigned sqMask;
+  unsigned* sqArray;
+  struct io_uring_sqe* sqes;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe* cqes;
+  mutex submitting;
+
+  void push(int op, int fd, struct iovec* iov, off_t offset, IoRequest* req) {
+    lock_guard<mutex> lock(submitting);
+    unsigned tail = *sqTail;
+    unsigned idx = tail & sqMask;
+    struct io_uring_sqe* sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = (iov != nullptr) ? 1 : 0;
+    sqe->off = (uint64_t)offset;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    sqArray[idx] = idx;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, nullptr, 0) < 0 &&
+           errno == EINTR) {
+    }
+  }
+
+  UringIoEngine(const UringIoEngine&) = delete;
+  UringIoEngine& operator=(const UringIoEngine&) = delete;
+};
+
+enum IoBackend { IO_AUTO, IO_URING, IO_THREADS };
+
+struct PipelineOptions {
+  size_t blockSize;
+  int coders;         // worker threads running encodeBlock()
+  IoBackend backend;  // IO_AUTO tries io_uring and falls back to threads
+  bool checksums;     // a TAG_CHECKSUM after every block, and a TAG_END
+
+  PipelineOptions()
+      : blockSize(DEFAULT_BLOCK_SIZE),
+        coders(max(1, (int)thread::hardware_concurrency())),
+        backend(IO_AUTO),
+        checksums(false) {}
+};
+
+//
+// CompressPipeline runs one compression job.  It lives only as long as
+// compressPipeline() below; everything it shares between threads is guarded
+// by m.
+//
+class CompressPipeline {
+ public:
+  CompressPipeline(int fdIn, int fdOut, const PipelineOptions& opt)
+      : fdIn(fdIn), fdOut(fdOut), opt(opt), slots(opt.coders + 4) {
+    inOffset = lseek(fdIn, 0, SEEK_CUR);
+    outOffset = lseek(fdOut, 0, SEEK_CUR);
+    for (size_t i = 0; i < slots.size(); i++) {
+      slots[i].in.resize(opt.blockSize);
+      slots[i].state = FREE;
+      slots[i].io.owner = &slots[i];
+    }
+  }
+
+  bool run() {
+    UringIoEngine* uring = nullptr;
+    if (opt.backend != IO_THREADS && inOffset >= 0 && outOffset >= 0) {
+      uring = new UringIoEngine(2 * slots.size() + 2);
+      if (!uring->ok()) {
+        delete uring;
+        uring = nullptr;
+      }
+    }
+    if (uring == nullptr && opt.backend == IO_URING) return false;
+    ThreadIoEngine* pool = (uring == nullptr) ? new ThreadIoEngine() : nullptr;
+    engine = (uring != nullptr) ? (IoEngine*)uring : (IoEngine*)pool;
+
+    nextRead = nextWrite = 0;
+    rawLength = 0;
+    crc = 0;
+    endSeq = UINT64_MAX;
+    readsInFlight = writesInFlight = 0;
+    failed = stopping = false;
+
+    thread reaper(&CompressPipeline::reap, this);
+    vector<thread> coders;
+    for (int i = 0; i < opt.coders; i++)
+      coders.push_back(thread(&CompressPipeline::code, this));
+
+    {
+      unique_lock<mutex> lock(m);
+      while (true) {
+        startReads();
+        startWrites();
+        bool finished = nextWrite == endSeq || failed;
+        if (finished && readsInFlight == 0 && writesInFlight == 0) break;
+        changed.wait(lock);
+      }
+      stopping = true;
+    }
+    changed.notify_all();
+    for (size_t i = 0; i < coders.size(); i++) coders[i].join();
+    engine->wake();
+    reaper.join();
+    delete engine;
+    if (!failed && opt.checksums) failed = !writeEnd();
+    return !failed;
+  }
+
+ private:
+  enum State { FREE, READING, READ, CODING, CODED, WRITING };
+  struct Slot {
+    IoRequest io;
+    vector<uint8_t> in;
+    vector<uint8_t> out;
+    uint64_t seq;
+    size_t len;
+    uint32_t crc;  // of in, when opt.checksums
+    State state;
+  };
+
+  int fdIn, fdOut;
+  PipelineOptions opt;
+  vector<Slot> slots;
+  IoEngine* engine;
+  off_t inOffset, outOffset;  // -1 when that end is not seekable
+  uint64_t nextRead, nextWrite;
+  uint64_t endSeq;            // number of blocks, once a short read shows it
+  uint64_t rawLength;         // bytes in the blocks written so far
+  uint32_t crc;               // and their CRC32C
+  int readsInFlight, writesInFlight;
+  bool failed, stopping;
+  mutex m;
+  condition_variable changed;
+
+  void startReads() {
+    for (size_t i = 0; i < slots.size() && !failed && nextRead < endSeq; i++) {
+      // a stream has one position, so its reads have to go one at a time
+      if (inOffset < 0 && readsInFlight > 0) return;
+      Slot& s = slots[i];
+      if (s.state != FREE) continue;
+      s.seq = nextRead++;
+      s.state = READING;
+      s.io.fd = fdIn;
+      s.io.buf = s.in.data();
+      s.io.len = s.in.size();
+      s.io.offset = (inOffset < 0) ? -1 : inOffset + s.seq * opt.blockSize;
+      s.io.isWrite = false;
+      s.io.done = 0;
+      s.io.error = 0;
+      readsInFlight++;
+      engine->submit(&s.io);
+    }
+  }
+
+  void startWrites() {
+    for (size_t i = 0; i < slots.size() && !failed && nextWrite < endSeq; i++) {
+      if (outOffset < 0 && writesInFlight > 0) return;
+      Slot& s = slots[i];
+      if (s.state != CODED || s.seq != nextWrite) continue;
+      s.state = WRITING;
+      s.io.fd = fdOut;
+      s.io.buf = s.out.data();
+      s.io.len = s.out.size();
+      s.io.offset = outOffset;
+      s.io.isWrite = true;
+      s.io.done = 0;
+      s.io.error = 0;
+      if (outOffset >= 0) outOffset += s.out.size();
+      if (opt.checksums) {
+        crc = crc32cCombine(crc, s.crc, s.len);
+        rawLength += s.len;
+      }
+      nextWrite++;
+      writesInFlight++;
+      engine->submit(&s.io);
+      i = (size_t)-1;  // the next block may sit in an earlier slot
+    }
+  }
+
+  void reap() {
+    while (IoRequest* req = engine->wait()) {
+      lock_guard<mutex> lock(m);
+      Slot& s = *(Slot*)req->owner;
+      if (req->error != 0) failed = true;
+      if (s.state == WRITING) {
+        writesInFlight--;
+        s.state = FREE;
+      } else {
+        readsInFlight--;
+        s.len = req->done;
+        s.state = READ;
+        if (s.len < s.in.size()) {
+          // a short read is the last block; an empty one only counts when
+          // the whole input is empty
+          uint64_t end = (s.len > 0 || s.seq == 0) ? s.seq + 1 : s.seq;
+          endSeq = min(endSeq, end);
+        }
+        if (failed) s.state = FREE;
+      }
+      for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i].state == READ && slots[i].seq >= endSeq)
+          slots[i].state = FREE;
+      }
+      changed.notify_all();
+    }
+  }
+
+  void code() {
+    HuffmanContext ctx;
+    unique_lock<mutex> lock(m);
+    while (true) {
+      Slot* s = nullptr;
+      changed.wait(lock, [&] {
+        if (stopping) return true;
+        for (size_t i = 0; i < slots.size(); i++) {
+          if (slots[i].state == READ && slots[i].seq < endSeq) {
+            s = &slots[i];
+            return true;
+          }
+        }
+        return false;
+      });
+      if (s == nullptr) return;
+      s->state = CODING;
+      lock.unlock();
+      s->out.clear();
+      encodeBlock(s->in.data(), s->len, s->out, ctx);
+      if (opt.checksums) s->crc = appendChecksum(s->in.data(), s->len, s->out);
+      lock.lock();
+      s->state = CODED;
+      changed.notify_all();
+    }
+  }
+
+  // the TAG_END record, after every block has been written
+  bool writeEnd() {
+    vector<uint8_t> end;
+    appendEnd(rawLength, crc, end);
+    if (outOffset >= 0 && lseek(fdOut, outOffset, SEEK_SET) < 0) return false;
+    return _writeAll(fdOut, end.data(), end.size());
+  }
+
+  CompressPipeline(const CompressPipeline&) = delete;
+  CompressPipeline& operator=(const CompressPipeline&) = delete;
+};
+
+//
+// *This function compresses fdIn to fdOut with reads, coding on
+// opt.coders threads, and writes all overlapped.  Without opt.checksums the
+// output is identical to compressStream()'s.  Returns false if a read or write fails, or if
+// opt.backend is IO_URING and io_uring is not available.
+//
+bool compressPipeline(int fdIn, int fdOut,
+                      const PipelineOptions& opt = PipelineOptions()) {
+  CompressPipeline job(fdIn, fdOut, opt);
+  return job.run();
+}
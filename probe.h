@@ -0,0 +1,149 @@
+//
+// probe.h
+//
+// Guesses how well an input will compress before spending the time on it.
+// estimateCompression() counts a sample of the input with countSampled(),
+// the same histogram stage compress() starts with, builds the codes for it
+// and reports the Shannon entropy alongside the exact size those codes take.
+// The default sample is PROBE_BLOCKS runs of PROBE_BLOCK bytes spread across
+// the input, so a probe costs tens of microseconds however big the input is;
+// inputs smaller than the sample are counted whole.
+//
+// estimateFile() does the same for a file, reading only the sampled runs.
+//
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "context.h"
+#include "format.h"
+#include "stream.h"
+#pragma once
+
+const size_t PROBE_BLOCK = 4096;
+const size_t PROBE_BLOCKS = 16;
+
+// predicted ratios above this are not worth the time to compress
+const double PROBE_WORTHWHILE_RATIO = 0.97;
+
+// the kind of block the encoder would most likely pick
+enum ProbeMode { PROBE_STORED, PROBE_RUN, PROBE_HUFFMAN };
+
+struct CompressionEstimate {
+  uint64_t length;        // bytes in the input
+  uint64_t sampled;       // bytes the estimate was made from
+  int symbols;            // distinct bytes in the sample
+  double entropy;         // Shannon entropy of the sample, bits per byte
+  double codeLength;      // average Huffman code length, bits per byte
+  double predictedRatio;  // output size over input size, headers included
+  ProbeMode mode;
+
+  bool worthCompressing() const { return mode != PROBE_STORED; }
+};
+
+//
+// Turns the histogram ctx holds for a sample of a length-byte input into an
+// estimate.  Each DEFAULT_BLOCK_SIZE block pays for its own code table: the
+// "{k:v, ...}" header or the multi-stream lengths and sizes, whichever is
+// smaller, the way encodeBlock() chooses.
+//
+CompressionEstimate _finishEstimate(HuffmanContext& ctx, uint64_t length) {
+  CompressionEstimate e;
+  e.length = length;
+  e.sampled = ctx.messageLength();
+  e.symbols = ctx.symbolCount() - 1;
+  e.entropy = 0;
+  e.codeLength = 0;
+  e.predictedRatio = 1;
+  e.mode = PROBE_STORED;
+  if (length == 0 || e.sampled == 0) return e;
+
+  for (int sym = 0; sym < 256; sym++) {
+    if (ctx.count(sym) == 0) continue;
+    double p = (double)ctx.count(sym) / e.sampled;
+    e.entropy -= p * log2(p);
+  }
+
+  uint64_t blocks = (length + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+  uint64_t blockLength = min<uint64_t>(length, DEFAULT_BLOCK_SIZE);
+  double stored = length + blocks * (1 + varintSize(blockLength));
+  if (e.symbols == 1) {
+    e.mode = PROBE_RUN;
+    e.codeLength = 0;
+    e.predictedRatio = (double)blocks * (2 + varintSize(blockLength)) / length;
+    return e;
+  }
+
+  ctx.buildTree();
+  ctx.buildCodes();
+  e.codeLength = (double)(ctx.codedBits() - ctx.codeLength(PSEUDO_EOF)) / e.sampled;
+  int nLens = 0, nStreams = (blockLength < MULTI_STREAM_MIN) ? 1 : STREAM_COUNT;
+  for (int sym = 0; sym < 256; sym++)
+    if (ctx.count(sym) != 0) nLens = sym + 1;
+  // each stream's size, and half a byte of padding on average
+  size_t streamTable = 1 + varintSize(blockLength) + 2 + (nLens + 1) / 2 +
+                       nStreams * varintSize(blockLength * e.codeLength / 8 / nStreams) +
+                       nStreams / 2;
+  ctx.quantize();
+  size_t table = min(ctx.headerSize(), min(ctx.quantizedHeaderSize(blockLength), streamTable));
+  double coded = e.codeLength * length / 8 + (double)blocks * table;
+  if (coded < stored) e.mode = PROBE_HUFFMAN;
+  e.predictedRatio = min(coded, stored) / length;
+  if (e.predictedRatio > PROBE_WORTHWHILE_RATIO) e.mode = PROBE_STORED;
+  return e;
+}
+
+//
+// *This function estimates how well len bytes at data compress, counting
+// only a sample of them: the given number of runs of block bytes each.  It
+// uses ctx's histogram and codes, so call it before compressing with ctx,
+// not in the middle.
+//
+CompressionEstimate estimateCompression(const uint8_t* data, size_t len,
+                                        HuffmanContext& ctx = threadContext(),
+                                        size_t block = PROBE_BLOCK,
+                                        size_t blocks = PROBE_BLOCKS) {
+  ctx.countSampled(data, len, block, blocks);
+  return _finishEstimate(ctx, len);
+}
+
+//
+// *This function estimates how well a file compresses, reading only the
+// sampled runs into ctx's input buffer.  Returns false if the file cannot
+// be read.
+//
+bool estimateFile(const string& filename, CompressionEstimate& estimate,
+                  HuffmanContext& ctx = threadContext(), size_t block = PROBE_BLOCK,
+                  size_t blocks = PROBE_BLOCKS) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0;
+  uint64_t length = ok ? st.st_size : 0;
+  if (block == 0 || blocks == 0 || block >= length / blocks) {
+    block = length;
+    blocks = 1;
+  }
+  vector<uint8_t>& sample = ctx.inputBuffer();
+  sample.resize(block * blocks);
+  for (size_t b = 0; ok && b < blocks; b++) {
+    off_t at = (blocks == 1) ? 0 : (length - block) / (blocks - 1) * b;
+    ok = pread(fd, sample.data() + b * block, block, at) == (ssize_t)block;
+  }
+  close(fd);
+  if (!ok) return false;
+  ctx.countSymbols(sample.data(), sample.size());
+  estimate = _finishEstimate(ctx, length);
+  return true;
+}
+
+const char* probeModeName(ProbeMode mode) {
+  switch (mode) {
+    case PROBE_RUN: return "run";
+    case PROBE_HUFFMAN: return "huffman";
+    default: return "stored";
+  }
+}
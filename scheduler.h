@@ -0,0 +1,132 @@
+//
+// scheduler.h
+//
+// A work-stealing thread pool.  Every worker owns a deque of tasks: it takes
+// its own work from the back, newest first, and when that runs dry steals
+// the oldest task from another worker's front.  Uneven batches, like a few
+// huge files next to thousands of tiny ones, keep every thread busy.
+//
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#pragma once
+
+using namespace std;
+
+class WorkStealingPool {
+ public:
+  WorkStealingPool(int nThreads) : queued(0), running(0), stopping(false) {
+    nThreads = max(1, nThreads);
+    for (int i = 0; i < nThreads; i++) queues.push_back(unique_ptr<Queue>(new Queue));
+    for (int i = 0; i < nThreads; i++)
+      threads.push_back(thread(&WorkStealingPool::run, this, i));
+  }
+
+  ~WorkStealingPool() {
+    wait();
+    {
+      lock_guard<mutex> lock(m);
+      stopping = true;
+    }
+    wakeup.notify_all();
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+  }
+
+  int size() const { return (int)threads.size(); }
+
+  //
+  // submit:
+  // Queues task.  Tasks submitted by a worker go on its own deque; others are
+  // dealt out round-robin.
+  //
+  void submit(function<void()> task) {
+    int index = workerIndex();
+    if (index < 0) index = (int)(dealt++ % queues.size());
+    {
+      lock_guard<mutex> lock(queues[index]->m);
+      queues[index]->tasks.push_back(move(task));
+    }
+    lock_guard<mutex> lock(m);
+    queued++;
+    wakeup.notify_one();
+  }
+
+  //
+  // wait:
+  // Blocks until every submitted task, including ones submitted by tasks,
+  // has finished.
+  //
+  void wait() {
+    unique_lock<mutex> lock(m);
+    idle.wait(lock, [this] { return queued == 0 && running == 0; });
+  }
+
+ private:
+  struct Queue {
+    mutex m;
+    deque<function<void()> > tasks;
+  };
+
+  vector<unique_ptr<Queue> > queues;
+  vector<thread> threads;
+  atomic<unsigned> dealt{0};
+  long queued;   // tasks sitting in some deque
+  long running;  // tasks being run
+  bool stopping;
+  mutex m;
+  condition_variable wakeup;
+  condition_variable idle;
+
+  static int& workerIndex() {
+    static thread_local int index = -1;
+    return index;
+  }
+
+  bool take(int self, function<void()>& task) {
+    int n = (int)queues.size();
+    for (int k = 0; k < n; k++) {
+      Queue& q = *queues[(self + k) % n];
+      lock_guard<mutex> lock(q.m);
+      if (q.tasks.empty()) continue;
+      if (k == 0) {
+        task = move(q.tasks.back());
+        q.tasks.pop_back();
+      } else {
+        task = move(q.tasks.front());
+        q.tasks.pop_front();
+      }
+      return true;
+    }
+    return false;
+  }
+
+  void run(int self) {
+    workerIndex() = self;
+    while (true) {
+      {
+        unique_lock<mutex> lock(m);
+        wakeup.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0) return;
+        queued--;
+        running++;
+      }
+      // the count says a task is waiting somewhere; keep looking until this
+      // worker gets one
+      function<void()> task;
+      while (!take(self, task)) this_thread::yield();
+      task();
+      lock_guard<mutex> lock(m);
+      running--;
+      if (queued == 0 && running == 0) idle.notify_all();
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+};
@@ -0,0 +1,259 @@
+//
+// serialize.h
+//
+// Compact binary forms of hashmap and mymap, so frequency tables and indexes
+// load at the speed they are read rather than the speed "{k:v, ...}" text
+// parses.  Both start with a fixed header
+//
+//   4 bytes  magic: "HMP1" for a hashmap, "MMP1" for a mymap
+//   8 bytes  number of entries, little-endian
+//   8 bytes  bytes of entries that follow, little-endian
+//
+// and then the entries, each a key followed by its value.  Integers are
+// varints, signed ones zigzagged so small negative keys stay one byte;
+// strings are a varint length and their bytes.  A hashmap's entries are in
+// keys() order, so the map read back prints the same text, and a mymap's
+// are in key order.
+//
+// SerializedView reads entries straight out of the bytes, for instance from
+// a MappedFile, without building a map.
+//
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "format.h"
+#include "hashmap.h"
+#include "mymap.h"
+#pragma once
+
+using namespace std;
+
+const size_t SERIAL_HEADER_SIZE = 20;
+
+enum SerialKind { SERIAL_HASHMAP, SERIAL_MYMAP };
+
+const char* const SERIAL_MAGIC[] = {"HMP1", "MMP1"};
+
+//
+// How one key or value type is written.  Integers of any width, and strings.
+//
+template<typename T, typename Enable = void>
+struct _Serial;
+
+template<typename T>
+struct _Serial<T, typename enable_if<is_integral<T>::value>::type> {
+  static void put(T v, vector<uint8_t>& out) {
+    if (is_signed<T>::value) {
+      int64_t s = (int64_t)v;
+      putVarint(((uint64_t)s << 1) ^ (uint64_t)(s >> 63), out);
+    } else {
+      putVarint((uint64_t)v, out);
+    }
+  }
+
+  // false if the varint is cut short or out of T's range
+  static bool get(const uint8_t* data, size_t len, size_t& pos, T& v) {
+    uint64_t u;
+    if (!getVarint(data, len, pos, u)) return false;
+    if (is_signed<T>::value) {
+      int64_t s = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+      if (s < (int64_t)numeric_limits<T>::min() || s > (int64_t)numeric_limits<T>::max())
+        return false;
+      v = (T)s;
+    } else {
+      if (u > (uint64_t)numeric_limits<T>::max()) return false;
+      v = (T)u;
+    }
+    return true;
+  }
+};
+
+template<>
+struct _Serial<string> {
+  static void put(const string& v, vector<uint8_t>& out) {
+    putVarint(v.size(), out);
+    out.insert(out.end(), v.begin(), v.end());
+  }
+
+  static bool get(const uint8_t* data, size_t len, size_t& pos, string& v) {
+    uint64_t n;
+    if (!getVarint(data, len, pos, n) || n > len - pos) return false;
+    v.assign((const char*)data + pos, n);
+    pos += n;
+    return true;
+  }
+};
+
+// appends the header, leaving the entry length to _finishSerial()
+size_t _startSerial(SerialKind kind, size_t count, vector<uint8_t>& out) {
+  out.insert(out.end(), SERIAL_MAGIC[kind], SERIAL_MAGIC[kind] + 4);
+  _putFixed(count, 8, out);
+  _putFixed(0, 8, out);
+  return out.size();
+}
+
+void _finishSerial(size_t start, vector<uint8_t>& out) {
+  uint64_t n = out.size() - start;
+  for (int i = 0; i < 8; i++) out[start - 8 + i] = (uint8_t)(n >> (8 * i));
+}
+
+//
+// Reads the header at data[pos], leaving pos on the first entry and end just
+// past the last.  Returns false if it is not a header of this kind or the
+// entries it announces are not all there.
+//
+bool _readSerialHeader(SerialKind kind, const uint8_t* data, size_t len, size_t& pos,
+                       uint64_t& count, size_t& end) {
+  if (pos > len || len - pos < SERIAL_HEADER_SIZE) return false;
+  if (memcmp(data + pos, SERIAL_MAGIC[kind], 4) != 0) return false;
+  count = _getFixed(data + pos + 4, 8);
+  uint64_t bytes = _getFixed(data + pos + 12, 8);
+  pos += SERIAL_HEADER_SIZE;
+  // every entry takes at least two bytes
+  if (bytes > len - pos || count > bytes / 2) return false;
+  end = pos + bytes;
+  return true;
+}
+
+//
+// *This function appends map to out in the binary form above.
+//
+void serializeMap(const hashmap& map, vector<uint8_t>& out) {
+  vector<int> keys = map.keys();
+  size_t start = _startSerial(SERIAL_HASHMAP, keys.size(), out);
+  for (size_t i = 0; i < keys.size(); i++) {
+    _Serial<int>::put(keys[i], out);
+    _Serial<long long>::put(map.get(keys[i]), out);
+  }
+  _finishSerial(start, out);
+}
+
+template<typename keyType, typename valueType>
+void serializeMap(mymap<keyType, valueType>& map, vector<uint8_t>& out) {
+  size_t start = _startSerial(SERIAL_MYMAP, map.Size(), out);
+  for (typename mymap<keyType, valueType>::iterator it = map.begin(); it != map.end(); ++it) {
+    _Serial<keyType>::put(it.key(), out);
+    _Serial<valueType>::put(it.value(), out);
+  }
+  _finishSerial(start, out);
+}
+
+//
+// *This function reads a map written by serializeMap() at data[pos] into
+// map, leaving pos just past it.  Returns false if the bytes are not one,
+// leaving the entries read so far in map, as operator>> does.
+//
+bool deserializeMap(const uint8_t* data, size_t len, size_t& pos, hashmap& map) {
+  uint64_t count;
+  size_t end;
+  if (!_readSerialHeader(SERIAL_HASHMAP, data, len, pos, count, end)) return false;
+  for (uint64_t i = 0; i < count; i++) {
+    int key;
+    long long value;
+    if (!_Serial<int>::get(data, end, pos, key) || !_Serial<long long>::get(data, end, pos, value))
+      return false;
+    map.put(key, value);
+  }
+  return pos == end;
+}
+
+template<typename keyType, typename valueType>
+bool deserializeMap(const uint8_t* data, size_t len, size_t& pos,
+                    mymap<keyType, valueType>& map) {
+  uint64_t count;
+  size_t end;
+  if (!_readSerialHeader(SERIAL_MYMAP, data, len, pos, count, end)) return false;
+  for (uint64_t i = 0; i < count; i++) {
+    keyType key;
+    valueType value;
+    if (!_Serial<keyType>::get(data, end, pos, key) ||
+        !_Serial<valueType>::get(data, end, pos, value))
+      return false;
+    map.put(key, value);
+  }
+  return pos == end;
+}
+
+//
+// SerializedView reads a serialized hashmap or mymap in place.  open()
+// checks every entry once; after that forEach() and find() decode entries
+// as they go and allocate nothing for integer keys and values.  The bytes
+// have to outlive the view.
+//
+template<typename keyType, typename valueType>
+class SerializedView {
+ public:
+  SerializedView() : data(nullptr), begin(0), end(0), count(0), sorted(false) {}
+
+  //
+  // open:
+  // Views the map serialized at data[pos], of either kind, leaving pos just
+  // past it.  Returns false if the bytes are not one, or claim to be a mymap
+  // with keys out of order, which find() could not search.
+  //
+  bool open(const uint8_t* bytes, size_t len, size_t& pos) {
+    size_t at = pos;
+    sorted = (pos <= len && len - pos >= 4 && memcmp(bytes + pos, SERIAL_MAGIC[SERIAL_MYMAP], 4) == 0);
+    if (!_readSerialHeader(sorted ? SERIAL_MYMAP : SERIAL_HASHMAP, bytes, len, at, count, end))
+      return false;
+    begin = at;
+    keyType key = keyType(), last = keyType();
+    valueType value;
+    for (uint64_t i = 0; i < count; i++) {
+      if (!_Serial<keyType>::get(bytes, end, at, key) ||
+          !_Serial<valueType>::get(bytes, end, at, value))
+        return false;
+      if (sorted && i > 0 && !(last < key)) return false;
+      swap(last, key);
+    }
+    if (at != end) return false;
+    data = bytes;
+    pos = end;
+    return true;
+  }
+
+  uint64_t size() const { return count; }
+
+  // true for a serialized mymap, whose keys are in order
+  bool isSorted() const { return sorted; }
+
+  // calls visit(key, value) for every entry, in the order they were written
+  template<typename Visit>
+  void forEach(Visit visit) const {
+    size_t at = begin;
+    keyType key = keyType();
+    valueType value = valueType();
+    for (uint64_t i = 0; i < count; i++) {
+      _Serial<keyType>::get(data, end, at, key);
+      _Serial<valueType>::get(data, end, at, value);
+      visit(key, value);
+    }
+  }
+
+  //
+  // find:
+  // Sets value to key's and returns true if key is there.  Entries are
+  // scanned in order, stopping early past key in a sorted view.
+  //
+  bool find(const keyType& key, valueType& value) const {
+    size_t at = begin;
+    keyType k = keyType();
+    for (uint64_t i = 0; i < count; i++) {
+      _Serial<keyType>::get(data, end, at, k);
+      _Serial<valueType>::get(data, end, at, value);
+      if (k == key) return true;
+      if (sorted && key < k) return false;
+    }
+    return false;
+  }
+
+ private:
+  const uint8_t* data;
+  size_t begin, end;  // the entries
+  uint64_t count;
+  bool sorted;
+};
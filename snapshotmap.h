@@ -0,0 +1,254 @@
+//
+// snapshotmap.h
+//
+// SnapshotMap is a mymap many threads can read while one at a time writes.
+// Readers never lock: they pin the current version of the map and search it
+// in place.  A writer copies the current version, changes the copy and
+// publishes it with one atomic store, so readers see each write whole or not
+// at all.  Writes cost a copy of the map, which suits registries that are
+// filled once and then read on every block.
+//
+// Old versions are freed by epoch-based reclamation.  Every reading thread
+// has a slot in one process-wide table where, while it reads, it records
+// the epoch it started in.  Publishing a version advances the epoch and
+// tags the version it replaced with the new one; a retired version is freed
+// once no slot holds an epoch older than its tag, since any reader that
+// started later found the newer version.
+//
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "mymap.h"
+#pragma once
+
+using namespace std;
+
+// threads that can read at once; any more wait for a slot to free up
+const int EPOCH_SLOTS = 256;
+
+struct _EpochDomain {
+  struct alignas(64) Slot {
+    atomic<uint64_t> active;  // epoch its reader started in, 0 when idle
+    atomic<bool> used;        // owned by a thread
+  };
+
+  atomic<uint64_t> epoch;
+  Slot slots[EPOCH_SLOTS];
+
+  _EpochDomain() : epoch(1) {
+    for (int i = 0; i < EPOCH_SLOTS; i++) {
+      slots[i].active = 0;
+      slots[i].used = false;
+    }
+  }
+
+  // the oldest epoch a reader is in, or UINT64_MAX if none is reading
+  uint64_t oldestActive() {
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < EPOCH_SLOTS; i++) {
+      uint64_t e = slots[i].active.load();
+      if (e != 0 && e < oldest) oldest = e;
+    }
+    return oldest;
+  }
+};
+
+_EpochDomain& _epochDomain() {
+  static _EpochDomain domain;
+  return domain;
+}
+
+//
+// A thread's slot, claimed the first time it reads and given back when it
+// exits.  depth lets a thread hold several snapshots at once.
+//
+struct _EpochReader {
+  int slot;
+  int depth;
+
+  _EpochReader() : slot(-1), depth(0) {}
+
+  ~_EpochReader() {
+    if (slot >= 0) _epochDomain().slots[slot].used.store(false);
+  }
+
+  void pin() {
+    if (depth++ != 0) return;
+    _EpochDomain& d = _epochDomain();
+    while (slot < 0) {
+      for (int i = 0; i < EPOCH_SLOTS && slot < 0; i++) {
+        bool expected = false;
+        if (!d.slots[i].used.load(memory_order_relaxed) &&
+            d.slots[i].used.compare_exchange_strong(expected, true))
+          slot = i;
+      }
+      if (slot < 0) this_thread::yield();
+    }
+    d.slots[slot].active.store(d.epoch.load());
+  }
+
+  void unpin() {
+    if (--depth == 0) _epochDomain().slots[slot].active.store(0, memory_order_release);
+  }
+};
+
+_EpochReader& _epochReader() {
+  static thread_local _EpochReader reader;
+  return reader;
+}
+
+template<typename keyType, typename valueType>
+class SnapshotMap {
+ public:
+  typedef mymap<keyType, valueType> Map;
+
+  //
+  // Snapshot pins one version of the map for as long as it lives.  Lookups
+  // on it are lock-free and all see the same contents, however many writes
+  // are published meanwhile.  Keep it short-lived: versions retired while
+  // it exists are not freed until it goes away.
+  //
+  class Snapshot {
+   public:
+    Snapshot(Snapshot&& other) : map(other.map) { other.map = nullptr; }
+
+    ~Snapshot() {
+      if (map != nullptr) _epochReader().unpin();
+    }
+
+    bool contains(const keyType& key) const { return map->contains(key); }
+
+    // the value for key, or valueType() if it is not there
+    valueType get(const keyType& key) const { return map->get(key); }
+
+    int Size() const { return map->Size(); }
+
+    template<typename Visit>
+    void forRange(const keyType& lo, const keyType& hi, Visit visit) const {
+      map->forRange(lo, hi, visit);
+    }
+
+    vector<pair<keyType, valueType> > toVector() const { return map->toVector(); }
+
+   private:
+    Map* map;  // searched only, never changed, despite mymap's signatures
+
+    friend class SnapshotMap;
+
+    explicit Snapshot(const atomic<Map*>& current) {
+      _epochReader().pin();
+      map = current.load();
+    }
+
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+  };
+
+  SnapshotMap(BalanceMode mode = BALANCE_ROTATE) : current(new Map(mode)) {}
+
+  // no thread may be reading the map when it is destroyed
+  ~SnapshotMap() {
+    delete current.load();
+    for (size_t i = 0; i < retired.size(); i++) delete retired[i].second;
+  }
+
+  //
+  // snapshot:
+  // Pins the current version for several lookups that have to agree.
+  //
+  Snapshot snapshot() const { return Snapshot(current); }
+
+  bool contains(const keyType& key) const { return snapshot().contains(key); }
+  valueType get(const keyType& key) const { return snapshot().get(key); }
+  int Size() const { return snapshot().Size(); }
+
+  //
+  // put:
+  // Publishes a version with key set to value.  Writers take turns; readers
+  // are never held up.
+  //
+  void put(const keyType& key, const valueType& value) {
+    update([&key, &value](Map& m) { m.put(key, value); });
+  }
+
+  //
+  // update:
+  // Calls change(map) on a private copy of the current version and then
+  // publishes the copy, so any number of changes cost one copy and readers
+  // see them all at once.  If change returns false, nothing is published.
+  //
+  template<typename Change>
+  bool update(Change change) {
+    lock_guard<mutex> lock(writer);
+    Map* next = new Map(*current.load());
+    if (!_applies(change, *next)) {
+      delete next;
+      return false;
+    }
+    _publish(next);
+    return true;
+  }
+
+  //
+  // putIfAbsent:
+  // Publishes key with value unless key is already there.  Returns whether
+  // it did; a map with the key already is not copied.
+  //
+  bool putIfAbsent(const keyType& key, const valueType& value) {
+    lock_guard<mutex> lock(writer);
+    if (current.load()->contains(key)) return false;
+    Map* next = new Map(*current.load());
+    next->put(key, value);
+    _publish(next);
+    return true;
+  }
+
+  // versions published and not yet freed, for tests
+  size_t retiredCount() {
+    lock_guard<mutex> lock(writer);
+    return retired.size();
+  }
+
+ private:
+  atomic<Map*> current;
+  mutex writer;                               // held by the one writer
+  vector<pair<uint64_t, Map*> > retired;      // old versions, by epoch tag
+
+  // change may return void (always publish) or bool
+  template<typename Change>
+  static auto _applies(Change& change, Map& m) ->
+      typename enable_if<is_void<decltype(change(m))>::value, bool>::type {
+    change(m);
+    return true;
+  }
+
+  template<typename Change>
+  static auto _applies(Change& change, Map& m) ->
+      typename enable_if<!is_void<decltype(change(m))>::value, bool>::type {
+    return change(m);
+  }
+
+  // swaps next in, retires the old version and frees whatever readers are done with
+  void _publish(Map* next) {
+    _EpochDomain& d = _epochDomain();
+    Map* old = current.exchange(next);
+    retired.push_back(make_pair(d.epoch.fetch_add(1) + 1, old));
+    uint64_t oldest = d.oldestActive();
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); i++) {
+      if (retired[i].first <= oldest)
+        delete retired[i].second;
+      else
+        retired[kept++] = retired[i];
+    }
+    retired.resize(kept);
+  }
+
+  SnapshotMap(const SnapshotMap&) = delete;
+  SnapshotMap& operator=(const SnapshotMap&) = delete;
+};
@@ -0,0 +1,245 @@
+//
+// stats.h
+//
+// Per-stage instrumentation.  Built with -DHUF_STATS (see "make build-stats")
+// every stage of coding records its calls, wall time and bytes in and out,
+// along with the symbols coded, code bits written, deepest tree and output
+// buffer growths.  Without it every hook below is an empty inline function
+// and StageTimer is an empty object, so the instrumented code compiles to
+// what it was before.
+//
+// Counters are process-wide relaxed atomics, touched once per block rather
+// than per symbol, so threads coding in parallel all add to the same totals.
+// statsSnapshot() copies them into a HuffmanStats, which statsJson() and
+// statsPrometheus() print.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#pragma once
+
+using namespace std;
+
+#ifdef HUF_STATS
+const bool STATS_ENABLED = true;
+#else
+const bool STATS_ENABLED = false;
+#endif
+
+enum Stage {
+  STAGE_HISTOGRAM,  // countSymbols() and parallelHistogram()
+  STAGE_TREE,       // buildTree()
+  STAGE_CODES,      // buildCodes() and planStreams()
+  STAGE_ENCODE,     // writing any block
+  STAGE_DECODE,     // reading any block
+  STAGE_CHECKSUM,   // CRC32C of blocks and files
+  NUM_STAGES
+};
+
+const char* const STAGE_NAMES[NUM_STAGES] = {"histogram", "tree",   "codes",
+                                             "encode",    "decode", "checksum"};
+
+struct StageStats {
+  uint64_t calls;
+  uint64_t nanos;
+  uint64_t bytesIn;
+  uint64_t bytesOut;
+};
+
+struct HuffmanStats {
+  StageStats stage[NUM_STAGES];
+  uint64_t symbols;       // symbols Huffman coded, PSEUDO_EOF included
+  uint64_t codeBits;      // bits of coded output they took
+  uint64_t maxTreeDepth;  // longest code built
+  uint64_t growths;       // times an output buffer had to allocate more room
+
+  double averageCodeLength() const {
+    return symbols ? (double)codeBits / symbols : 0;
+  }
+};
+
+struct _StatsCounters {
+  atomic<uint64_t> calls[NUM_STAGES];
+  atomic<uint64_t> nanos[NUM_STAGES];
+  atomic<uint64_t> bytesIn[NUM_STAGES];
+  atomic<uint64_t> bytesOut[NUM_STAGES];
+  atomic<uint64_t> symbols;
+  atomic<uint64_t> codeBits;
+  atomic<uint64_t> maxTreeDepth;
+  atomic<uint64_t> growths;
+};
+
+// zero-initialized, being static
+_StatsCounters& _statsCounters() {
+  static _StatsCounters counters;
+  return counters;
+}
+
+//
+// StageTimer times one run of a stage, from construction to finish() (or
+// destruction, which credits no bytes).
+//
+class StageTimer {
+ public:
+#ifdef HUF_STATS
+  StageTimer(Stage stage)
+      : stage(stage), running(true), start(chrono::steady_clock::now()) {}
+
+  ~StageTimer() { finish(0, 0); }
+
+  // ends the stage, crediting it with the bytes it read and wrote
+  void finish(uint64_t bytesIn, uint64_t bytesOut) {
+    if (!running) return;
+    running = false;
+    uint64_t nanos = chrono::duration_cast<chrono::nanoseconds>(
+                         chrono::steady_clock::now() - start).count();
+    _StatsCounters& c = _statsCounters();
+    c.calls[stage].fetch_add(1, memory_order_relaxed);
+    c.nanos[stage].fetch_add(nanos, memory_order_relaxed);
+    c.bytesIn[stage].fetch_add(bytesIn, memory_order_relaxed);
+    c.bytesOut[stage].fetch_add(bytesOut, memory_order_relaxed);
+  }
+
+ private:
+  Stage stage;
+  bool running;
+  chrono::steady_clock::time_point start;
+#else
+  StageTimer(Stage) {}
+  void finish(uint64_t, uint64_t) {}
+#endif
+};
+
+// symbols Huffman coded and the bits they took
+inline void statsRecordCodes(uint64_t symbols, uint64_t bits) {
+#ifdef HUF_STATS
+  _statsCounters().symbols.fetch_add(symbols, memory_order_relaxed);
+  _statsCounters().codeBits.fetch_add(bits, memory_order_relaxed);
+#endif
+}
+
+inline void statsRecordTreeDepth(uint64_t depth) {
+#ifdef HUF_STATS
+  atomic<uint64_t>& max = _statsCounters().maxTreeDepth;
+  uint64_t seen = max.load(memory_order_relaxed);
+  while (depth > seen && !max.compare_exchange_weak(seen, depth, memory_order_relaxed)) {
+  }
+#endif
+}
+
+// an output buffer's capacity before and after a stage wrote to it
+inline void statsRecordGrowth(size_t before, size_t after) {
+#ifdef HUF_STATS
+  if (after != before) _statsCounters().growths.fetch_add(1, memory_order_relaxed);
+#endif
+}
+
+//
+// *This function returns the counters as they stand, all zero when built
+// without HUF_STATS.
+//
+HuffmanStats statsSnapshot() {
+  _StatsCounters& c = _statsCounters();
+  HuffmanStats s;
+  for (int i = 0; i < NUM_STAGES; i++) {
+    s.stage[i].calls = c.calls[i].load(memory_order_relaxed);
+    s.stage[i].nanos = c.nanos[i].load(memory_order_relaxed);
+    s.stage[i].bytesIn = c.bytesIn[i].load(memory_order_relaxed);
+    s.stage[i].bytesOut = c.bytesOut[i].load(memory_order_relaxed);
+  }
+  s.symbols = c.symbols.load(memory_order_relaxed);
+  s.codeBits = c.codeBits.load(memory_order_relaxed);
+  s.maxTreeDepth = c.maxTreeDepth.load(memory_order_relaxed);
+  s.growths = c.growths.load(memory_order_relaxed);
+  return s;
+}
+
+void statsReset() {
+  _StatsCounters& c = _statsCounters();
+  for (int i = 0; i < NUM_STAGES; i++) {
+    c.calls[i] = 0;
+    c.nanos[i] = 0;
+    c.bytesIn[i] = 0;
+    c.bytesOut[i] = 0;
+  }
+  c.symbols = 0;
+  c.codeBits = 0;
+  c.maxTreeDepth = 0;
+  c.growths = 0;
+}
+
+//
+// *This function formats s as one JSON object:
+//   {"enabled": true, "stages": {"histogram": {"calls": 1, "seconds": ...,
+//   "bytes_in": ..., "bytes_out": ...}, ...}, "symbols": ..., ...}
+//
+string statsJson(const HuffmanStats& s) {
+  char buf[512];
+  string out = STATS_ENABLED ? "{\"enabled\": true, \"stages\": {"
+                             : "{\"enabled\": false, \"stages\": {";
+  for (int i = 0; i < NUM_STAGES; i++) {
+    const StageStats& st = s.stage[i];
+    snprintf(buf, sizeof(buf),
+             "%s\"%s\": {\"calls\": %llu, \"seconds\": %.9f, \"bytes_in\": %llu, "
+             "\"bytes_out\": %llu}",
+             i ? ", " : "", STAGE_NAMES[i], (unsigned long long)st.calls,
+             st.nanos / 1e9, (unsigned long long)st.bytesIn,
+             (unsigned long long)st.bytesOut);
+    out += buf;
+  }
+  snprintf(buf, sizeof(buf),
+           "}, \"symbols\": %llu, \"code_bits\": %llu, \"average_code_length\": %.4f, "
+           "\"max_tree_depth\": %llu, \"buffer_growths\": %llu}",
+           (unsigned long long)s.symbols, (unsigned long long)s.codeBits,
+           s.averageCodeLength(), (unsigned long long)s.maxTreeDepth,
+           (unsigned long long)s.growths);
+  return out + buf;
+}
+
+//
+// *This function formats s in the Prometheus text exposition format, every
+// metric prefixed "huf_" and the stage ones labelled by stage.
+//
+string statsPrometheus(const HuffmanStats& s) {
+  struct {
+    const char* name;
+    const char* type;
+    const char* help;
+  } stageMetrics[] = {
+      {"huf_stage_calls_total", "counter", "Runs of each coding stage."},
+      {"huf_stage_seconds_total", "counter", "Wall time spent in each stage."},
+      {"huf_stage_bytes_in_total", "counter", "Bytes each stage consumed."},
+      {"huf_stage_bytes_out_total", "counter", "Bytes each stage produced."},
+  };
+  char buf[512];
+  string out;
+  for (int m = 0; m < 4; m++) {
+    snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s %s\n", stageMetrics[m].name,
+             stageMetrics[m].help, stageMetrics[m].name, stageMetrics[m].type);
+    out += buf;
+    for (int i = 0; i < NUM_STAGES; i++) {
+      const StageStats& st = s.stage[i];
+      if (m == 1)
+        snprintf(buf, sizeof(buf), "%s{stage=\"%s\"} %.9f\n", stageMetrics[m].name,
+                 STAGE_NAMES[i], st.nanos / 1e9);
+      else
+        snprintf(buf, sizeof(buf), "%s{stage=\"%s\"} %llu\n", stageMetrics[m].name,
+                 STAGE_NAMES[i],
+                 (unsigned long long)(m == 0 ? st.calls : m == 2 ? st.bytesIn : st.bytesOut));
+      out += buf;
+    }
+  }
+  snprintf(buf, sizeof(buf),
+           "# TYPE huf_symbols_total counter\nhuf_symbols_total %llu\n"
+           "# TYPE huf_code_bits_total counter\nhuf_code_bits_total %llu\n"
+           "# TYPE huf_average_code_length gauge\nhuf_average_code_length %.4f\n"
+           "# TYPE huf_max_tree_depth gauge\nhuf_max_tree_depth %llu\n"
+           "# TYPE huf_buffer_growths_total counter\nhuf_buffer_growths_total %llu\n",
+           (unsigned long long)s.symbols, (unsigned long long)s.codeBits,
+           s.averageCodeLength(), (unsigned long long)s.maxTreeDepth,
+           (unsigned long long)s.growths);
+  return out + buf;
+}
@@ -0,0 +1,245 @@
+//
+// stream.h
+//
+// Block-at-a-time compression for inputs that are too big to hold in memory
+// or cannot be read twice, like pipes.  Each block is read once into a buffer,
+// counted, coded and encoded from that same buffer while a background thread
+// reads the next one.  The output is the blocks back to back; every block
+// type is self-delimiting, so decompressBuffer() just decodes them in turn.
+//
+// decompressStream() goes the other way, a block at a time, straight into a
+// descriptor through an FdWriter.
+//
+
+#include <cerrno>
+#include <cstdint>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "buffer.h"
+#include "fdwriter.h"
+#include "mappedfile.h"
+#pragma once
+
+// bytes per block; large enough that per-block headers are noise.  Not
+// called BLOCK_SIZE: <linux/fs.h>, pulled in by the io_uring header, defines
+// that as a macro for 1024.
+const size_t DEFAULT_BLOCK_SIZE = 1 << 20;
+
+//
+// Reads len bytes from fd, stopping early only at end of input.  Returns the
+// number of bytes read, or -1 on error.  A read cut short by a signal is
+// retried.
+//
+ssize_t _readFull(int fd, uint8_t* buf, size_t len) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = read(fd, buf + got, len - got);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -1;
+    if (n == 0) break;
+    got += n;
+  }
+  return got;
+}
+
+//
+// BlockReader hands out an input one block at a time while a background
+// thread reads ahead into a ring of reusable buffers.
+//
+class BlockReader {
+ public:
+  BlockReader(int fd, size_t blockSize, int nSlots = 2)
+      : fd(fd), slots(nSlots), next(0), held(-1), stopping(false) {
+    for (int i = 0; i < nSlots; i++) {
+      slots[i].data.resize(blockSize);
+      slots[i].state = EMPTY;
+    }
+    worker = thread(&BlockReader::run, this);
+  }
+
+  ~BlockReader() {
+    {
+      lock_guard<mutex> lock(m);
+      stopping = true;
+    }
+    changed.notify_all();
+    worker.join();
+  }
+
+  //
+  // read:
+  // Hands back the next block, which stays valid until the following call.
+  // A short block is the last one; an empty input yields one empty block.
+  // Returns false once the input is used up or a read fails (see failed()).
+  //
+  bool read(const uint8_t*& data, size_t& len) {
+    unique_lock<mutex> lock(m);
+    if (held >= 0) {
+      if (slots[held].last) return false;
+      slots[held].state = EMPTY;
+      changed.notify_all();
+    }
+    held = next;
+    next = (next + 1) % slots.size();
+    Slot& slot = slots[held];
+    changed.wait(lock, [&slot] { return slot.state == FULL; });
+    if (slot.error) return false;
+    data = slot.data.data();
+    len = slot.len;
+    return true;
+  }
+
+  bool failed() {
+    lock_guard<mutex> lock(m);
+    return held >= 0 && slots[held].error;
+  }
+
+ private:
+  enum State { EMPTY, FULL };
+  struct Slot {
+    vector<uint8_t> data;
+    size_t len;
+    bool last;
+    bool error;
+    State state;
+  };
+
+  int fd;
+  vector<Slot> slots;
+  size_t next;  // slot the consumer takes next
+  int held;     // slot the consumer is working on, or -1
+  bool stopping;
+  mutex m;
+  condition_variable changed;
+  thread worker;
+
+  void run() {
+    for (size_t i = 0;; i = (i + 1) % slots.size()) {
+      Slot& slot = slots[i];
+      {
+        unique_lock<mutex> lock(m);
+        changed.wait(lock, [&] { return stopping || slot.state == EMPTY; });
+        if (stopping) return;
+      }
+      ssize_t n = _readFull(fd, slot.data.data(), slot.data.size());
+      lock_guard<mutex> lock(m);
+      slot.error = (n < 0);
+      slot.len = (n < 0) ? 0 : n;
+      slot.last = slot.error || slot.len < slot.data.size();
+      slot.state = FULL;
+      changed.notify_all();
+      if (slot.last) return;
+    }
+  }
+
+  BlockReader(const BlockReader&) = delete;
+  BlockReader& operator=(const BlockReader&) = delete;
+};
+
+//
+// Appends the bit pattern of one block to bits, as compress() reports it: the
+// code bits of a Huffman block, or every bit of a stored or run block.
+//
+void _appendBlockBits(const uint8_t* block, size_t len,
+                      const HuffmanContext& ctx, string& bits) {
+  long long n = (long long)len * NUM_BITS_IN_BYTE;
+  if (len > 0 && (block[0] == '{' || block[0] == TAG_QUANTIZED)) n = ctx.codedBits();
+  const uint8_t* start = block + len - (size_t)((n + 7) / NUM_BITS_IN_BYTE);
+  for (long long i = 0; i < n; i++) {
+    int byte = start[i / NUM_BITS_IN_BYTE];
+    bits += (char)('0' + ((byte >> (i % NUM_BITS_IN_BYTE)) & 1));
+  }
+}
+
+//
+// *This function compresses everything readable from fdIn to fdOut in blocks
+// of blockSize bytes, reading each byte exactly once.  fdIn need not be
+// seekable.  If bits is not null the bit pattern of the output is appended
+// to it.  Returns false if a read or write fails.
+//
+bool compressStream(int fdIn, int fdOut, HuffmanContext& ctx,
+                    size_t blockSize = DEFAULT_BLOCK_SIZE, string* bits = nullptr) {
+  BlockReader reader(fdIn, blockSize);
+  vector<uint8_t>& packed = ctx.outputBuffer();
+  const uint8_t* data;
+  size_t len;
+  bool first = true;
+  while (reader.read(data, len)) {
+    // a short final read can come back empty; only an empty input needs it
+    if (len == 0 && !first) break;
+    first = false;
+    packed.clear();
+    encodeBlock(data, len, packed, ctx);
+    if (!_writeAll(fdOut, packed.data(), packed.size())) return false;
+    if (bits != nullptr) _appendBlockBits(packed.data(), packed.size(), ctx, *bits);
+  }
+  return !reader.failed();
+}
+
+//
+// *This function decompresses everything in fdIn to fdOut, which may be a
+// file, a pipe or a socket.  Blocks are decoded a chunk's worth at a time
+// into the FdWriter's buffers, never into one buffer for the whole output.
+// If fdIn is a regular file it is mapped rather than read, and its stored
+// blocks are copied to fdOut by the kernel.  Returns false if fdIn is not a
+// complete compressed stream, fails a checksum or fdOut stops taking output;
+// ctx.decodeError() says which of the first two it was.
+//
+bool decompressStream(int fdIn, int fdOut, HuffmanContext& ctx) {
+  MappedFile file;
+  const uint8_t* data;
+  size_t len;
+  bool mapped = file.map(fdIn);
+  if (mapped) {
+    data = file.data();
+    len = file.size();
+  } else {
+    vector<uint8_t>& in = ctx.inputBuffer();
+    in.clear();
+    uint8_t buf[1 << 16];
+    ssize_t n;
+    while ((n = read(fdIn, buf, sizeof(buf))) != 0) {
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) return false;
+      in.insert(in.end(), buf, buf + n);
+    }
+    data = in.data();
+    len = in.size();
+  }
+
+  FdWriter writer(fdOut);
+  ChecksumChecker checker;
+  ctx.reset();
+  if (len == 0) return ctx.fail(DECODE_TRUNCATED);
+  if (data[0] == TAG_DICTIONARY) {
+    return decompressWithDictionary(data, len, writer.buffer(), dictionaryRegistry(), ctx) &&
+           writer.finish();
+  }
+  size_t pos = 0;
+  while (pos < len) {
+    uint8_t tag = data[pos];
+    if (tag == TAG_CHECKSUM || tag == TAG_END) {
+      DecodeError e = checker.read(data, len, pos, writer.buffer());
+      if (e != DECODE_OK) return ctx.fail(e);
+    } else if (tag == TAG_STORED && mapped) {
+      size_t at = pos + 1;
+      uint64_t n;
+      if (!getVarint(data, len, at, n) || n > len - at) return ctx.fail(DECODE_TRUNCATED);
+      checker.add(data + at, n, writer.buffer());
+      if (!writer.copyFrom(fdIn, at, n)) return false;
+      pos = at + n;
+    } else {
+      if (!decodeBlock(data, len, pos, writer.buffer(), ctx)) return false;
+      if (writer.full()) {
+        checker.drop(writer.buffer());
+        if (!writer.flush()) return false;
+      }
+    }
+  }
+  checker.drop(writer.buffer());
+  return writer.finish();
+}
@@ -1,14 +1,1437 @@
 #include "hashmap.h"
 #include "util.h"
+#include "buffer.h"
+#include "batch.h"
+#include "archive.h"
+#include "probe.h"
+#include "snapshotmap.h"
+#include "serialize.h"
+#include "mappedfile.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <atomic>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <cstdlib>
+#include <new>
 using namespace std;
 
+static int failures = 0;
+
+// every heap allocation in the program goes through here so tests can check
+// that steady-state code does not allocate; atomic, since tests start threads
+static atomic<long long> allocations(0);
+
+// GCC sees the malloc and free through inlining and takes this matched pair
+// for a mismatch
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(size_t n) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    void* p = malloc(n != 0 ? n : 1);
+    if (p == nullptr) throw bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+#pragma GCC diagnostic pop
+
+static void check(bool ok, const string& what) {
+    if (!ok) {
+        cout << "FAILED: " << what << endl;
+        failures++;
+    }
+}
+
+static vector<uint8_t> readAll(const string& filename) {
+    ifstream in(filename, ios::binary);
+    return vector<uint8_t>(istreambuf_iterator<char>(in),
+                           istreambuf_iterator<char>());
+}
+
+//
+// compressBuffer should write exactly what compress() writes, and each
+// decompressor should accept the other's input.
+//
+static void testBufferMatchesFiles(const string& filename) {
+    vector<uint8_t> raw = readAll(filename);
+    vector<uint8_t> packed, unpacked;
+    compress(filename);
+    compressBuffer(raw.data(), raw.size(), packed);
+    check(packed == readAll(filename + ".huf"), "compressBuffer == compress " + filename);
+    check(decompressBuffer(packed.data(), packed.size(), unpacked), "decompressBuffer " + filename);
+    check(unpacked == raw, "buffer round trip " + filename);
+}
+
+static void testBufferRoundTrip() {
+    vector<uint8_t> raw, packed, unpacked;
+    compressBuffer(raw.data(), raw.size(), packed);
+    check(decompressBuffer(packed.data(), packed.size(), unpacked) && unpacked.empty(),
+          "empty buffer round trip");
+
+    srand(1);
+    for (int n = 1; n < 5000; n = n * 3 + 1) {
+        raw.resize(n);
+        for (int i = 0; i < n; i++) raw[i] = (uint8_t)(rand() % (1 + n % 256));
+        compressBuffer(raw.data(), raw.size(), packed);
+        check(decompressBuffer(packed.data(), packed.size(), unpacked) && unpacked == raw,
+              "random buffer round trip " + to_string(n));
+        check(!decompressBuffer(packed.data(), packed.size() / 2, unpacked),
+              "truncated buffer rejected " + to_string(n));
+    }
+}
+
+//
+// Once a context and the caller's buffers have grown to fit, coding more
+// messages through them must not allocate.
+//
+static void testContextDoesNotAllocate() {
+    HuffmanContext ctx;
+    vector<uint8_t> msg(300), packed, unpacked;
+    packed.reserve(4096);
+    unpacked.reserve(4096);
+    for (size_t i = 0; i < msg.size(); i++) msg[i] = (uint8_t)("hello, world "[i % 13] + i % 3);
+    compressBuffer(msg.data(), msg.size(), packed, ctx);
+    decompressBuffer(packed.data(), packed.size(), unpacked, ctx);
+
+    long long before = allocations;
+    bool ok = true;
+    for (int round = 0; round < 1000; round++) {
+        size_t n = 1 + round % msg.size();
+        msg[round % msg.size()] = (uint8_t)round;
+        ctx.reset();
+        compressBuffer(msg.data(), n, packed, ctx);
+        ok = ok && decompressBuffer(packed.data(), packed.size(), unpacked, ctx)
+                && unpacked.size() == n && equal(unpacked.begin(), unpacked.end(), msg.begin());
+    }
+    long long made = allocations - before;
+    check(ok, "context round trips");
+    check(made == 0, "context allocated " + to_string(made) + " times in steady state");
+}
+
+//
+// A message coded with a trained dictionary carries no table, decodes through
+// the registry, and survives a save/load of the dictionary.
+//
+static void testDictionary() {
+    hashmap freq;
+    vector<string> samples = {"test.txt", "medium.txt", "example.txt", "no-such-file.txt"};
+    trainDictionary(samples, freq);
+    HuffmanDictionary* dict = new HuffmanDictionary(7, freq);
+    check(dict->complete(), "trained dictionary covers every byte");
+    check(dict->save("test.dict"), "dictionary saved");
+    check(dictionaryRegistry().add(dict), "dictionary registered");
+
+    string text = "asdf jkl ab cab 1234 \xff";
+    vector<uint8_t> msg(text.begin(), text.end()), packed, plain, unpacked;
+    compressWithDictionary(msg.data(), msg.size(), *dict, packed);
+    compressBuffer(msg.data(), msg.size(), plain);
+    check(packed.size() < plain.size(), "dictionary message is smaller than a self-contained one");
+    check(decompressBuffer(packed.data(), packed.size(), unpacked) && unpacked == msg,
+          "dictionary round trip");
+
+    HuffmanDictionary loaded(0);
+    check(loaded.load("test.dict") && loaded.id() == 7, "dictionary loaded");
+    vector<uint8_t> repacked;
+    compressWithDictionary(msg.data(), msg.size(), loaded, repacked);
+    check(repacked == packed, "loaded dictionary codes like the original");
+
+    DictionaryRegistry fresh;
+    fresh.setDirectory(".");
+    rename("test.dict", "7.dict");
+    check(decompressWithDictionary(packed.data(), packed.size(), unpacked, fresh) && unpacked == msg,
+          "registry loads dictionaries by id on demand");
+    packed[1] = 9;
+    rename("7.dict", "9.dict");
+    check(!decompressWithDictionary(packed.data(), packed.size(), unpacked, fresh),
+          "dictionary file with the wrong id rejected");
+    remove("9.dict");
+}
+
+//
+// Input Huffman coding would grow is stored, a single repeated byte becomes a
+// run, and both come back through the buffer and file decompressors.
+//
+static void testStoredAndRunBlocks() {
+    vector<uint8_t> raw(4000), packed, unpacked;
+    srand(2);
+    for (size_t i = 0; i < raw.size(); i++) raw[i] = (uint8_t)rand();
+    compressBuffer(raw.data(), raw.size(), packed);
+    check(packed[0] == TAG_STORED && packed.size() <= raw.size() + 3, "random bytes are stored");
+    check(decompressBuffer(packed.data(), packed.size(), unpacked) && unpacked == raw,
+          "stored round trip");
+
+    ofstream("stored.bin", ios::binary).write((const char*)raw.data(), raw.size());
+    compress("stored.bin");
+    check(decompressFile("stored.bin.huf", "stored_unc.bin") && readAll("stored_unc.bin") == raw,
+          "stored file copied back by decompressFile");
+    remove("stored.bin");
+    remove("stored.bin.huf");
+    remove("stored_unc.bin");
+
+    raw.assign(100000, 'z');
+    compressBuffer(raw.data(), raw.size(), packed);
+    check(packed[0] == TAG_RLE && packed.size() == 5, "repeated byte becomes a run");
+    check(decompressBuffer(packed.data(), packed.size(), unpacked) && unpacked == raw,
+          "run round trip");
+
+    HuffmanContext ctx;
+    vector<uint8_t> header;
+    string text = "some text with a few \x80\xff high bytes";
+    ctx.countSymbols((const uint8_t*)text.data(), text.size());
+    ctx.writeHeader(header);
+    check(ctx.headerSize() == header.size(), "headerSize matches writeHeader");
+}
+
+//
+// compressStream reads a pipe once, in blocks, and writes blocks that decode
+// back to back.
+//
+static void testStreamFromPipe() {
+    vector<uint8_t> raw(50000);
+    srand(3);
+    for (size_t i = 0; i < raw.size(); i++)
+        raw[i] = (i / 7000 % 2) ? (uint8_t)rand() : (uint8_t)("abcabcd"[rand() % 7]);
+    raw.insert(raw.end(), 9000, 'q');
+
+    int fds[2];
+    check(pipe(fds) == 0, "pipe");
+    thread writer([&] {
+        _writeAll(fds[1], raw.data(), raw.size());
+        close(fds[1]);
+    });
+    int fdOut = open("stream.huf", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    HuffmanContext ctx;
+    check(compressStream(fds[0], fdOut, ctx, 4096), "compressStream from a pipe");
+    writer.join();
+    close(fds[0]);
+    close(fdOut);
+
+    vector<uint8_t> packed = readAll("stream.huf"), unpacked;
+    check(packed.size() < raw.size(), "stream compressed");
+    check(decompressBuffer(packed.data(), packed.size(), unpacked) && unpacked == raw,
+          "multi-block round trip");
+    remove("stream.huf");
+}
+
+//
+// The pipeline writes exactly what compressStream writes, whichever I/O
+// engine it runs on, and copes with a pipe on the input side.
+//
+static void testPipeline() {
+    vector<uint8_t> raw(300000);
+    srand(4);
+    for (size_t i = 0; i < raw.size(); i++)
+        raw[i] = (i / 50000 % 3 == 1) ? (uint8_t)rand() : (uint8_t)("the quick fox "[rand() % 14]);
+    ofstream("pipe.bin", ios::binary).write((const char*)raw.data(), raw.size());
+
+    PipelineOptions opt;
+    opt.blockSize = 16384;
+    opt.coders = 3;
+    int fdIn = open("pipe.bin", O_RDONLY);
+    int fdOut = open("pipe.ref", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    HuffmanContext ctx;
+    compressStream(fdIn, fdOut, ctx, opt.blockSize);
+    close(fdIn);
+    close(fdOut);
+    vector<uint8_t> expected = readAll("pipe.ref");
+
+    IoBackend backends[] = {IO_URING, IO_THREADS};
+    for (IoBackend backend : backends) {
+        opt.backend = backend;
+        bool ok = compressFile("pipe.bin", "pipe.huf", opt);
+        if (!ok && backend == IO_URING) continue;  // kernel without io_uring
+        check(ok && readAll("pipe.huf") == expected,
+              "pipeline output matches compressStream, backend " + to_string(backend));
+    }
+
+    int fds[2];
+    check(pipe(fds) == 0, "pipe");
+    thread writer([&] {
+        _writeAll(fds[1], raw.data(), raw.size());
+        close(fds[1]);
+    });
+    fdOut = open("pipe.huf", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    opt.backend = IO_AUTO;
+    check(compressPipeline(fds[0], fdOut, opt), "pipeline from a pipe");
+    writer.join();
+    close(fds[0]);
+    close(fdOut);
+    check(readAll("pipe.huf") == expected, "pipeline from a pipe matches compressStream");
+
+    ofstream("pipe.bin", ios::binary);
+    check(compressFile("pipe.bin", "pipe.huf", opt), "pipeline on an empty file");
+    vector<uint8_t> packed = readAll("pipe.huf"), unpacked;
+    check(decompressBuffer(packed.data(), packed.size(), unpacked) && unpacked.empty(),
+          "empty file through the pipeline");
+    remove("pipe.bin");
+    remove("pipe.ref");
+    remove("pipe.huf");
+}
+
+//
+// Both CRC32C kernels give the standard answers at every alignment, joined
+// checksums match one over the whole range, and checked files decode only
+// while every block and the end record are intact.
+//
+static void testChecksums() {
+    const char* digits = "123456789";
+    check(crc32c((const uint8_t*)digits, 9, 0, CRC_SOFTWARE) == 0xe3069283 &&
+          crc32c((const uint8_t*)digits, 9, 0, CRC_SSE42) == 0xe3069283,
+          "crc32c check value");
+    vector<uint8_t> raw(100000);
+    srand(9);
+    for (size_t i = 0; i < raw.size(); i++) raw[i] = (uint8_t)rand();
+    for (size_t at = 0; at < 9; at++) {
+        size_t n = raw.size() - 2 * at, split = 1000 + at;
+        uint32_t whole = crc32c(raw.data() + at, n, 0, CRC_SOFTWARE);
+        check(crc32c(raw.data() + at, n, 0, CRC_SSE42) == whole,
+              "crc32c kernels agree at " + to_string(at));
+        uint32_t first = crc32c(raw.data() + at, split);
+        uint32_t second = crc32c(raw.data() + at + split, n - split);
+        check(crc32c(raw.data() + at + split, n - split, first) == whole &&
+              crc32cCombine(first, second, n - split) == whole,
+              "crc32c continued and combined at " + to_string(at));
+    }
+
+    // random bytes go into stored blocks, so a flipped byte still decodes
+    ofstream("check.bin", ios::binary).write((const char*)raw.data(), raw.size());
+    PipelineOptions opt;
+    opt.blockSize = 16384;
+    opt.coders = 2;
+    opt.checksums = true;
+    check(compressFile("check.bin", "check.huf", opt), "compress with checksums");
+    vector<uint8_t> packed = readAll("check.huf"), unpacked;
+    check(packed[packed.size() - 5 - varintSize(raw.size())] == TAG_END,
+          "checked file ends in TAG_END");
+    check(decompressBuffer(packed.data(), packed.size(), unpacked) && unpacked == raw,
+          "checked file round trip");
+    vector<uint8_t> bad = packed;
+    bad[50000] ^= 0x10;
+    check(!decompressBuffer(bad.data(), bad.size(), unpacked), "flipped byte fails its checksum");
+    bad = packed;
+    bad.back() ^= 0x10;
+    check(!decompressBuffer(bad.data(), bad.size(), unpacked), "bad file checksum rejected");
+    check(!decompressBuffer(packed.data(), packed.size() - 1, unpacked), "cut end record rejected");
+    bad = packed;
+    bad.push_back(TAG_STORED);
+    bad.push_back(0);
+    check(!decompressBuffer(bad.data(), bad.size(), unpacked), "blocks after the end rejected");
+    remove("check.bin");
+    remove("check.huf");
+}
+
+//
+// Malformed input is rejected before anything is decoded, with a reason, and
+// the text reader for hashmaps stops at the end of its input.
+//
+static DecodeError decodeErrorOf(const string& s) {
+    HuffmanContext ctx;
+    vector<uint8_t> out;
+    check(!decompressBuffer((const uint8_t*)s.data(), s.size(), out, ctx), "rejects " + s);
+    return ctx.decodeError();
+}
+
+static void testMalformedInput() {
+    check(decodeErrorOf("{97:1") == DECODE_TRUNCATED, "cut header");
+    check(decodeErrorOf("{97:1, 256:1}") == DECODE_TRUNCATED, "header without bits");
+    check(decodeErrorOf("{97:x}") == DECODE_BAD_HEADER, "header with a non-number");
+    check(decodeErrorOf("{97:1, 97:1, 256:1}\x05") == DECODE_BAD_HEADER, "duplicate key");
+    check(decodeErrorOf("{97:1, 98:1}\x05") == DECODE_BAD_CODES, "header without PSEUDO_EOF");
+    check(decodeErrorOf("{97:281474976710656, 98:1, 256:1}\x05") == DECODE_BAD_CODES,
+          "counts that overflow");
+    check(decodeErrorOf("\x90") == DECODE_BAD_HEADER, "unknown tag");
+    check(decodeErrorOf(string("\x82z\xff\xff\xff\xff\x0f", 7)) == DECODE_BAD_HEADER,
+          "run longer than any block");
+
+    // dictionary messages: no id, an unknown id, cut short, and trailing bytes
+    hashmap freq;
+    trainDictionary(vector<string>(1, "test.txt"), freq);
+    HuffmanDictionary* dict = new HuffmanDictionary(12, freq);
+    check(dict->complete() && dictionaryRegistry().add(dict), "malformed test dictionary");
+    const uint8_t msg[] = "dictionary";
+    vector<uint8_t> packed;
+    compressWithDictionary(msg, sizeof(msg) - 1, *dict, packed);
+    string message(packed.begin(), packed.end());
+    check(decodeErrorOf("\x80") == DECODE_TRUNCATED, "dictionary message without an id");
+    check(decodeErrorOf("\x80\x63\x05") == DECODE_BAD_HEADER, "unknown dictionary");
+    check(decodeErrorOf(message.substr(0, message.size() - 1)) == DECODE_TRUNCATED,
+          "cut dictionary message");
+    check(decodeErrorOf(message + '\0') == DECODE_BAD_DATA, "bytes after a dictionary message");
+
+    // a block whose bits decode to fewer bytes than its header counts
+    HuffmanContext ctx;
+    const uint8_t raw[] = {'a', 'a', 'b'};
+    vector<uint8_t> block, out;
+    ctx.countSymbols(raw, 3);
+    ctx.buildTree();
+    ctx.buildCodes();
+    ctx.writeHeader(block);
+    ctx.encode(raw, 3, block);
+    string text(block.begin(), block.end());
+    size_t at = text.find("97:2");
+    check(at != string::npos, "header holds 97:2");
+    text[at + 3] = '3';
+    check(decodeErrorOf(text) == DECODE_BAD_DATA, "bits that disagree with the counts");
+    check(decompressBuffer(block.data(), block.size(), out, ctx) && ctx.decodeError() == DECODE_OK,
+          "the unchanged block decodes");
+
+    hashmap map;
+    istringstream good("{1:2, 3:4}");
+    check((bool)(good >> map) && map.keys().size() == 2 && map.get(3) == 4, "hashmap text read");
+    const char* bad[] = {"", "{", "{1:2, 3", "{1:2 3:4}", "{1:x}", "{99999999999:1}"};
+    for (const char* s : bad) {
+        hashmap m;
+        istringstream in(s);
+        check(!(in >> m), string("hashmap text rejects ") + s);
+    }
+}
+
+//
+// The per-stage counters add up what one round trip did when stats are built
+// in, record nothing when they are not, and print as JSON and Prometheus text.
+//
+static void testStats() {
+    statsReset();
+    vector<uint8_t> raw, packed, out;
+    for (int i = 0; i < 6000; i++) raw.push_back((uint8_t)("abracadabra"[i % 11]));
+    compressBuffer(raw.data(), raw.size(), packed);
+    check(decompressBuffer(packed.data(), packed.size(), out) && out == raw, "stats round trip");
+    HuffmanStats s = statsSnapshot();
+    if (STATS_ENABLED) {
+        check(s.stage[STAGE_HISTOGRAM].calls == 1 && s.stage[STAGE_HISTOGRAM].bytesIn == raw.size(),
+              "stats count the histogram");
+        check(s.stage[STAGE_ENCODE].calls == 1 && s.stage[STAGE_DECODE].bytesOut == raw.size(),
+              "stats count bytes coded");
+        check(s.symbols >= raw.size() && s.averageCodeLength() > 1 && s.averageCodeLength() < 8,
+              "stats average code length");
+        check(s.maxTreeDepth >= 2 && s.maxTreeDepth <= 5, "stats tree depth");
+    } else {
+        check(s.stage[STAGE_ENCODE].calls == 0 && s.symbols == 0, "stats off record nothing");
+    }
+
+    string json = statsJson(s);
+    check(json.front() == '{' && json.back() == '}', "stats json is one object");
+    check(json.find("\"histogram\": {\"calls\": ") != string::npos &&
+              json.find("\"average_code_length\": ") != string::npos,
+          "stats json fields");
+    string text = statsPrometheus(s);
+    check(text.find("# TYPE huf_stage_calls_total counter\n") != string::npos &&
+              text.find("huf_stage_bytes_in_total{stage=\"checksum\"} ") != string::npos &&
+              text.back() == '\n',
+          "stats prometheus text");
+}
+
+//
+// The sampled probe predicts the ratio of text to within a few percent,
+// counts small inputs whole, and tells noise and runs from text; a file gets
+// the same estimate as its bytes.
+//
+static void testProbe() {
+    vector<uint8_t> text, noise(200000), packed;
+    const char* words = "the quick brown fox jumps over the lazy dog; ";
+    for (int i = 0; i < 300000; i++) text.push_back((uint8_t)words[(i * 7 + i / 45) % 45]);
+    for (size_t i = 0; i < noise.size(); i++) noise[i] = (uint8_t)rand();
+
+    CompressionEstimate e = estimateCompression(text.data(), text.size());
+    compressBuffer(text.data(), text.size(), packed);
+    double actual = (double)packed.size() / text.size();
+    check(e.sampled == PROBE_BLOCK * PROBE_BLOCKS && e.length == text.size(), "probe samples");
+    check(e.mode == PROBE_HUFFMAN && e.worthCompressing(), "probe text is worth compressing");
+    check(e.entropy <= e.codeLength && e.codeLength < e.entropy + 1, "probe code length bound");
+    check(e.predictedRatio > actual - 0.03 && e.predictedRatio < actual + 0.03, "probe predicts text");
+
+    e = estimateCompression(text.data(), 1000);
+    compressBuffer(text.data(), 1000, packed);
+    check(e.sampled == 1000 && fabs(e.predictedRatio * 1000 - packed.size()) < 10,
+          "probe counts small inputs whole");
+
+    e = estimateCompression(noise.data(), noise.size());
+    check(e.mode == PROBE_STORED && !e.worthCompressing() && e.entropy > 7.9, "probe noise");
+    vector<uint8_t> run(50000, 'z');
+    e = estimateCompression(run.data(), run.size());
+    check(e.mode == PROBE_RUN && e.predictedRatio < 0.001 && e.entropy == 0, "probe run");
+    e = estimateCompression(run.data(), 0);
+    check(e.sampled == 0 && !e.worthCompressing(), "probe empty input");
+
+    const char* name = "_probe_test.txt";
+    ofstream(name, ios::binary).write((const char*)text.data(), text.size());
+    CompressionEstimate f;
+    e = estimateCompression(text.data(), text.size());
+    check(estimateFile(name, f) && f.sampled == e.sampled && f.predictedRatio == e.predictedRatio,
+          "probe file matches buffer");
+    remove(name);
+    check(!estimateFile(name, f), "probe missing file");
+}
+
+//
+// A batch codes every file in a directory, splitting the large ones across
+// the pool, into exactly what compressStream() writes, and decompresses them
+// back.
+//
+static void testBatch() {
+    mkdir("batch.dir", 0755);
+    vector<string> files;
+    vector<vector<uint8_t> > contents;
+    srand(5);
+    for (int f = 0; f < 8; f++) {
+        size_t size = (f == 0) ? 100000 : (f == 1) ? 0 : 500 + rand() % 3000;
+        vector<uint8_t> raw(size);
+        for (size_t i = 0; i < size; i++)
+            raw[i] = (f == 2) ? 'z' : (uint8_t)("abcabcd \n"[rand() % 9]);
+        files.push_back("batch.dir/f" + to_string(f));
+        contents.push_back(raw);
+        ofstream(files.back(), ios::binary).write((const char*)raw.data(), raw.size());
+    }
+
+    BatchOptions opt;
+    opt.threads = 3;
+    opt.blockSize = 16384;
+    vector<FileStats> stats = runBatch(listDirectory("batch.dir", false), opt);
+    check(stats.size() == files.size(), "batch saw every file");
+    for (size_t i = 0; i < files.size(); i++) {
+        int fdIn = open(files[i].c_str(), O_RDONLY);
+        int fdOut = open("batch.ref", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        HuffmanContext ctx;
+        compressStream(fdIn, fdOut, ctx, opt.blockSize);
+        close(fdIn);
+        close(fdOut);
+        check(readAll(files[i] + ".huf") == readAll("batch.ref"),
+              "batch output matches compressStream for " + files[i]);
+    }
+    for (size_t i = 0; i < stats.size(); i++)
+        check(stats[i].ok && stats[i].bytesOut > 0, "batch stats for " + stats[i].name);
+
+    for (size_t i = 0; i < files.size(); i++) remove(files[i].c_str());
+    opt.decompress = true;
+    stats = runBatch(listDirectory("batch.dir", true), opt);
+    check(stats.size() == files.size(), "batch decompress saw every file");
+    for (size_t i = 0; i < files.size(); i++) {
+        check(readAll(files[i]) == contents[i], "batch round trip for " + files[i]);
+        remove(files[i].c_str());
+        remove((files[i] + ".huf").c_str());
+    }
+    check(!runBatch(vector<string>(1, "batch.dir/missing.huf"), opt)[0].ok,
+          "batch reports a missing file");
+    remove("batch.ref");
+    rmdir("batch.dir");
+}
+
+//
+// An archive holds entries with and without a shared table, extracts any
+// entry or block alone, detects corruption, and keeps entry names inside
+// the directory it is extracted in.
+//
+static void testArchive() {
+    vector<vector<uint8_t> > contents;
+    srand(6);
+    for (int f = 0; f < 6; f++) {
+        size_t size = (f == 0) ? 70000 : (f == 1) ? 0 : 200 + rand() % 2000;
+        vector<uint8_t> raw(size);
+        for (size_t i = 0; i < size; i++)
+            raw[i] = (f == 0 && i > 40000) ? (uint8_t)rand() : (uint8_t)("shared words "[rand() % 13]);
+        contents.push_back(raw);
+    }
+    hashmap freq;
+    ofstream("archive.train").write((const char*)contents[2].data(), contents[2].size());
+    trainDictionary(vector<string>(1, "archive.train"), freq);
+
+    ArchiveWriter writer(16384);
+    uint32_t table = writer.addTable(freq);
+    check(table == 1, "archive table id");
+    check(writer.open("test.hufa"), "archive open for writing");
+    for (size_t f = 0; f < contents.size(); f++) {
+        check(writer.add("entry" + to_string(f), contents[f].data(), contents[f].size(),
+                         f >= 2 ? table : 0),
+              "archive add entry" + to_string(f));
+    }
+    check(!writer.add("entry0", contents[0].data(), 1), "archive rejects a duplicate name");
+    check(!writer.add("bad", contents[0].data(), 1, 7), "archive rejects an unknown table");
+    check(writer.close(), "archive close");
+
+    ArchiveReader reader;
+    check(reader.open("test.hufa") && reader.size() == contents.size(), "archive index");
+    for (size_t f = 0; f < contents.size(); f++) {
+        vector<uint8_t> raw;
+        int i = reader.find("entry" + to_string(f));
+        check(i == (int)f && reader.extract(i, raw) && raw == contents[f],
+              "archive extract entry" + to_string(f));
+    }
+    check(reader.entry(0).blockEnd.size() == 5, "archive large entry is split into blocks");
+    check(reader.entry(3).table == table, "archive entry remembers its table");
+    vector<uint8_t> part;
+    check(reader.extractBlock(0, 2, part) &&
+          part == vector<uint8_t>(contents[0].begin() + 32768, contents[0].begin() + 49152),
+          "archive extract one block");
+    check(reader.find("missing") == -1, "archive find a missing name");
+    check(!reader.extractBlock(0, 5, part) && !reader.extractBlock(6, 0, part),
+          "archive rejects a block out of range");
+
+    // a flipped byte in an entry's data must fail its checksum or its decode
+    vector<uint8_t> bytes = readAll("test.hufa");
+    bytes[reader.entry(3).offset + 3] ^= 0x40;
+    _writeFile("test.hufa", bytes);
+    vector<uint8_t> raw;
+    check(reader.open("test.hufa") && !reader.extract(3, raw), "archive detects corruption");
+    bytes.resize(bytes.size() - 1);
+    _writeFile("test.hufa", bytes);
+    check(!reader.open("test.hufa"), "archive rejects a truncated file");
+
+    check(archiveName("/var/log/x") == "var/log/x" && archiveName("../a/./b//c") == "a/b/c" &&
+          archiveName("a/../../b") == "b", "archive names are relative");
+    ArchiveWriter hostile;
+    check(hostile.open("test.hufa") && !hostile.add("../escape", contents[2].data(), 10) &&
+          !hostile.add("/escape", contents[2].data(), 10),
+          "archive rejects a name leaving the directory");
+    check(hostile.add("xx/escape", contents[2].data(), 10) &&
+          hostile.add("Xescape", contents[2].data(), 10) && hostile.close(),
+          "archive with names to rewrite");
+    // rewrite the names in the index into ones a hostile archive would hold
+    bytes = readAll("test.hufa");
+    string text(bytes.begin(), bytes.end());
+    memcpy(&bytes[text.rfind("xx/escape")], "..", 2);
+    _writeFile("test.hufa", bytes);
+    check(!reader.open("test.hufa"), "archive rejects an entry name with ..");
+    memcpy(&bytes[text.rfind("xx/escape")], "xx", 2);
+    bytes[text.rfind("Xescape")] = '/';
+    _writeFile("test.hufa", bytes);
+    check(!reader.open("test.hufa"), "archive rejects an absolute entry name");
+    bytes[text.rfind("Xescape")] = 'X';
+    _writeFile("test.hufa", bytes);
+    check(reader.open("test.hufa") && reader.extractFile(reader.find("xx/escape")) &&
+          readAll("xx/escape") == vector<uint8_t>(contents[2].begin(), contents[2].begin() + 10),
+          "archive extracts into a new directory");
+    check(!reader.extractFile(reader.find("xx/escape")), "archive extract never overwrites");
+    check(readAll("../escape").empty() && readAll("/escape").empty(),
+          "archive extract stays in the directory");
+    remove("xx/escape");
+    rmdir("xx");
+    remove("archive.train");
+    remove("test.hufa");
+}
+
+// the codes for data[0..len) and PSEUDO_EOF, written one bit at a time
+static vector<uint8_t> packOneBitAtATime(const vector<uint8_t>& data, size_t len,
+                                         const HuffmanContext& ctx) {
+    vector<uint8_t> out;
+    long long nBits = 0;
+    for (size_t i = 0; i <= len; i++) {
+        int sym = (i < len) ? data[i] : PSEUDO_EOF;
+        for (int b = 0; b < ctx.codeLength(sym); b++, nBits++) {
+            if (nBits % 8 == 0) out.push_back(0);
+            out.back() |= ((ctx.codeOf(sym) >> b) & 1) << (nBits % 8);
+        }
+    }
+    return out;
+}
+
+//
+// mymap iterates in key order both ways, and its bounds and range scans
+// agree with std::map.
+//
+static void testMymapIteration() {
+    mymap<int, int> m;
+    map<int, int> ref;
+    check(m.begin() == m.end() && m.lower_bound(3) == m.end() && m.toVector().empty(),
+          "empty mymap");
+    srand(11);
+    for (int i = 0; i < 3000; i++) {
+        int k = rand() % 10000;
+        m.put(k, i);
+        ref[k] = i;
+    }
+    vector<pair<int, int> > want(ref.begin(), ref.end());
+    check(m.toVector() == want, "mymap toVector in order");
+
+    vector<int> keys, back;
+    for (int k : m) keys.push_back(k);
+    mymap<int, int>::iterator it = m.end();
+    while (it != m.begin()) back.push_back(*--it);
+    reverse(back.begin(), back.end());
+    check(keys.size() == ref.size() && keys == back, "mymap iterates both ways");
+
+    bool ok = true;
+    for (int k = -1; k <= 10001 && ok; k += 7) {
+        mymap<int, int>::iterator lo = m.lower_bound(k), hi = m.upper_bound(k);
+        map<int, int>::iterator rlo = ref.lower_bound(k), rhi = ref.upper_bound(k);
+        ok = (lo == m.end()) == (rlo == ref.end()) && (hi == m.end()) == (rhi == ref.end()) &&
+             (lo == m.end() || (lo.key() == rlo->first && lo.value() == rlo->second)) &&
+             (hi == m.end() || *hi == rhi->first);
+    }
+    check(ok, "mymap lower_bound and upper_bound");
+
+    vector<pair<int, int> > inRange = m.range(2500, 2600);
+    check(inRange == vector<pair<int, int> >(ref.lower_bound(2500), ref.lower_bound(2600)),
+          "mymap range");
+    long visited = 0;
+    m.forRange(10000, 20000, [&visited](int, int) { visited++; });
+    check(visited == 0 && m.range(5, 5).empty(), "mymap empty range");
+}
+
+//
+// Readers hammer a SnapshotMap while a writer publishes version after
+// version.  Version v maps k to 2k for k < v and -1 to v, so a snapshot
+// that mixed two versions would disagree with itself.
+//
+static void testSnapshotMap() {
+    SnapshotMap<int, int> m;
+    m.put(-1, 0);
+    const int VERSIONS = 1500;
+    atomic<bool> done(false), torn(false);
+    atomic<long> reads(0);
+    vector<thread> readers;
+    for (int t = 0; t < 4; t++) {
+        readers.push_back(thread([&m, &done, &torn, &reads] {
+            while (!done.load()) {
+                SnapshotMap<int, int>::Snapshot s = m.snapshot();
+                int v = s.get(-1);
+                if (s.Size() != v + 1 || (v > 0 && s.get(v - 1) != 2 * (v - 1)) || s.contains(v))
+                    torn = true;
+                reads++;
+            }
+        }));
+    }
+    for (int v = 1; v <= VERSIONS; v++) {
+        m.update([v](mymap<int, int>& next) {
+            next.put(v - 1, 2 * (v - 1));
+            next.put(-1, v);
+        });
+    }
+    done = true;
+    for (size_t t = 0; t < readers.size(); t++) readers[t].join();
+    check(!torn && reads > 0, "snapshots are consistent under writes");
+    check(m.Size() == VERSIONS + 1 && m.get(VERSIONS - 1) == 2 * (VERSIONS - 1), "snapshot map contents");
+
+    // with nobody reading, the next write frees every old version
+    check(!m.update([](mymap<int, int>&) { return false; }), "snapshot update can decline");
+    check(m.putIfAbsent(VERSIONS, 0) && !m.putIfAbsent(VERSIONS, 1) && m.retiredCount() == 0,
+          "snapshot map reclaims old versions");
+    SnapshotMap<int, int>::Snapshot pinned = m.snapshot();
+    m.put(0, 7);
+    check(pinned.get(0) == 0 && m.get(0) == 7 && m.retiredCount() == 1, "snapshot pins its version");
+}
+
+//
+// Counting on several threads gives the serial histogram, and
+// buildFrequencyMap() prints the same map for a file, a FIFO and a /proc
+// file as reading them a byte at a time.
+//
+static void testParallelHistogram() {
+    // skewed bytes with rare ones near the end, so ranges see different sets
+    vector<uint8_t> data(300000);
+    srand(46);
+    for (size_t i = 0; i < data.size(); i++) data[i] = (uint8_t)(rand() % 7 == 0 ? rand() : 'a' + rand() % 4);
+    data[data.size() - 3] = 0xFF;
+    ByteHistogram serial, parallel;
+    serial.clear();
+    serial.add(data.data(), data.size());
+    bool same = true;
+    for (int threads = 1; threads <= 8; threads++) {
+        parallelHistogram(data.data(), data.size(), parallel, threads, 1000);
+        same = same && memcmp(parallel.counts, serial.counts, sizeof(serial.counts)) == 0 &&
+               parallel.nOrder == serial.nOrder &&
+               equal(serial.order, serial.order + serial.nOrder, parallel.order);
+    }
+    check(same, "parallel histogram matches serial counting");
+    check(!numaNodes().empty() && !numaNodes()[0].empty(), "numa topology lists cpus");
+
+    // buildFrequencyMap() prints the same map the byte-at-a-time loop did
+    {
+        ofstream out("histogram.bin", ios::binary);
+        out.write((const char*)data.data(), data.size());
+    }
+    hashmap fast, slow;
+    buildFrequencyMap("histogram.bin", true, fast);
+    ifstream in("histogram.bin");
+    char ch;
+    while (in.get(ch)) slow.put(ch, slow.containsKey(ch) ? slow.get(ch) + 1 : 1);
+    slow.put(256, 1);
+    ostringstream a, b;
+    a << fast;
+    b << slow;
+    check(a.str() == b.str(), "frequency map built in parallel");
+    hashmap missing;
+    buildFrequencyMap("no-such-file", true, missing);
+    check(missing.keys().size() == 1 && missing.get(256) == 1, "missing file counts only eof");
+
+    // a FIFO cannot be mapped, so it is read instead
+    remove("histogram.fifo");
+    check(mkfifo("histogram.fifo", 0644) == 0, "make a fifo");
+    thread feeder([] {
+        ifstream in("histogram.bin", ios::binary);
+        ofstream("histogram.fifo", ios::binary) << in.rdbuf();
+    });
+    hashmap piped;
+    buildFrequencyMap("histogram.fifo", true, piped);
+    feeder.join();
+    ostringstream c;
+    c << piped;
+    check(c.str() == b.str(), "frequency map read from a fifo");
+    hashmap proc;
+    buildFrequencyMap("/proc/self/status", true, proc);
+    check(proc.keys().size() > 10, "frequency map of a /proc file that reports no size");
+    remove("histogram.fifo");
+    remove("histogram.bin");
+}
+
+// reads fd to its end on another thread, slowly, into out
+static thread drainInto(int fd, vector<uint8_t>& out) {
+    return thread([fd, &out] {
+        uint8_t buf[1 << 15];
+        ssize_t n;
+        int reads = 0;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            out.insert(out.end(), buf, buf + n);
+            if (++reads % 16 == 0) this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        close(fd);
+    });
+}
+
+//
+// decompressStream() gives the same bytes to a file, a pipe and a socket,
+// from a mapped file or a pipe, across stored, Huffman and checksum records
+// and more than one chunk of output.
+//
+static void testDecompressToFd() {
+    vector<uint8_t> raw;
+    srand(48);
+    for (int i = 0; i < 1300000; i++) raw.push_back((uint8_t)rand());
+    for (int i = 0; i < 1700000; i++) raw.push_back((uint8_t)"to be or not to be\n"[rand() % 19]);
+    for (int i = 0; i < 500000; i++) raw.push_back((uint8_t)rand());
+    ofstream("fd.bin", ios::binary).write((const char*)raw.data(), raw.size());
+    PipelineOptions opt;
+    opt.checksums = true;
+    check(compressFile("fd.bin", "fd.bin.huf", opt), "compress for fd output");
+
+    check(decompressFile("fd.bin.huf", "fd_unc.bin") && readAll("fd_unc.bin") == raw,
+          "decompress to a file");
+
+    int in = open("fd.bin.huf", O_RDONLY);
+    int p[2];
+    check(pipe(p) == 0, "pipe");
+    vector<uint8_t> piped;
+    thread reader = drainInto(p[0], piped);
+    {
+        FdWriter probe(p[1]);
+        check(probe.splicing(), "pipes are spliced into");
+    }
+    bool ok = decompressStream(in, p[1], threadContext());
+    close(p[1]);
+    reader.join();
+    check(ok && piped == raw, "decompress spliced into a pipe");
+
+    int s[2];
+    check(socketpair(AF_UNIX, SOCK_STREAM, 0, s) == 0, "socketpair");
+    vector<uint8_t> sent;
+    reader = drainInto(s[0], sent);
+    ok = decompressStream(in, s[1], threadContext());
+    close(s[1]);
+    reader.join();
+    check(ok && sent == raw, "decompress into a socket");
+    close(in);
+
+    // a pipe in, where stored blocks have to be read like the rest
+    vector<uint8_t> packed = readAll("fd.bin.huf");
+    check(pipe(p) == 0, "pipe");
+    thread writer([&packed, &p] {
+        _writeAll(p[1], packed.data(), packed.size());
+        close(p[1]);
+    });
+    int out = open("fd_unc.bin", O_WRONLY | O_TRUNC);
+    ok = decompressStream(p[0], out, threadContext());
+    writer.join();
+    close(p[0]);
+    close(out);
+    check(ok && readAll("fd_unc.bin") == raw, "decompress from a pipe");
+
+    // a bad checksum fails, and decompressFile leaves nothing behind
+    packed[packed.size() - 1] ^= 1;
+    ofstream("fd.bin.huf", ios::binary).write((const char*)packed.data(), packed.size());
+    remove("fd_unc.bin");
+    check(!decompressFile("fd.bin.huf", "fd_unc.bin") &&
+              threadContext().decodeError() == DECODE_BAD_CHECKSUM && !ifstream("fd_unc.bin"),
+          "bad checksum stops decompress to a file");
+
+    // nor does a corrupt file lying next to the original touch the original
+    _writeFile("fd.bin.huf", vector<uint8_t>(packed.begin(), packed.begin() + 20));
+    check(!decompressFile("fd.bin.huf", "fd.bin") && readAll("fd.bin") == raw,
+          "failed decompress keeps the existing output file");
+    vector<string> left = listDirectory(".", false);
+    bool clean = true;
+    for (size_t i = 0; i < left.size(); i++) clean = clean && left[i].find("/fd.bin.") == string::npos;
+    check(clean, "failed decompress leaves no temporary file");
+    remove("fd.bin");
+    remove("fd.bin.huf");
+}
+
+//
+// hashmaps and mymaps round trip through the binary form, malformed or
+// unsorted bytes are rejected, and a view reads a mapped file in place.
+//
+static void testSerialization() {
+    hashmap freqs;
+    freqs.put(-3, 1);
+    freqs.put(256, 1);
+    for (int c = 'a'; c <= 'z'; c++) freqs.put(c, c * 1000);
+    vector<uint8_t> bytes;
+    serializeMap(freqs, bytes);
+    size_t pos = 0;
+    hashmap back;
+    ostringstream before, after;
+    before << freqs;
+    check(deserializeMap(bytes.data(), bytes.size(), pos, back) && pos == bytes.size(),
+          "hashmap deserializes");
+    after << back;
+    check(after.str() == before.str(), "hashmap round trips in binary");
+
+    mymap<string, int> names;
+    mymap<uint32_t, uint64_t> offsets;
+    for (int i = 0; i < 1000; i++) {
+        names.put("file" + to_string(i * 7919 % 1000), i);
+        offsets.put(i * 2654435761u, (uint64_t)i << 40);
+    }
+    vector<uint8_t> both;
+    serializeMap(names, both);
+    serializeMap(offsets, both);
+    mymap<string, int> names2;
+    mymap<uint32_t, uint64_t> offsets2;
+    pos = 0;
+    check(deserializeMap(both.data(), both.size(), pos, names2) &&
+              deserializeMap(both.data(), both.size(), pos, offsets2) && pos == both.size(),
+          "mymaps deserialize back to back");
+    check(names2.toVector() == names.toVector() && offsets2.toVector() == offsets.toVector(),
+          "mymap round trips in binary");
+
+    // every truncation and a wrong kind or a bad count are rejected
+    bool rejected = true;
+    for (size_t n = 0; n < bytes.size(); n++) {
+        hashmap partial;
+        pos = 0;
+        rejected = rejected && !deserializeMap(bytes.data(), n, pos, partial);
+    }
+    mymap<int, int> wrongKind;
+    pos = 0;
+    rejected = rejected && !deserializeMap(bytes.data(), bytes.size(), pos, wrongKind);
+    vector<uint8_t> bad = bytes;
+    bad[4]++;
+    pos = 0;
+    rejected = rejected && !deserializeMap(bad.data(), bad.size(), pos, back);
+    // counts and lengths are 64-bit, so a count 2^32 too high does not wrap
+    bad = bytes;
+    bad[8]++;
+    pos = 0;
+    rejected = rejected && !deserializeMap(bad.data(), bad.size(), pos, back);
+    vector<uint8_t> wide;
+    serializeMap(offsets, wide);
+    pos = 0;
+    SerializedView<uint16_t, uint64_t> narrowView;
+    rejected = rejected && !narrowView.open(wide.data(), wide.size(), pos);
+    check(rejected, "malformed serialized maps are rejected");
+    mymap<int, int> pair;
+    pair.put(1, 10);
+    pair.put(2, 20);
+    vector<uint8_t> swapped;
+    serializeMap(pair, swapped);
+    swap_ranges(swapped.begin() + SERIAL_HEADER_SIZE, swapped.begin() + SERIAL_HEADER_SIZE + 2,
+                swapped.begin() + SERIAL_HEADER_SIZE + 2);
+    SerializedView<int, int> pairView;
+    pos = 0;
+    check(swapped.size() == SERIAL_HEADER_SIZE + 4 &&
+              !pairView.open(swapped.data(), swapped.size(), pos),
+          "serialized view rejects a mymap out of order");
+
+    // a view reads the entries in place from the mapped file
+    {
+        ofstream out("offsets.bin", ios::binary);
+        out.write((const char*)wide.data(), wide.size());
+    }
+    MappedFile file;
+    SerializedView<uint32_t, uint64_t> view;
+    pos = 0;
+    check(file.open("offsets.bin") && view.open(file.data(), file.size(), pos) &&
+              view.size() == (uint64_t)offsets.Size() && view.isSorted(),
+          "serialized view opens a mapped file");
+    uint64_t value = 0;
+    bool found = view.find(7 * 2654435761u, value) && value == (uint64_t)7 << 40 &&
+                 !view.find(1, value);
+    size_t seen = 0;
+    bool ordered = true;
+    uint32_t last = 0;
+    view.forEach([&](uint32_t k, uint64_t v) {
+        ordered = ordered && (seen == 0 || k > last) && offsets.get(k) == v;
+        last = k;
+        seen++;
+    });
+    check(found && ordered && seen == (size_t)offsets.Size(), "serialized view lookups");
+    file.close();
+    remove("offsets.bin");
+}
+
+//
+// In rotate mode mymap stays weight-balanced for sorted and random inserts,
+// and holds the same entries as the rebuilding mode.
+//
+static void testMymapRotations() {
+    // ascending, descending and random keys all stay weight-balanced
+    for (int order = 0; order < 3; order++) {
+        mymap<int, int> m(BALANCE_ROTATE), rebuilt;
+        map<int, int> ref;
+        srand(5);
+        for (int i = 0; i < 20000; i++) {
+            int k = (order == 0) ? i : (order == 1) ? -i : rand() % 50000;
+            m.put(k, i);
+            rebuilt.put(k, i);
+            ref[k] = i;
+        }
+        string what = "mymap rotations, order " + to_string(order);
+        vector<pair<int, int> > want(ref.begin(), ref.end());
+        check(m.isBalanced() && m.Size() == (int)ref.size(), what + " balanced");
+        check(rebuilt.isBalanced(), what + " rebuilt counts");
+        check(m.toVector() == want && m.toVector() == rebuilt.toVector(), what + " contents");
+        vector<int> back;
+        for (mymap<int, int>::iterator it = m.end(); it != m.begin();) back.push_back(*--it);
+        check(back.size() == ref.size() && back.front() == ref.rbegin()->first, what + " backwards");
+        mymap<int, int> copy = m;
+        check(copy.balanceMode() == BALANCE_ROTATE && copy.isBalanced() &&
+                  copy.checkBalance() == m.checkBalance(),
+              what + " copy");
+    }
+    mymap<int, int> small, rotated(BALANCE_ROTATE);
+    for (int k = 1; k <= 4; k++) {
+        if (k <= 3) small.put(k, 10 * k);
+        rotated.put(k, 10 * k);
+    }
+    check(small.checkBalance() == "key: 2, nL: 1, nR: 1\nkey: 1, nL: 0, nR: 0\nkey: 3, nL: 0, nR: 0\n",
+          "mymap rebuild, three keys");
+    check(rotated.checkBalance() == "key: 2, nL: 1, nR: 2\nkey: 1, nL: 0, nR: 0\n"
+                                    "key: 3, nL: 0, nR: 1\nkey: 4, nL: 0, nR: 0\n",
+          "mymap rotations, four keys");
+}
+
+//
+// BitWriter and BitReader agree with the packing kernels, and the string bit
+// streams read and write bits and bytes, directly or through the base
+// classes.
+//
+static void testBitIO() {
+    // BitWriter agrees with the packing kernels
+    HuffmanContext ctx;
+    vector<uint8_t> raw, packed, bits;
+    for (int i = 0; i < 5000; i++) raw.push_back((uint8_t)("mississippi river"[i % 17]));
+    ctx.countSymbols(raw.data(), raw.size());
+    ctx.buildTree();
+    ctx.buildCodes();
+    ctx.encode(raw.data(), raw.size(), packed);
+    BitWriter writer(bits);
+    for (size_t i = 0; i < raw.size(); i++) writer.writeBits(ctx.codeOf(raw[i]), ctx.codeLength(raw[i]));
+    writer.writeBits(ctx.codeOf(PSEUDO_EOF), ctx.codeLength(PSEUDO_EOF));
+    check(bits == packed, "BitWriter matches encode");
+
+    BitReader reader(bits);
+    uint64_t v;
+    bool ok = true;
+    for (size_t i = 0; i < raw.size() && ok; i++) {
+        int len = ctx.codeLength(raw[i]);
+        ok = reader.readBits(len, v) && v == ctx.codeOf(raw[i]);
+    }
+    check(ok, "BitReader reads the codes back");
+    size_t left = 8 * bits.size() - reader.bitPosition();
+    check(!reader.readBits((int)left + 1, v) && reader.readBits((int)left, v) && reader.atEnd() &&
+              reader.readBit() == EOF,
+          "BitReader end");
+
+    // the string streams: bits, bytes between them, size and EOF
+    ostringbitstream out;
+    out.writeBit(1);
+    out.writeBit(0);
+    out.writeBit(1);
+    out << "xy";
+    out.writeBits(0x1ff, 9);
+    check(out.str() == string("\x05xy\xff\x01", 5) && out.size() == 5, "ostringbitstream bytes");
+    ostringbitstream fake;
+    fake.setFake(true);
+    fake.writeBits(6, 3);
+    check(fake.str() == "011", "ostringbitstream fake mode");
+
+    istringbitstream in(out.str());
+    string got;
+    for (int i = 0; i < 3; i++) got += (char)('0' + in.readBit());
+    got += (char)in.get();
+    got += (char)in.get();
+    for (int i = 0; i < 9; i++) got += (char)('0' + in.readBit());
+    check(got == "101xy111111111" && in.size() == 5, "istringbitstream bits and bytes");
+    for (int i = 0; i < 7; i++) in.readBit();
+    check(in.readBit() == EOF && in.fail(), "istringbitstream EOF");
+    in.rewind();
+    check(in.readBit() == 1 && in.readBit() == 0 && in.readBit() == 1, "istringbitstream rewind");
+
+    // through base references the base class versions work on the same buffers
+    ostringbitstream viaBase;
+    obitstream& base = viaBase;
+    base.writeBit(1);
+    base.writeBit(0);
+    base.writeBit(1);
+    base << "xy";
+    for (int i = 0; i < 9; i++) base.writeBit(1);
+    check(viaBase.str() == out.str() && base.size() == 5, "ostringbitstream as an obitstream");
+    base.setFake(true);
+    viaBase.writeBit(1);
+    check(viaBase.str() == out.str() + "1", "ostringbitstream shares fake mode");
+    istringbitstream inBase(out.str());
+    ibitstream& ibase = inBase;
+    got.clear();
+    for (int i = 0; i < 3; i++) got += (char)('0' + ibase.readBit());
+    got += (char)ibase.get();
+    got += (char)ibase.get();
+    for (int i = 0; i < 9; i++) got += (char)('0' + ibase.readBit());
+    check(got == "101xy111111111" && ibase.size() == 5, "istringbitstream as an ibitstream");
+}
+
+//
+// Every packing kernel writes the same bits as packing one bit at a time, for
+// codes up to the longest each kernel takes and beyond.
+//
+static void testPackKernels() {
+    // Fibonacci counts (PSEUDO_EOF being the first 1) build a tree with one
+    // leaf per level, so k symbols make a k-bit code: 14 and 24 are the
+    // longest for merging four codes and for the vector kernel, 28 for pairs
+    int nSymbols[] = {0, 14, 15, 24, 25, 28, 29, 42};
+    for (int k : nSymbols) {
+        HuffmanContext ctx;
+        vector<uint8_t> raw(100003);
+        srand(7 + k);
+        if (k == 0) {
+            for (size_t i = 0; i < raw.size(); i++) raw[i] = (uint8_t)(rand() % (1 + i % 256));
+            ctx.countSymbols(raw.data(), raw.size());
+        } else {
+            hashmap freq;
+            int a = 1, b = 2;
+            for (int sym = 0; sym < k; sym++) {
+                freq.put(sym, a);
+                int next = a + b;
+                a = b;
+                b = next;
+            }
+            freq.put(PSEUDO_EOF, 1);
+            ctx.setHistogram(freq);
+            for (size_t i = 0; i < raw.size(); i++) raw[i] = (uint8_t)(rand() % k);
+        }
+        ctx.buildTree();
+        ctx.buildCodes();
+        check(k == 0 || ctx.maxCodeLength() == k, "code length for " + to_string(k) + " symbols");
+
+        size_t lens[] = {0, 1, 7, 9, 65537, raw.size()};
+        PackKernel kernels[] = {PACK_SCALAR, PACK_AVX2};
+        for (size_t len : lens) {
+            vector<uint8_t> expected(3, 0xAA), fromContext(3, 0xAA);
+            vector<uint8_t> bits = packOneBitAtATime(raw, len, ctx);
+            expected.insert(expected.end(), bits.begin(), bits.end());
+            ctx.encode(raw.data(), len, fromContext);
+            check(fromContext == expected, "encode " + to_string(len) + " of " + to_string(k));
+            for (PackKernel kernel : kernels) {
+                vector<uint8_t> out(3, 0xAA);
+                packCodes(raw.data(), len, ctx.codeTable(), out, kernel);
+                check(out == expected, "pack kernel " + to_string(kernel) + ", " +
+                                           to_string(len) + " of " + to_string(k));
+            }
+        }
+    }
+}
+
+//
+// Text large enough to amortize a table is coded as four streams, which
+// decode back at every length, including ones too short to fill them all.
+// Short blocks use one stream; text needs only the byte-wide table and the
+// skewed histogram the full one, so every decoder instantiation runs.
+//
+static void testStreamBlocks() {
+    vector<uint8_t> raw(200000), packed, unpacked;
+    srand(8);
+    for (size_t i = 0; i < raw.size(); i++) raw[i] = (uint8_t)("abracadabra, said the wizard\n"[rand() % 29]);
+    compressBuffer(raw.data(), raw.size(), packed);
+    check(packed[0] == TAG_STREAMS, "text is coded as four streams");
+    check(decompressBuffer(packed.data(), packed.size(), unpacked) && unpacked == raw,
+          "four stream round trip");
+    check(!decompressBuffer(packed.data(), packed.size() - 1, unpacked), "truncated streams rejected");
+
+    HuffmanContext ctx;
+    size_t lens[] = {2, 3, 4, 5, 7, 8, 17, 33, 1000, 4095, 4096, 4099, 65537};
+    for (size_t n : lens) {
+        vector<uint8_t> block;
+        ctx.countSymbols(raw.data(), n);
+        size_t size = ctx.planStreams(raw.data(), n);
+        ctx.encodeStreams(raw.data(), n, block);
+        check(size == block.size(), "planStreams size " + to_string(n));
+        check(block[1 + varintSize(n)] == (n < MULTI_STREAM_MIN ? 1 : STREAM_COUNT),
+              "stream count of " + to_string(n));
+        size_t pos = 0;
+        unpacked.assign(1, '@');
+        check(ctx.decodeStreams(block.data(), block.size(), pos, unpacked) &&
+              pos == block.size() && unpacked.size() == n + 1 &&
+              equal(raw.begin(), raw.begin() + n, unpacked.begin() + 1),
+              "four stream block of " + to_string(n));
+    }
+
+    // a 255-symbol skewed histogram has to be flattened to fit the length limit
+    for (size_t i = 0; i < raw.size(); i++) raw[i] = (uint8_t)(i % 7 ? 'e' : i % 255);
+    ctx.countSymbols(raw.data(), raw.size());
+    vector<uint8_t> block;
+    ctx.planStreams(raw.data(), raw.size());
+    ctx.encodeStreams(raw.data(), raw.size(), block);
+    size_t pos = 0;
+    unpacked.clear();
+    check(ctx.decodeStreams(block.data(), block.size(), pos, unpacked) && unpacked == raw,
+          "length-limited four stream round trip");
+
+    // only one or four streams, and lengths that form a complete code
+    size_t header = 1 + varintSize(raw.size());
+    block[header] = 2;
+    pos = 0;
+    check(!ctx.decodeStreams(block.data(), block.size(), pos, unpacked), "bad stream count rejected");
+    block[header] = STREAM_COUNT;
+    block[header + 2] = 0x11;
+    pos = 0;
+    check(!ctx.decodeStreams(block.data(), block.size(), pos, unpacked), "bad code lengths rejected");
+}
+
+//
+// The multi-symbol table decodes the same bytes as the single one, for one
+// and four streams, lengths around a round's worth of symbols and codes of
+// every length.  decode() picks it for long text with short codes.
+//
+static void testMultiSymbolDecode() {
+    const char* log = "GET /index.html 200\nGET /favicon.ico 404\nPOST /login 302\n";
+    vector<uint8_t> raw(300000);
+    srand(47);
+    for (size_t i = 0; i < raw.size(); i++)
+        raw[i] = (uint8_t)(i % 50 == 49 ? rand() : log[rand() % strlen(log)]);
+    size_t lens[] = {2, 21, 100, 4095, 4096, 4096 * 4 + 77, 65537, raw.size()};
+    DecodeTableMode modes[] = {TABLE_SINGLE, TABLE_MULTI, TABLE_AUTO};
+    bool same = true, autoMulti = false;
+    for (size_t n : lens) {
+        uint64_t counts[256] = {0};
+        for (size_t i = 0; i < n; i++) counts[raw[i]]++;
+        MultiStreamCoder coder;
+        if (coder.plan(counts, raw.data(), n) == 0) continue;
+        vector<uint8_t> block;
+        coder.encode(raw.data(), n, block);
+        for (DecodeTableMode mode : modes) {
+            MultiStreamCoder decoder;
+            decoder.setTableMode(mode);
+            vector<uint8_t> out(1, '@');
+            size_t pos = 0;
+            same = same && decoder.decode(block.data(), block.size(), pos, out) &&
+                   pos == block.size() && out.size() == n + 1 &&
+                   equal(raw.begin(), raw.begin() + n, out.begin() + 1) &&
+                   (mode == TABLE_AUTO || decoder.usedMultiTable() == (mode == TABLE_MULTI));
+            if (mode == TABLE_AUTO && n == raw.size()) autoMulti = decoder.usedMultiTable();
+        }
+    }
+    check(same, "multi-symbol decode matches single-symbol decode");
+    check(autoMulti, "multi-symbol table chosen for log text");
+
+    // long codes leave it off, and every code is still decoded
+    uint64_t counts[256];
+    for (int i = 0; i < 256; i++) counts[i] = 100 + i % 3 * 50;
+    for (size_t i = 0; i < raw.size(); i++) raw[i] = (uint8_t)(i * 131);
+    MultiStreamCoder coder;
+    vector<uint8_t> block, out;
+    coder.plan(counts, raw.data(), raw.size());
+    coder.encode(raw.data(), raw.size(), block);
+    size_t pos = 0;
+    bool autoOk = coder.decode(block.data(), block.size(), pos, out) && out == raw && !coder.usedMultiTable();
+    coder.setTableMode(TABLE_MULTI);
+    pos = 0;
+    out.clear();
+    check(autoOk && coder.decode(block.data(), block.size(), pos, out) && out == raw,
+          "multi-symbol decode of long codes");
+}
+
+//
+// Counts past what an int holds, Fibonacci-sized so an unscaled tree would
+// be as deep as it gets, are scaled down the same way by buildEncodingTree()
+// and by a context, before and after a trip through the header.
+//
+static void testWideCounts() {
+    hashmap freq;
+    long long a = 1, b = 1;
+    for (int ch = 'A'; ch < 'A' + 60; ch++) {
+        freq.put(ch, a);
+        long long next = a + b;
+        a = b;
+        b = next;
+    }
+    freq.put(PSEUDO_EOF, 1);
+    check(freq.get('A' + 59) > 4294967296LL, "counts are wider than 32 bits");
+
+    HuffmanNode* root = buildEncodingTree(freq);
+    mymap<int, string> codes = buildEncodingMap(root);
+    freeTree(root);
+
+    HuffmanContext ctx;
+    check(ctx.setHistogram(freq), "64-bit histogram loaded");
+    ctx.buildTree();
+    ctx.buildCodes();
+    check(ctx.maxCodeLength() <= 45, "scaled codes stay under 46 bits");
+
+    vector<uint8_t> header;
+    ctx.writeHeader(header);
+    HuffmanContext read;
+    size_t pos = 0;
+    check(read.readHeader(header.data(), header.size(), pos) && pos == header.size(),
+          "64-bit header read back");
+    read.buildTree();
+    read.buildCodes();
+
+    bool same = true;
+    vector<int> keys = freq.keys();
+    for (size_t i = 0; i < keys.size(); i++) {
+        int sym = (keys[i] == PSEUDO_EOF) ? PSEUDO_EOF : (uint8_t)keys[i];
+        string code = codes.get(keys[i]);
+        same = same && read.count(sym) == (uint64_t)freq.get(keys[i]) &&
+               ctx.codeLength(sym) == (int)code.size() && read.codeOf(sym) == ctx.codeOf(sym);
+        for (size_t j = 0; j < code.size(); j++)
+            same = same && (int)((ctx.codeOf(sym) >> j) & 1) == code[j] - '0';
+    }
+    check(same, "scaled tree is the same everywhere");
+}
+
+//
+// Short text gets a quantized header, which reads back as counts adding up
+// to QUANT_TOTAL for exactly the symbols used, stays about the same size
+// however long the input, and costs the codes little.
+//
+static void testQuantizedHeader() {
+    const char* log = "GET /index.html 200\nGET /favicon.ico 404\nPOST /login 302\n";
+    vector<uint8_t> raw(100), packed, unpacked;
+    srand(50);
+    for (size_t i = 0; i < raw.size(); i++) raw[i] = (uint8_t)"abracadabra"[rand() % 11];
+    compressBuffer(raw.data(), raw.size(), packed);
+    check(packed[0] == TAG_QUANTIZED, "short text gets a quantized header");
+    check(decompressBuffer(packed.data(), packed.size(), unpacked) && unpacked == raw,
+          "quantized round trip");
+    for (size_t cut = 1; cut < packed.size(); cut += 7) {
+        check(decodeErrorOf(string(packed.begin(), packed.begin() + cut)) == DECODE_TRUNCATED,
+              "cut quantized block " + to_string(cut));
+    }
+
+    HuffmanContext ctx, read;
+    ctx.countSymbols(raw.data(), raw.size());
+    ctx.quantize();
+    vector<uint8_t> header;
+    ctx.writeQuantized(raw.size(), header);
+    check(header.size() == ctx.quantizedHeaderSize(raw.size()), "quantizedHeaderSize matches");
+    size_t pos = 0;
+    uint64_t n = 0, total = 0;
+    bool same = read.readQuantized(header.data(), header.size(), pos, n) &&
+                pos == header.size() && n == raw.size();
+    for (int sym = 0; sym < NUM_SYMBOLS; sym++) {
+        same = same && (read.count(sym) != 0) == (ctx.count(sym) != 0);
+        total += read.count(sym);
+    }
+    check(same && total == QUANT_TOTAL, "quantized counts read back");
+
+    // the same text ten thousand times over, where "{k:v}" grows
+    size_t text = ctx.headerSize();
+    vector<uint8_t> more;
+    for (int r = 0; r < 10000; r++) more.insert(more.end(), raw.begin(), raw.end());
+    ctx.countSymbols(more.data(), more.size());
+    ctx.quantize();
+    check(ctx.quantizedHeaderSize(more.size()) <= header.size() + 4 && ctx.headerSize() > text + 10,
+          "quantized header does not grow with the input");
+
+    // log lines with a stray byte of any value every 50
+    raw.resize(1 << 20);
+    for (size_t i = 0; i < raw.size(); i++)
+        raw[i] = (uint8_t)(i % 50 == 49 ? rand() : log[rand() % strlen(log)]);
+    ctx.countSymbols(raw.data(), raw.size());
+    ctx.buildTree();
+    ctx.buildCodes();
+    long long exact = ctx.codedBits();
+    ctx.quantize();
+    check(ctx.codedBits() < exact + exact / 1000, "quantizing costs the codes under 0.1%");
+
+    check(decodeErrorOf("\x86\x01\xff\x3f") == DECODE_BAD_HEADER, "quantized count above the total");
+    check(decodeErrorOf(string("\x86\x01\x00\x00\x00\x00", 6)) == DECODE_BAD_HEADER,
+          "run of zeros too long");
+}
+
+#ifdef HUF_HUGE_TEST
+//
+// A sparse file past 4 GiB, with text on both sides of the 4 GiB mark,
+// compresses and decompresses end to end in bounded memory.  Only built by
+// "make test-huge", since it reads and writes a few GiB.
+//
+static void testHugeFile() {
+    const long long size = 9LL << 29;  // 4.5 GiB
+    const long long spots[] = {0, 1LL << 31, (1LL << 32) - 10, (1LL << 32) + 12345, size - 100};
+    string text = "sparse but not empty: the quick brown fox jumps over the lazy dog.\n";
+    int fd = open("huge.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    bool made = fd >= 0 && ftruncate(fd, size) == 0;
+    for (long long at : spots)
+        made = made && pwrite(fd, text.data(), min((long long)text.size(), size - at), at) > 0;
+
+    // what the file should decode to, read a block at a time
+    uint32_t want = 0;
+    vector<uint8_t> buf(DEFAULT_BLOCK_SIZE);
+    for (long long at = 0; made && at < size;) {
+        ssize_t n = pread(fd, buf.data(), buf.size(), at);
+        if (n <= 0) break;
+        want = crc32c(buf.data(), n, want);
+        at += n;
+    }
+    if (fd >= 0) close(fd);
+    check(made, "huge file made");
+
+    PipelineOptions opt;
+    opt.checksums = true;
+    check(compressFile("huge.bin", "huge.bin.huf", opt), "huge file compressed");
+
+    int fds[2];
+    check(pipe(fds) == 0, "pipe");
+    uint32_t got = 0;
+    long long length = 0;
+    thread reader([&] {
+        vector<uint8_t> chunk(1 << 16);
+        ssize_t n;
+        while ((n = read(fds[0], chunk.data(), chunk.size())) > 0) {
+            got = crc32c(chunk.data(), n, got);
+            length += n;
+        }
+        close(fds[0]);
+    });
+    int in = open("huge.bin.huf", O_RDONLY);
+    HuffmanContext ctx;
+    bool ok = in >= 0 && decompressStream(in, fds[1], ctx);
+    close(fds[1]);
+    reader.join();
+    if (in >= 0) close(in);
+    check(ok && length == size && got == want, "huge file round trip");
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    check(usage.ru_maxrss < 256 * 1024, "huge file used " + to_string(usage.ru_maxrss / 1024) + " MiB");
+
+    // last, since counting maps the whole file
+    hashmap freq;
+    buildFrequencyMap("huge.bin", true, freq);
+    check(freq.get(0) > 4294967296LL, "byte counts past 32 bits");
+    remove("huge.bin");
+    remove("huge.bin.huf");
+}
+#endif
 
 int main() {
     /*
     hashmap h;
-    
+
     buildFrequencyMap("medium.txt", true, h);
 
     HuffmanNode * root = buildEncodingTree(h);
@@ -19,11 +1442,11 @@ int main() {
     for(auto e : code) {
         cout << (char)e.first << " " << e.second << endl;
     }
-    
+
     ifstream in("medium.txt");
     ofbitstream out("out.huf");
-    int size = 0;
-    
+    long long size = 0;
+
     string encoded = encode(in, code, out, size, true);
 
     ifbitstream ifasd("out.huf");
@@ -31,7 +1454,44 @@ int main() {
     cout << endl;
     cout << decode(ifasd, root, asdfhj);
     */
-    compress("secretmessage.txt");
-    decompress("secretmessage.txt.huf");
-    
-}
\ No newline at end of file
+    // a copy of test.txt, so the tracked test.txt.huf is left alone
+    _writeFile("driver.txt", readAll("test.txt"));
+    compress("driver.txt");
+    decompress("driver.txt.huf");
+
+    testBufferMatchesFiles("driver.txt");
+    testBufferRoundTrip();
+    testContextDoesNotAllocate();
+    testDictionary();
+    testStoredAndRunBlocks();
+    testStreamFromPipe();
+    testPipeline();
+    testBatch();
+    testArchive();
+    testPackKernels();
+    testStreamBlocks();
+    testChecksums();
+    testMalformedInput();
+    testStats();
+    testProbe();
+    testBitIO();
+    testMymapIteration();
+    testMymapRotations();
+    testSnapshotMap();
+    testSerialization();
+    testParallelHistogram();
+    testMultiSymbolDecode();
+    testDecompressToFd();
+    testWideCounts();
+    testQuantizedHeader();
+#ifdef HUF_HUGE_TEST
+    testHugeFile();
+#endif
+
+    remove("driver.txt");
+    remove("driver.txt.huf");
+    remove("driver_unc.txt");
+    if (failures != 0) return 1;
+    cout << "all tests passed" << endl;
+    return 0;
+}
@@ -11,56 +11,42 @@
 #include <vector>      // std::vector
 #include <functional>  // std::greater
 #include <string>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "bitstream.h"
 #include "hashmap.h"
 #include "mymap.h"
+#include "huffman.h"
+#include "buffer.h"
+#include "stream.h"
+#include "pipeline.h"
+#include "histogram.h"
 #pragma once
 
-struct HuffmanNode {
-  int character;
-  int count;
-  HuffmanNode* zero;
-  HuffmanNode* one;
-};
-
-class Compare {
- public:
-  bool operator()(HuffmanNode* x, HuffmanNode* y) {
-    return x->count > y->count;
-  }
-};
-
-//
-// *This method frees the memory allocated for the Huffman tree.
-//
-void freeTree(HuffmanNode* node) {
-  if (node == nullptr) return;
-
-  freeTree(node->zero);
-  freeTree(node->one);
-  free(node);
-}
-
 //
 // *This function build the frequency map.  If isFile is true, then it reads
 // from filename.  If isFile is false, then it reads from a string filename.
 //
 void buildFrequencyMap(string filename, bool isFile, hashmap& map) {
-  ifstream in;
-  char ch;
   if (isFile) {
-    in.open(filename);
-    in.get(ch);
-    while (!in.eof()) {
-      if (map.containsKey((int)ch))
-        map.put(ch, map.get(ch) + 1);
+    // counted on every core; adding in first-seen order keeps keys() in the
+    // order the byte-at-a-time loop this replaced produced
+    // a file that cannot be read counts as empty, as it always has
+    ByteHistogram h;
+    if (!histogramFile(filename, h)) h.clear();
+    for (int i = 0; i < h.nOrder; i++) {
+      int ch = (int)(char)h.order[i];
+      long long count = (long long)h.counts[h.order[i]];
+      if (map.containsKey(ch))
+        map.put(ch, map.get(ch) + count);
       else
-        map.put(ch, 1);
-      in.get(ch);
+        map.put(ch, count);
     }
     map.put(256, 1);
   } else {
-    for (int i = 0; i < filename.size(); i++) {
+    for (size_t i = 0; i < filename.size(); i++) {
       if (map.containsKey(filename[i]))
         map.put(filename[i], map.get(filename[i]) + 1);
       else
@@ -71,15 +57,34 @@ void buildFrequencyMap(string filename, bool isFile, hashmap& map) {
 }
 
 //
-// *This function builds an encoding tree from the frequency map.
+// *This function trains a shared dictionary table by running
+// buildFrequencyMap() over every sample file into one map.  Bytes the samples
+// never use are given a count of 1 so every message can still be coded.
+//
+void trainDictionary(const vector<string>& files, hashmap& map) {
+  for (size_t i = 0; i < files.size(); i++) {
+    buildFrequencyMap(files[i], true, map);
+  }
+  for (int ch = -128; ch < 128; ch++) {
+    if (!map.containsKey(ch)) map.put(ch, 1);
+  }
+  map.put(PSEUDO_EOF, 1);
+}
+
+//
+// *This function builds an encoding tree from the frequency map.  Counts too
+// big for an int between them are scaled down first (see treeWeightShift()).
 //
 HuffmanNode* buildEncodingTree(hashmap& map) {
   priority_queue<HuffmanNode*, vector<HuffmanNode*>, Compare> pq;
   vector<int> chars = map.keys();
+  unsigned long long total = 0;
+  for (size_t i = 0; i < chars.size(); i++) total += map.get(chars[i]);
+  int shift = treeWeightShift(total, (int)chars.size());
   for (int i = 0; i < chars.size(); i++) {
     HuffmanNode* temp = new HuffmanNode;
     temp->character = chars[i];
-    temp->count = map.get(chars[i]);
+    temp->count = treeWeight(map.get(chars[i]), shift);
     temp->zero = nullptr;
     temp->one = nullptr;
     pq.push(temp);
@@ -136,7 +141,7 @@ mymap<int, string> buildEncodingMap(HuffmanNode* tree) {
 // the output file, which is particularly useful for testing.
 //
 string encode(ifstream& input, mymap<int, string>& encodingMap,
-              ofbitstream& output, int& size, bool makeFile) {
+              ofbitstream& output, long long& size, bool makeFile) {
   char ch;
   string str = "";
   int bit;
@@ -150,7 +155,7 @@ string encode(ifstream& input, mymap<int, string>& encodingMap,
   str += encodingMap[PSEUDO_EOF];
   size = str.length();
 
-  for (int i = 0; i < str.length(); i++) {
+  for (size_t i = 0; i < str.length(); i++) {
     bit = str[i] - 48;
     output.writeBit(bit);
   }
@@ -160,14 +165,6 @@ string encode(ifstream& input, mymap<int, string>& encodingMap,
   return str;
 }
 
-bool isLeaf(HuffmanNode* node) {
-  if (node->zero == nullptr && node->one == nullptr) {
-    return true;
-  } else {
-    return false;
-  }
-}
-
 //
 // *This function decodes the input stream and writes the result to the output
 // stream using the encodingTree.  This function also returns a string
@@ -179,15 +176,15 @@ string decode(ifbitstream& input, HuffmanNode* encodingTree, ofstream& output) {
   int bit = 0;
   HuffmanNode* cur = encodingTree;
 
-  if (!output) {
+  if (!output || encodingTree == nullptr) {
     return str;
   }
   while (bit != -1) {
     bit = input.readBit();
-    if (bit == 0)
-      cur = cur->zero;
-    else if (bit == 1)
-      cur = cur->one;
+    if (bit == -1) break;
+    // a tree that is one leaf has no children to move to: every bit is that
+    // leaf, as buildEncodingMap() codes it
+    if (!isLeaf(encodingTree)) cur = (bit == 1) ? cur->one : cur->zero;
 
     if (isLeaf(cur)) {
       curChar = (char)cur->character;
@@ -205,6 +202,26 @@ string decode(ifbitstream& input, HuffmanNode* encodingTree, ofstream& output) {
   return str;
 }
 
+//
+// Reads the whole file into buf, reusing its storage.  Returns false if the
+// file cannot be opened.
+//
+bool _readFile(const string& filename, vector<uint8_t>& buf) {
+  ifstream in(filename, ios::binary);
+  if (!in) return false;
+  in.seekg(0, ios::end);
+  buf.resize((size_t)in.tellg());
+  in.seekg(0, ios::beg);
+  in.read((char*)buf.data(), buf.size());
+  return (size_t)in.gcount() == buf.size();
+}
+
+bool _writeFile(const string& filename, const vector<uint8_t>& buf) {
+  ofstream out(filename, ios::binary);
+  out.write((const char*)buf.data(), buf.size());
+  return (bool)out;
+}
+
 //
 // *This function completes the entire compression process.  Given a file,
 // filename, this function (1) builds a frequency map; (2) builds an encoding
@@ -213,20 +230,20 @@ string decode(ifbitstream& input, HuffmanNode* encodingTree, ofstream& output) {
 // should create a compressed file named (filename + ".huf") and should also
 // return a string version of the bit pattern.
 //
+// The file is read once, a block at a time, and each block is counted, coded
+// and encoded from the same buffer in the calling thread's HuffmanContext.
+//
 string compress(string filename) {
-  hashmap h;
-  stringstream ss;
-  string ifname = filename;
+  string str;
+  int fdIn = open(filename.c_str(), O_RDONLY);
+  if (fdIn < 0) return str;
   string ofname = filename + ".huf";
-  buildFrequencyMap(ifname, true, h);
-  HuffmanNode* root = buildEncodingTree(h);
-  mymap<int, string> encoded;
-  encoded = buildEncodingMap(root);
-  int size = 0;
-  ifstream in(ifname);
-  ofbitstream out(ofname);
-  out << h;
-  string str = encode(in, encoded, out, size, true);
+  int fdOut = open(ofname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fdOut >= 0) {
+    compressStream(fdIn, fdOut, threadContext(), DEFAULT_BLOCK_SIZE, &str);
+    close(fdOut);
+  }
+  close(fdIn);
   return str;
 }
 
@@ -242,20 +259,53 @@ string compress(string filename) {
 // function did.
 //
 string decompress(string filename) {
-  string ifname = filename;
   string ofname = filename.substr(0, filename.length() - 8) + "_unc.txt";
-  hashmap h;
-  ifstream inFile(filename);
-  inFile >> h;
-  HuffmanNode* root = buildEncodingTree(h);
-  inFile.close();
-  ifbitstream in(ifname);
-  ofstream out(ofname);
+  HuffmanContext& ctx = threadContext();
+  vector<uint8_t>& packed = ctx.inputBuffer();
+  vector<uint8_t>& raw = ctx.outputBuffer();
+  if (!_readFile(filename, packed)) return "";
+  decompressBuffer(packed.data(), packed.size(), raw, ctx);
+  _writeFile(ofname, raw);
+  return string(raw.begin(), raw.end());
+}
 
-  char dummy = '\0';  // dummy character to detect when header is over
-  in.get(dummy);      // skipping until after header
-  while (dummy != '}') {
-    in.get(dummy);
-  }
-  return decode(in, root, out);
+//
+// *This function compresses the file ifname into ofname with the parallel
+// pipeline, overlapping reads, coding and writes.  The result is the same
+// file compress() would write, without the bit string it returns.
+//
+bool compressFile(const string& ifname, const string& ofname,
+                  const PipelineOptions& opt = PipelineOptions()) {
+  int fdIn = open(ifname.c_str(), O_RDONLY);
+  if (fdIn < 0) return false;
+  int fdOut = open(ofname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fdOut >= 0 && compressPipeline(fdIn, fdOut, opt);
+  if (fdOut >= 0) close(fdOut);
+  close(fdIn);
+  return ok;
+}
+
+//
+// *This function decompresses the file ifname into ofname without building
+// the returned string decompress() does, through decompressStream(): stored
+// blocks are copied straight from one file to the other by the kernel and
+// everything else is decoded a chunk at a time through the calling thread's
+// context.  The output goes to a temporary file next to ofname, renamed over
+// it only once everything has decoded, so if ifname is missing or malformed
+// this returns false and leaves ofname as it was.
+//
+bool decompressFile(const string& ifname, const string& ofname) {
+  int fdIn = open(ifname.c_str(), O_RDONLY);
+  if (fdIn < 0) return false;
+  vector<char> tmp(ofname.begin(), ofname.end());
+  const char suffix[] = ".XXXXXX";
+  tmp.insert(tmp.end(), suffix, suffix + sizeof(suffix));
+  int fdOut = mkstemp(tmp.data());
+  bool ok = fdOut >= 0 && fchmod(fdOut, 0644) == 0 &&
+            decompressStream(fdIn, fdOut, threadContext());
+  if (fdOut >= 0) ok = (close(fdOut) == 0) && ok;
+  close(fdIn);
+  if (ok) ok = rename(tmp.data(), ofname.c_str()) == 0;
+  if (!ok && fdOut >= 0) unlink(tmp.data());
+  return ok;
 }